@@ -42,11 +42,13 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 //Level2
 #include "Search.h"
+#include "VerletList.h"
 #include "Kernels.h"
 #include "Operators.h"
 #include "Preconditioners.h"
 #include "FastMultipoleMethod.h"
 #include "H2Matrix.h"
+#include "HMatrix.h"
 
 //Level3
 #include "Symbolic.h"
@@ -145,7 +145,8 @@ public:
 private:
     bool set_domain_impl() {
         const size_t n = this->m_particles_end - this->m_particles_begin;
-        if (n < 0.5*m_size_calculated_with_n || n > 2*m_size_calculated_with_n) {
+        if (n < 0.5*m_size_calculated_with_n || n > 2*m_size_calculated_with_n
+                || this->m_morton_order != m_point_to_bucket_index.m_bucket_index.m_morton) {
             m_size_calculated_with_n = n;
             LOG(2,"bucket_search_serial: recalculating bucket size");
             if (this->m_n_particles_in_leaf > n) {
@@ -163,9 +164,15 @@ private:
                     }
                 }
             }
+            if (this->m_morton_order) {
+                for (int i=0; i<Traits::dimension; ++i) {
+                    m_size[i] = detail::round_down_to_power_of_two(m_size[i]);
+                }
+            }
             m_bucket_side_length = (this->m_bounds.bmax-this->m_bounds.bmin)/m_size;
             m_point_to_bucket_index = 
-                detail::point_to_bucket_index<Traits::dimension>(m_size,m_bucket_side_length,this->m_bounds);
+                detail::point_to_bucket_index<Traits::dimension>(m_size,m_bucket_side_length,this->m_bounds,
+                                                                this->m_morton_order);
 
             LOG(2,"\tbucket side length = "<<m_bucket_side_length);
             LOG(2,"\tnumber of buckets = "<<m_size<<" (total="<<m_size.prod()<<")");
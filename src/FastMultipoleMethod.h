@@ -62,6 +62,8 @@ protected:
     typedef typename traits_type::position position;
     static const unsigned int dimension = traits_type::dimension;
     typedef detail::bbox<dimension> box_type;
+    typedef detail::m2l_cache<Expansions,
+                detail::m2l_dense_operator<Expansions::ncheb>> m2l_cache_type;
 
     mutable storage_type m_W;
     mutable storage_type m_g;
@@ -70,17 +72,90 @@ protected:
     const NeighbourQuery *m_query;
     const ColParticles* m_col_particles;
     Expansions m_expansions;
+    m2l_cache_type m_m2l_cache;
+    // subtrees below this depth are swept serially within a single task
+    size_t m_task_depth;
 
     FastMultipoleMethodBase(const ColParticles &col_particles, 
-                        const Expansions& expansions):
+                        const Expansions& expansions,
+                        const bool cache_m2l):
         m_query(&col_particles.get_query()),
         m_expansions(expansions),
-        m_col_particles(&col_particles)
-    {}
+        m_col_particles(&col_particles),
+        m_m2l_cache(m_query->get_bounds(),cache_m2l)
+    {
+        // spawn tasks only for the top levels of the tree, enough to keep 
+        // every thread busy. Below this the task overhead is larger than 
+        // the work in each subtree
+#ifdef HAVE_OPENMP
+        m_task_depth = detail::task_depth(*m_query,8*omp_get_max_threads());
+#else
+        m_task_depth = 0;
+#endif
+        // precalculate M2L operators for every unique box offset
+        for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
+            generate_m2l_cache(child_iterator_vector_type(),ci);
+        }
+        LOG(2,"FastMultipoleMethod: cached "<<m_m2l_cache.number_of_keys()<<" M2L operators");
+    }
+
+    // mirrors the connectivity calculation in calculate_dive_M2L_and_L2L
+    void generate_m2l_cache(
+            const child_iterator_vector_type& connected_buckets_parent,
+            const child_iterator& ci) {
+        const box_type& target_box = m_query->get_bounds(ci);
+        child_iterator_vector_type connected_buckets;
+        detail::theta_condition<dimension> theta(target_box.bmin,target_box.bmax);
+
+        if (connected_buckets_parent.empty()) {
+            for (child_iterator cj = m_query->get_children(); cj != false; ++cj) {
+                const box_type& source_box = m_query->get_bounds(cj);
+                if (theta.check(source_box.bmin,source_box.bmax)) {
+                    connected_buckets.push_back(cj);
+                } else {
+                    m_m2l_cache.find_or_create(target_box,source_box,m_expansions);
+                }
+            }
+        } else {
+            for (const child_iterator& source: connected_buckets_parent) {
+                if (m_query->is_leaf_node(*source)) {
+                    connected_buckets.push_back(source);
+                } else {
+                    for (child_iterator cj = m_query->get_children(source); cj != false; ++cj) {
+                        const box_type& source_box = m_query->get_bounds(cj);
+                        if (theta.check(source_box.bmin,source_box.bmax)) {
+                            connected_buckets.push_back(cj);
+                        } else {
+                            m_m2l_cache.find_or_create(target_box,source_box,m_expansions);
+                        }
+                    }
+                }
+            }
+        }
+        if (!m_query->is_leaf_node(*ci)) { 
+            for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                generate_m2l_cache(connected_buckets,cj);
+            }
+        }
+    }
+
+    // use cached M2L operator if available
+    void M2L(expansion_type& accum,
+             const box_type& target_box, 
+             const box_type& source_box, 
+             const expansion_type& source) const {
+        const size_t index = m_m2l_cache.find(target_box,source_box);
+        if (index != m2l_cache_type::npos) {
+            m_m2l_cache[index].apply(accum,source);
+        } else {
+            m_expansions.M2L(accum,target_box,source_box,source);
+        }
+    }
 
     template <typename VectorType>
     expansion_type& calculate_dive_P2M_and_M2M(const child_iterator& ci, 
-                                               const VectorType& source_vector) const {
+                                               const VectorType& source_vector,
+                                               const size_t depth=0) const {
         const size_t my_index = m_query->get_bucket_index(*ci);
         const box_type& my_box = m_query->get_bounds(ci);
         LOG(3,"calculate_dive_P2M_and_M2M with bucket "<<my_box);
@@ -91,15 +166,60 @@ protected:
                     m_query->get_bucket_particles(*ci),
                     source_vector,m_query->get_particles_begin(),m_expansions);
         } else { 
+            // each child subtree is independent, so dive into them in 
+            // parallel. The M2M accumulation is done afterwards in child 
+            // order so the result does not depend on the number of threads
+            if (depth < m_task_depth) {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    #pragma omp task default(shared) firstprivate(cj)
+                    calculate_dive_P2M_and_M2M(cj,source_vector,depth+1);
+                }
+                #pragma omp taskwait
+            } else {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    calculate_dive_P2M_and_M2M(cj,source_vector,depth+1);
+                }
+            }
             for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
-                expansion_type& child_W = calculate_dive_P2M_and_M2M(cj,source_vector);
+                const size_t child_index = m_query->get_bucket_index(*cj);
                 const box_type& child_box = m_query->get_bounds(cj);
-                m_expansions.M2M(W,my_box,child_box,child_W);
+                m_expansions.M2M(W,my_box,child_box,m_W[child_index]);
             }
         }
         return W;
     }
 
+    // upward sweep of tree, spawns a task for each subtree
+    template <typename VectorType>
+    void upward_sweep(const VectorType& source_vector) const {
+        #pragma omp parallel
+        #pragma omp single
+        {
+            for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
+                #pragma omp task default(shared) firstprivate(ci)
+                calculate_dive_P2M_and_M2M(ci,source_vector);
+            }
+        }
+    }
+
+    // downward sweep of tree, spawns a task for each target bucket
+    template <typename VectorTypeTarget, typename VectorTypeSource>
+    void downward_sweep(VectorTypeTarget& target_vector, 
+                        const VectorTypeSource& source_vector) const {
+        #pragma omp parallel
+        #pragma omp single
+        {
+            for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
+                #pragma omp task default(shared) firstprivate(ci)
+                {
+                    child_iterator_vector_type dummy;
+                    expansion_type g = {};
+                    calculate_dive_M2L_and_L2L(target_vector,dummy,g,box_type(),ci,source_vector);
+                }
+            }
+        }
+    }
+
     template <typename VectorTypeTarget, typename VectorTypeSource>
     void calculate_dive_M2L_and_L2L(
             VectorTypeTarget& target_vector,
@@ -107,7 +227,8 @@ protected:
             const expansion_type& g_parent, 
             const box_type& box_parent, 
             const child_iterator& ci,
-            const VectorTypeSource& source_vector) const {
+            const VectorTypeSource& source_vector,
+            const size_t depth=0) const {
         const box_type& target_box = m_query->get_bounds(ci);
         LOG(3,"calculate_dive_M2L_and_L2L with bucket "<<target_box);
         size_t target_index = m_query->get_bucket_index(*ci);
@@ -126,7 +247,7 @@ protected:
                     connected_buckets.push_back(cj);
                 } else {
                     size_t source_index = m_query->get_bucket_index(*cj);
-                    m_expansions.M2L(g,target_box,source_box,m_W[source_index]);
+                    M2L(g,target_box,source_box,m_W[source_index]);
                 }
             }
         } else {
@@ -145,42 +266,77 @@ protected:
                             connected_buckets.push_back(cj);
                         } else {
                             size_t source_index = m_query->get_bucket_index(*cj);
-                            m_expansions.M2L(g,target_box,source_box,m_W[source_index]);
+                            M2L(g,target_box,source_box,m_W[source_index]);
                         }
                     }
                 }
             }
         }
         if (!m_query->is_leaf_node(*ci)) { // leaf node
-            for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
-                calculate_dive_M2L_and_L2L(target_vector,connected_buckets,g
-                                            ,target_box,cj,source_vector);
+            // children only read this bucket's expansion and connectivity,
+            // and write to disjoint target particles, so can run in parallel
+            if (depth < m_task_depth) {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    #pragma omp task default(shared) firstprivate(cj)
+                    calculate_dive_M2L_and_L2L(target_vector,connected_buckets,g
+                                                ,target_box,cj,source_vector,depth+1);
+                }
+                #pragma omp taskwait
+            } else {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    calculate_dive_M2L_and_L2L(target_vector,connected_buckets,g
+                                                ,target_box,cj,source_vector,depth+1);
+                }
             }
         } else if (target_vector.size() > 0) {
             detail::calculate_L2P(target_vector,g,target_box,
                     m_query->get_bucket_particles(*ci),
                     m_query->get_particles_begin(),m_expansions);
 
+            // reused for each source bucket
+            detail::p2p_source_tile<dimension> tile;
             for (child_iterator& cj: connected_buckets) { 
                 if (m_query->is_leaf_node(*cj)) {
                     LOG(3,"calculate_P2P: target = "<<target_box<<" source = "<<m_query->get_bounds(cj));
                     detail::calculate_P2P(target_vector,source_vector,
                         m_query->get_bucket_particles(*ci),m_query->get_bucket_particles(*cj),
                         m_query->get_particles_begin(),m_query->get_particles_begin(),
-                        m_expansions);
+                        m_expansions,tile);
                 } else {
                     for (reference ref_j: m_query->get_subtree(cj)) {
                         if (m_query->is_leaf_node(ref_j)) {
                             detail::calculate_P2P(target_vector,source_vector,
                                 m_query->get_bucket_particles(*ci),m_query->get_bucket_particles(ref_j),
                                 m_query->get_particles_begin(),m_query->get_particles_begin(),
-                                m_expansions);
+                                m_expansions,tile);
                         }
                     }
                 }
             }
         }
     }
+
+public:
+    /// sets the depth of the tree below which subtrees are swept serially, 
+    /// rather than as separate OpenMP tasks. By default this is the first 
+    /// level of the tree with at least 8 nodes per thread
+    void set_task_depth(const size_t depth) {
+        m_task_depth = depth;
+    }
+
+    // returns the memory used by the cached M2L operators and the 
+    // expansions, and the number of strong and weak interactions on each 
+    // level of the tree. All the other operators are applied on the fly
+    fast_method_statistics get_statistics() const {
+        fast_method_statistics stats;
+        const size_t n = m_col_particles->size();
+        const size_t ncheb = Expansions::ncheb;
+        stats.m2l_bytes = m_m2l_cache.size()*ncheb*ncheb*sizeof(double);
+        stats.expansion_bytes = 2*m_query->number_of_buckets()*sizeof(expansion_type);
+        stats.dense_bytes = n*n*sizeof(double);
+        detail::count_interactions(*m_query,stats);
+        return stats;
+    }
 };
 
 template <typename Expansions, typename ColParticles,
@@ -198,8 +354,9 @@ class FastMultipoleMethod: public FastMultipoleMethodBase<Expansions,ColParticle
     static const unsigned int dimension = base_type::dimension;
 public:
     FastMultipoleMethod(const ColParticles &col_particles, 
-                        const Expansions& expansions):
-        base_type(col_particles,expansions)
+                        const Expansions& expansions,
+                        const bool cache_m2l=true):
+        base_type(col_particles,expansions,cache_m2l)
     {}
 
     // target_vector += A*source_vector
@@ -215,26 +372,17 @@ public:
 
         // upward sweep of tree
         //
-        for (child_iterator ci = this->m_query->get_children(); ci != false; ++ci) {
-            this->calculate_dive_P2M_and_M2M(ci,source_vector);
-        }
+        this->upward_sweep(source_vector);
 
         // downward sweep of tree. 
         //
         if (&row_particles == this->m_col_particles) {
-            for (child_iterator ci = this->m_query->get_children(); ci != false; ++ci) {
-                child_iterator_vector_type dummy;
-                expansion_type g = {};
-                this->calculate_dive_M2L_and_L2L(target_vector,dummy,g,box_type(),ci,source_vector);
-            }
+            this->downward_sweep(target_vector,source_vector);
         } else {
-            for (child_iterator ci = this->m_query->get_children(); ci != false; ++ci) {
-                child_iterator_vector_type dummy;
-                std::vector<double> dummy2;
-                expansion_type g = {};
-                this->calculate_dive_M2L_and_L2L(dummy2,dummy,g,box_type(),ci,source_vector);
-            }
+            std::vector<double> dummy;
+            this->downward_sweep(dummy,source_vector);
 
+            #pragma omp parallel for
             for (int i = 0; i < row_particles.size(); ++i) {
                 const double_d& p = get<position>(row_particles)[i];
                 pointer bucket;
@@ -282,8 +430,9 @@ public:
     template <typename VectorType>
     FastMultipoleMethodWithSource(const ColParticles& col_particles, 
                         const Expansions& expansions,
-                        const VectorType& source_vector):
-        base_type(col_particles,expansions)
+                        const VectorType& source_vector,
+                        const bool cache_m2l=true):
+        base_type(col_particles,expansions,cache_m2l)
     {
         const size_t n = this->m_query->number_of_buckets();
         this->m_W.resize(n);
@@ -292,18 +441,12 @@ public:
 
         // upward sweep of tree
         //
-        for (child_iterator ci = this->m_query->get_children(); ci != false; ++ci) {
-            this->calculate_dive_P2M_and_M2M(ci,source_vector);
-        }
+        this->upward_sweep(source_vector);
 
         // downward sweep of tree.
         //
-        for (child_iterator ci = this->m_query->get_children(); ci != false; ++ci) {
-            child_iterator_vector_type dummy;
-            VectorType dummy2;
-            expansion_type g = {};
-            this->calculate_dive_M2L_and_L2L(dummy2,dummy,g,box_type(),ci,source_vector);
-        }
+        VectorType dummy;
+        this->downward_sweep(dummy,source_vector);
     }
 
 
@@ -344,16 +487,18 @@ detail::BlackBoxExpansions<D,N,Function> make_black_box_expansion(const Function
 
 template <typename Expansions, typename ColParticles>
 FastMultipoleMethod<Expansions,ColParticles>
-make_fmm(const ColParticles &col_particles, const Expansions& expansions) {
-    return FastMultipoleMethod<Expansions,ColParticles>(col_particles,expansions);
+make_fmm(const ColParticles &col_particles, const Expansions& expansions,
+         const bool cache_m2l=true) {
+    return FastMultipoleMethod<Expansions,ColParticles>(col_particles,expansions,cache_m2l);
 }
 
 template <typename Expansions, typename ColParticles, typename VectorType>
 FastMultipoleMethodWithSource<Expansions,ColParticles>
 make_fmm_with_source(const ColParticles &col_particles, 
                      const Expansions& expansions, 
-                     const VectorType& source_vector) {
-    return FastMultipoleMethodWithSource<Expansions,ColParticles>(col_particles,expansions,source_vector);
+                     const VectorType& source_vector,
+                     const bool cache_m2l=true) {
+    return FastMultipoleMethodWithSource<Expansions,ColParticles>(col_particles,expansions,source_vector,cache_m2l);
 }
 
 }
@@ -37,6 +37,7 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define H2_MATRIX_H_
 
 #include "detail/FastMultipoleMethod.h"
+#include <set>
 
 namespace Aboria {
 
@@ -62,17 +63,35 @@ class H2Matrix {
     typedef typename Expansions::l2p_matrix_type l2p_matrix_type;
     typedef typename Expansions::p2m_matrix_type p2m_matrix_type;
     typedef typename Expansions::p2p_matrix_type p2p_matrix_type;
+    typedef typename Expansions::p2p_map_type p2p_map_type;
+    typedef typename Expansions::const_p2p_map_type const_p2p_map_type;
     typedef typename Expansions::l2l_matrix_type l2l_matrix_type;
     typedef typename Expansions::m2l_matrix_type m2l_matrix_type;
     typedef typename traits_type::template vector_type<p_vector_type>::type p_vectors_type;
     typedef typename traits_type::template vector_type<m_vector_type>::type m_vectors_type;
+    // block versions of the p and m vectors, used for multiple right hand sides
+    typedef p2p_matrix_type p_block_type;
+    typedef p2m_matrix_type m_block_type;
+    typedef typename traits_type::template vector_type<p_block_type>::type p_blocks_type;
+    typedef typename traits_type::template vector_type<m_block_type>::type m_blocks_type;
     typedef typename traits_type::template vector_type<l2p_matrix_type>::type l2p_matrices_type;
     typedef typename traits_type::template vector_type<p2m_matrix_type>::type p2m_matrices_type;
-    typedef typename traits_type::template vector_type<p2p_matrix_type>::type p2p_matrices_type;
-    typedef typename traits_type::template vector_type<p2p_matrices_type>::type vector_of_p2p_matrices_type;
     typedef typename traits_type::template vector_type<l2l_matrix_type>::type l2l_matrices_type;
-    typedef typename traits_type::template vector_type<m2l_matrix_type>::type m2l_matrices_type;
-    typedef typename traits_type::template vector_type<m2l_matrices_type>::type vector_of_m2l_matrices_type;
+    typedef detail::m2l_cache<Expansions,m2l_matrix_type> m2l_cache_type;
+    // single precision versions of the leaf (P2M, L2P and P2P) matrices and
+    // the particle vectors, used if the matrix is created with 
+    // single_precision = true
+    typedef typename Expansions::p2m_float_matrix_type p2m_float_matrix_type;
+    typedef typename Expansions::l2p_float_matrix_type l2p_float_matrix_type;
+    typedef typename Expansions::p2p_float_matrix_type p2p_float_matrix_type;
+    typedef typename Expansions::p2p_float_map_type p2p_float_map_type;
+    typedef typename Expansions::const_p2p_float_map_type const_p2p_float_map_type;
+    typedef typename Expansions::p_float_vector_type p_float_vector_type;
+    typedef p2p_float_matrix_type p_float_block_type;
+    typedef typename traits_type::template vector_type<p2m_float_matrix_type>::type p2m_float_matrices_type;
+    typedef typename traits_type::template vector_type<l2p_float_matrix_type>::type l2p_float_matrices_type;
+    typedef typename traits_type::template vector_type<p_float_vector_type>::type p_float_vectors_type;
+    typedef typename traits_type::template vector_type<p_float_block_type>::type p_float_blocks_type;
     typedef typename traits_type::template vector_type<size_t>::type indices_type;
     typedef typename traits_type::template vector_type<indices_type>::type vector_of_indices_type;
 
@@ -85,31 +104,66 @@ class H2Matrix {
     mutable m_vectors_type m_g;
     mutable p_vectors_type m_source_vector;
     mutable p_vectors_type m_target_vector;
+    mutable m_blocks_type m_W_block;
+    mutable m_blocks_type m_g_block;
+    mutable p_blocks_type m_source_block;
+    mutable p_blocks_type m_target_block;
+    mutable p_float_vectors_type m_source_float_vector;
+    mutable p_float_blocks_type m_source_float_block;
 
     l2p_matrices_type m_l2p_matrices;
     p2m_matrices_type m_p2m_matrices;
     l2l_matrices_type m_l2l_matrices;
-    vector_of_p2p_matrices_type m_p2p_matrices;
-    vector_of_m2l_matrices_type m_m2l_matrices;
+    // all the P2P matrices are stored column-major in a single buffer, 
+    // m_p2p_offsets[i][j] is the start of the matrix between leaf i and its
+    // j-th strongly connected leaf. Leafs are laid out in tree order, so 
+    // the multiply streams through the buffer
+    std::vector<double> m_p2p_storage;
+    vector_of_indices_type m_p2p_offsets;
+    // if m_single_precision is true only the float versions of the P2M, L2P
+    // and P2P matrices are stored
+    bool m_single_precision;
+    p2m_float_matrices_type m_p2m_float_matrices;
+    l2p_float_matrices_type m_l2p_float_matrices;
+    std::vector<float> m_p2p_float_storage;
+    m2l_cache_type m_m2l_matrices;
+    vector_of_indices_type m_m2l_indices;
     vector_of_indices_type m_row_indices;
     vector_of_indices_type m_col_indices;
 
     connectivity_type m_strong_connectivity; 
     connectivity_type m_weak_connectivity; 
 
+    // leaf buckets, in tree order
+    child_iterator_vector_type m_leaves;
+
     Expansions m_expansions;
 
     const Query* m_query;
     const ColParticles* m_col_particles;
+    // subtrees below this depth are swept serially within a single task
+    size_t m_task_depth;
 
 public:
 
+    /// If \p single_precision is true the leaf matrices (P2M, L2P and P2P),
+    /// which hold most of the memory, are stored in single precision and 
+    /// multiplied by single precision copies of the particle vectors. The 
+    /// upper levels of the tree still use double precision
     template <typename RowParticles>
-    H2Matrix(const RowParticles &row_particles, const ColParticles &col_particles, const Expansions& expansions):
+    H2Matrix(const RowParticles &row_particles, const ColParticles &col_particles, const Expansions& expansions,
+             const bool cache_m2l=true, const bool single_precision=false):
+        m_single_precision(single_precision),
         m_query(&col_particles.get_query()),
         m_expansions(expansions),
         m_col_particles(&col_particles)
     {
+        // spawn tasks only for the top levels of the tree, as for the fmm
+#ifdef HAVE_OPENMP
+        m_task_depth = detail::task_depth(*m_query,8*omp_get_max_threads());
+#else
+        m_task_depth = 0;
+#endif
         //generate h2 matrix 
         const size_t n = m_query->number_of_buckets();
         LOG(2,"H2Matrix: creating matrix with "<<n<<" buckets, using "<<row_particles.size()<<" row particles and "<<col_particles.size()<<" column particles");
@@ -118,14 +172,23 @@ public:
         m_W.resize(n);
         m_g.resize(n);
         m_l2l_matrices.resize(n);
-        m_m2l_matrices.resize(n);
+        m_m2l_matrices = m2l_cache_type(m_query->get_bounds(),cache_m2l);
+        m_m2l_indices.resize(n);
         m_row_indices.resize(n);
         m_col_indices.resize(n);
         m_source_vector.resize(n);
         m_target_vector.resize(n);
+        m_W_block.resize(n);
+        m_g_block.resize(n);
+        m_source_block.resize(n);
+        m_target_block.resize(n);
         m_l2p_matrices.resize(n);
         m_p2m_matrices.resize(n);
-        m_p2p_matrices.resize(n);
+        m_p2p_offsets.resize(n);
+        m_source_float_vector.resize(n);
+        m_source_float_block.resize(n);
+        m_l2p_float_matrices.resize(n);
+        m_p2m_float_matrices.resize(n);
         m_strong_connectivity.resize(n);
         m_weak_connectivity.resize(n);
 
@@ -159,13 +222,22 @@ public:
             }
         }
 
-        // downward sweep of tree to generate matrices
+        // downward sweep of tree to generate connectivity, L2L and M2L 
+        // matrices
         LOG(2,"\tgenerating matrices...");
         for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
             const box_type& target_box = m_query->get_bounds(ci);
             generate_matrices(child_iterator_vector_type(),box_type(),ci,row_particles,col_particles);
         }
-        LOG(2,"\tdone");
+
+        // the leaf matrices only depend on the connectivity, and each leaf 
+        // writes to its own matrices, so they are generated in parallel
+        allocate_p2p_storage();
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < m_leaves.size(); ++i) {
+            generate_leaf_matrices(m_leaves[i],row_particles,col_particles);
+        }
+        LOG(2,"\tdone, created "<<m_m2l_matrices.size()<<" M2L matrices ("<<m_m2l_matrices.number_of_keys()<<" cached)");
     }
 
     H2Matrix(const H2Matrix& matrix) = default;
@@ -182,25 +254,37 @@ public:
         m_g(matrix.m_g.size()),
         m_source_vector(matrix.m_source_vector),
         //m_target_vector(matrix.m_target_vector), \\going to redo
+        m_W_block(matrix.m_W_block.size()),
+        m_g_block(matrix.m_g_block.size()),
+        m_source_block(matrix.m_source_block.size()),
+        m_target_block(matrix.m_target_block.size()),
+        m_source_float_vector(matrix.m_source_float_vector.size()),
+        m_source_float_block(matrix.m_source_float_block.size()),
         //m_l2p_matrices(matrix.m_l2p_matrices),     \\going to redo
         m_p2m_matrices(matrix.m_p2m_matrices),
         m_l2l_matrices(matrix.m_l2l_matrices),
-        //m_p2p_matrices(matrix.m_p2p_matrices), \\going to redo these
+        //m_p2p_storage(matrix.m_p2p_storage), \\going to redo these
+        m_single_precision(matrix.m_single_precision),
+        m_p2m_float_matrices(matrix.m_p2m_float_matrices),
         m_m2l_matrices(matrix.m_m2l_matrices),
+        m_m2l_indices(matrix.m_m2l_indices),
         //m_row_indices(matrix.m_row_indices), \\going to redo these
         m_col_indices(matrix.m_col_indices),
         m_strong_connectivity(matrix.m_strong_connectivity),
         m_weak_connectivity(matrix.m_weak_connectivity),
+        m_leaves(matrix.m_leaves),
         m_query(matrix.m_query),
         m_expansions(matrix.m_expansions),
-        m_col_particles(matrix.m_col_particles)
+        m_col_particles(matrix.m_col_particles),
+        m_task_depth(matrix.m_task_depth)
     {
         const size_t n = m_query->number_of_buckets();
         const bool row_equals_col = &row_particles == m_col_particles;
         m_target_vector.resize(n);
         m_row_indices.resize(n);
-        m_p2p_matrices.resize(n);
+        m_p2p_offsets.resize(n);
         m_l2p_matrices.resize(n);
+        m_l2p_float_matrices.resize(n);
 
         // setup row and column indices
         if (row_equals_col) {
@@ -220,9 +304,10 @@ public:
             m_target_vector[i].resize(m_row_indices[i].size());
         }
 
-        for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
-            const box_type& target_box = m_query->get_bounds(ci);
-            generate_row_matrices(ci,row_particles,*m_col_particles);
+        allocate_p2p_storage();
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < m_leaves.size(); ++i) {
+            generate_row_matrices(m_leaves[i],row_particles,*m_col_particles);
         }
     }
 
@@ -232,38 +317,166 @@ public:
                           const VectorTypeSource& source_vector) const {
 
         // for all leaf nodes setup source vector
-        for (auto& bucket: m_query->get_subtree()) {
-            if (m_query->is_leaf_node(bucket)) { // leaf node
-                const size_t index = m_query->get_bucket_index(bucket); 
+        #pragma omp parallel for
+        for (size_t l = 0; l < m_leaves.size(); ++l) {
+            const size_t index = m_query->get_bucket_index(*m_leaves[l]); 
+            if (m_single_precision) {
+                p_float_vector_type& source = m_source_float_vector[index];
+                source.resize(m_col_indices[index].size());
+                for (int i = 0; i < m_col_indices[index].size(); ++i) {
+                    source[i] = source_vector[m_col_indices[index][i]];
+                }
+            } else {
                 for (int i = 0; i < m_col_indices[index].size(); ++i) {
                     m_source_vector[index][i] = source_vector[m_col_indices[index][i]];
                 }
             }
         }
 
+        // upward sweep of tree, spawns a task for each subtree
+        #pragma omp parallel
+        #pragma omp single
+        {
+            for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
+                #pragma omp task default(shared) firstprivate(ci)
+                mvm_upward_sweep(ci);
+            }
+        }
+
+        // downward sweep of tree, spawns a task for each target bucket 
+        #pragma omp parallel
+        #pragma omp single
+        {
+            for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
+                #pragma omp task default(shared) firstprivate(ci)
+                {
+                    m_vector_type g = m_vector_type::Zero();
+                    mvm_downward_sweep(g,ci);
+                }
+            }
+        }
+
+        // for all leaf nodes copy to target vector. Each row belongs to 
+        // only one leaf, so there are no conflicting writes
+        #pragma omp parallel for
+        for (size_t l = 0; l < m_leaves.size(); ++l) {
+            const size_t index = m_query->get_bucket_index(*m_leaves[l]); 
+            for (int i = 0; i < m_row_indices[index].size(); ++i) {
+                target_vector[m_row_indices[index][i]] += m_target_vector[index][i];
+            }
+        }
+    }
+
+    // target_matrix += A*source_matrix, where each column of source_matrix 
+    // is a separate right hand side. The tree is traversed once for the 
+    // whole block, so all the M2M, M2L, L2L and P2P operators are applied as 
+    // matrix-matrix products
+    template <typename MatrixTypeTarget, typename MatrixTypeSource>
+    void matrix_matrix_multiply(MatrixTypeTarget& target_matrix, 
+                          const MatrixTypeSource& source_matrix) const {
+        const size_t nrhs = source_matrix.cols();
+        ASSERT(target_matrix.cols() == nrhs,"target and source matrices have different number of columns");
+
+        // for all leaf nodes setup source block
+        #pragma omp parallel for
+        for (size_t l = 0; l < m_leaves.size(); ++l) {
+            const size_t index = m_query->get_bucket_index(*m_leaves[l]); 
+            if (m_single_precision) {
+                p_float_block_type& source = m_source_float_block[index];
+                source.resize(m_col_indices[index].size(),nrhs);
+                for (int i = 0; i < m_col_indices[index].size(); ++i) {
+                    source.row(i) = source_matrix.row(m_col_indices[index][i]).template cast<float>();
+                }
+            } else {
+                p_block_type& source = m_source_block[index];
+                source.resize(m_col_indices[index].size(),nrhs);
+                for (int i = 0; i < m_col_indices[index].size(); ++i) {
+                    source.row(i) = source_matrix.row(m_col_indices[index][i]);
+                }
+            }
+        }
+
         // upward sweep of tree
-        for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
-            mvm_upward_sweep(ci);
+        #pragma omp parallel
+        #pragma omp single
+        {
+            for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
+                #pragma omp task default(shared) firstprivate(ci)
+                mmm_upward_sweep(ci,nrhs);
+            }
         }
 
         // downward sweep of tree. 
-        for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
-            m_vector_type g = m_vector_type::Zero();
-            mvm_downward_sweep(g,ci);
+        #pragma omp parallel
+        #pragma omp single
+        {
+            for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
+                #pragma omp task default(shared) firstprivate(ci)
+                {
+                    m_block_type g = m_block_type::Zero(m_vector_type::RowsAtCompileTime,nrhs);
+                    mmm_downward_sweep(g,ci);
+                }
+            }
         }
 
-        // for all leaf nodes copy to target vector
-        for (auto& bucket: m_query->get_subtree()) {
-            if (m_query->is_leaf_node(bucket)) { // leaf node
-                const size_t index = m_query->get_bucket_index(bucket); 
-                for (int i = 0; i < m_row_indices[index].size(); ++i) {
-                    target_vector[m_row_indices[index][i]] += m_target_vector[index][i];
-                }
+        // for all leaf nodes copy to target matrix
+        #pragma omp parallel for
+        for (size_t l = 0; l < m_leaves.size(); ++l) {
+            const size_t index = m_query->get_bucket_index(*m_leaves[l]); 
+            for (int i = 0; i < m_row_indices[index].size(); ++i) {
+                target_matrix.row(m_row_indices[index][i]) += m_target_block[index].row(i);
             }
         }
     }
 
+    // returns the memory used by each class of operator, and the number of
+    // strong and weak interactions on each level of the tree
+    /// sets the depth of the tree below which subtrees are swept serially, 
+    /// rather than as separate OpenMP tasks. By default this is the first 
+    /// level of the tree with at least 8 nodes per thread
+    void set_task_depth(const size_t depth) {
+        m_task_depth = depth;
+    }
+
+    fast_method_statistics get_statistics() const {
+        fast_method_statistics stats;
+        size_t nrows = 0;
+        for (const child_iterator& ci: m_leaves) {
+            const size_t index = m_query->get_bucket_index(*ci);
+            stats.p2m_bytes += m_p2m_matrices[index].size()*sizeof(double)
+                               + m_p2m_float_matrices[index].size()*sizeof(float);
+            stats.l2p_bytes += m_l2p_matrices[index].size()*sizeof(double)
+                               + m_l2p_float_matrices[index].size()*sizeof(float);
+            nrows += m_row_indices[index].size();
+        }
+        stats.p2p_bytes = m_p2p_storage.size()*sizeof(double)
+                          + m_p2p_float_storage.size()*sizeof(float)
+                          + m_p2p_offsets.size()*sizeof(indices_type);
+        for (const indices_type& offsets: m_p2p_offsets) {
+            stats.p2p_bytes += offsets.size()*sizeof(size_t);
+        }
+        stats.m2l_bytes = m_m2l_matrices.size()*sizeof(m2l_matrix_type);
+        stats.l2l_bytes = m_l2l_matrices.size()*sizeof(l2l_matrix_type);
+        stats.expansion_bytes = (m_W.size()+m_g.size())*sizeof(m_vector_type)
+                                + (m_col_particles->size()+nrows)*sizeof(double);
+        stats.dense_bytes = nrows*m_col_particles->size()*sizeof(double);
+        detail::count_interactions(*m_query,stats);
+        return stats;
+    }
+
 private:
+    // M2L matrices are shared between all box pairs with the same level and
+    // relative offset 
+    void add_m2l_matrix(const size_t target_index,
+                        const box_type& target_box, 
+                        const box_type& source_box) {
+        size_t index = m_m2l_matrices.find_or_create(target_box,source_box,m_expansions);
+        if (index == m2l_cache_type::npos) {
+            index = m_m2l_matrices.add(target_box,source_box,m_expansions);
+        }
+        m_m2l_indices[target_index].push_back(index);
+    }
+
     template <typename RowParticles>
     void generate_matrices(
             const child_iterator_vector_type& parents_strong_connections,
@@ -281,6 +494,9 @@ private:
 
         // add strongly connected buckets to current connectivity list
         if (parents_strong_connections.empty()) {
+            // no parent, so no transfer from parent
+            m_l2l_matrices[target_index] = l2l_matrix_type::Zero();
+
             for (child_iterator cj = m_query->get_children(); cj != false; ++cj) {
                 const box_type& source_box = m_query->get_bounds(cj);
                 if (theta.check(source_box.bmin,source_box.bmax)) {
@@ -289,11 +505,7 @@ private:
                 } else {
                     // from weakly connected buckets, 
                     // add connectivity and generate m2l matricies
-                    size_t source_index = m_query->get_bucket_index(*cj);
-                    m_m2l_matrices[target_index].emplace_back();
-                    m_expansions.M2L_matrix(
-                            *(m_m2l_matrices[target_index].end()-1)
-                            ,target_box,source_box);
+                    add_m2l_matrix(target_index,target_box,source_box);
                     m_weak_connectivity[target_index].push_back(cj);
 
                 }
@@ -312,11 +524,7 @@ private:
                         if (theta.check(source_box.bmin,source_box.bmax)) {
                             m_strong_connectivity[target_index].push_back(cj);
                         } else {
-                            size_t source_index = m_query->get_bucket_index(*cj);
-                            m_m2l_matrices[target_index].emplace_back();
-                            m_expansions.M2L_matrix(
-                                    *(m_m2l_matrices[target_index].end()-1)
-                                    ,target_box,source_box);
+                            add_m2l_matrix(target_index,target_box,source_box);
                             m_weak_connectivity[target_index].push_back(cj);
 
                         }
@@ -330,43 +538,107 @@ private:
                                     ,target_box,cj,row_particles,col_particles);
             }
         } else {
-            m_expansions.P2M_matrix(m_p2m_matrices[target_index], 
-                    target_box,
-                    m_col_indices[target_index],
-                    col_particles);
-            m_expansions.L2P_matrix(m_l2p_matrices[target_index], 
-                    target_box,
-                    m_row_indices[target_index],
-                    row_particles);
-
-            
+            // expand strongly connected buckets down to their leafs, the 
+            // P2M, L2P and P2P matrices are generated later in 
+            // generate_leaf_matrices
             child_iterator_vector_type strong_copy = m_strong_connectivity[target_index];
             m_strong_connectivity[target_index].clear();
             for (child_iterator& source: strong_copy) {
                 if (m_query->is_leaf_node(*source)) {
-                    m_p2p_matrices[target_index].emplace_back();
                     m_strong_connectivity[target_index].push_back(source);
-                    size_t source_index = m_query->get_bucket_index(*source);
-                    m_expansions.P2P_matrix(
-                            *(m_p2p_matrices[target_index].end()-1),
-                            m_row_indices[target_index],m_col_indices[source_index],
-                            row_particles,col_particles);
                 } else {
                     auto range = m_query->get_subtree(source);
                     for (all_iterator i = range.begin(); i!=range.end(); ++i) {
                         if (m_query->is_leaf_node(*i)) {
                             m_strong_connectivity[target_index].push_back(i.get_child_iterator());
-                            m_p2p_matrices[target_index].emplace_back();
-                            size_t index = m_query->get_bucket_index(*i);
-                            m_expansions.P2P_matrix(
-                                *(m_p2p_matrices[target_index].end()-1),
-                                m_row_indices[target_index],m_col_indices[index],
-                                row_particles,col_particles);
                         }
                     }
                 }
             }
+            m_leaves.push_back(ci);
+        }
+    }
+
+    // calculates the offsets of each P2P matrix and allocates the buffer 
+    // that holds them
+    void allocate_p2p_storage() {
+        size_t offset = 0;
+        size_t nblocks = 0;
+        for (const child_iterator& ci: m_leaves) {
+            const size_t target_index = m_query->get_bucket_index(*ci);
+            const size_t nrows = m_row_indices[target_index].size();
+            m_p2p_offsets[target_index].resize(m_strong_connectivity[target_index].size());
+            for (int i = 0; i < m_strong_connectivity[target_index].size(); ++i) {
+                const size_t source_index = 
+                    m_query->get_bucket_index(*m_strong_connectivity[target_index][i]);
+                m_p2p_offsets[target_index][i] = offset;
+                offset += nrows*m_col_indices[source_index].size();
+                ++nblocks;
+            }
+        }
+        if (m_single_precision) {
+            m_p2p_float_storage.resize(offset);
+            m_p2p_storage.clear();
+        } else {
+            m_p2p_storage.resize(offset);
+            m_p2p_float_storage.clear();
+        }
+        LOG(2,"\tallocated "<<offset*(m_single_precision?sizeof(float):sizeof(double))<<" bytes for "<<nblocks<<" P2P matrices");
+    }
+
+    p2p_map_type get_p2p_matrix(const size_t target_index, const size_t i) {
+        const size_t source_index = 
+            m_query->get_bucket_index(*m_strong_connectivity[target_index][i]);
+        return p2p_map_type(m_p2p_storage.data()+m_p2p_offsets[target_index][i],
+                            m_row_indices[target_index].size(),
+                            m_col_indices[source_index].size());
+    }
+
+    const_p2p_map_type get_p2p_matrix(const size_t target_index, const size_t i) const {
+        const size_t source_index = 
+            m_query->get_bucket_index(*m_strong_connectivity[target_index][i]);
+        return const_p2p_map_type(m_p2p_storage.data()+m_p2p_offsets[target_index][i],
+                            m_row_indices[target_index].size(),
+                            m_col_indices[source_index].size());
+    }
+
+    p2p_float_map_type get_p2p_float_matrix(const size_t target_index, const size_t i) {
+        const size_t source_index = 
+            m_query->get_bucket_index(*m_strong_connectivity[target_index][i]);
+        return p2p_float_map_type(m_p2p_float_storage.data()+m_p2p_offsets[target_index][i],
+                            m_row_indices[target_index].size(),
+                            m_col_indices[source_index].size());
+    }
+
+    const_p2p_float_map_type get_p2p_float_matrix(const size_t target_index, const size_t i) const {
+        const size_t source_index = 
+            m_query->get_bucket_index(*m_strong_connectivity[target_index][i]);
+        return const_p2p_float_map_type(m_p2p_float_storage.data()+m_p2p_offsets[target_index][i],
+                            m_row_indices[target_index].size(),
+                            m_col_indices[source_index].size());
+    }
+
+    template <typename RowParticles>
+    void generate_leaf_matrices(
+            const child_iterator& ci,
+            const RowParticles &row_particles,
+            const ColParticles &col_particles
+            ) {
+        const box_type& target_box = m_query->get_bounds(ci);
+        size_t target_index = m_query->get_bucket_index(*ci);
+        LOG(3,"generate_leaf_matrices with bucket "<<target_box);
+
+        m_expansions.P2M_matrix(m_p2m_matrices[target_index], 
+                target_box,
+                m_col_indices[target_index],
+                col_particles);
+        if (m_single_precision) {
+            m_p2m_float_matrices[target_index] = 
+                m_p2m_matrices[target_index].template cast<float>();
+            m_p2m_matrices[target_index] = p2m_matrix_type();
         }
+
+        generate_row_matrices(ci,row_particles,col_particles);
     }
 
     template <typename RowParticles>
@@ -379,44 +651,70 @@ private:
         const box_type& target_box = m_query->get_bounds(ci);
         size_t target_index = m_query->get_bucket_index(*ci);
         LOG(3,"generate_row_matrices with bucket "<<target_box);
+        ASSERT(m_query->is_leaf_node(*ci),"should be leaf node");
         
-        if (!m_query->is_leaf_node(*ci)) { // leaf node
-            for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
-                generate_row_matrices(cj,row_particles,col_particles);
-            }
-        } else {
-            m_expansions.L2P_matrix(m_l2p_matrices[target_index], 
-                    target_box,
-                    m_row_indices[target_index],
-                    row_particles);
-
-            for (child_iterator& source: m_strong_connectivity[target_index]) {
-                ASSERT(m_query->is_leaf_node(*source),"should be leaf node");
-                m_p2p_matrices[target_index].emplace_back();
-                size_t source_index = m_query->get_bucket_index(*source);
+        m_expansions.L2P_matrix(m_l2p_matrices[target_index], 
+                target_box,
+                m_row_indices[target_index],
+                row_particles);
+        if (m_single_precision) {
+            m_l2p_float_matrices[target_index] = 
+                m_l2p_matrices[target_index].template cast<float>();
+            m_l2p_matrices[target_index] = l2p_matrix_type();
+        }
+
+        for (int i = 0; i < m_strong_connectivity[target_index].size(); ++i) {
+            const child_iterator& source = m_strong_connectivity[target_index][i];
+            ASSERT(m_query->is_leaf_node(*source),"should be leaf node");
+            size_t source_index = m_query->get_bucket_index(*source);
+            if (m_single_precision) {
+                p2p_float_map_type p2p_matrix = get_p2p_float_matrix(target_index,i);
                 m_expansions.P2P_matrix(
-                        *(m_p2p_matrices[target_index].end()-1),
+                        p2p_matrix,
+                        m_row_indices[target_index],m_col_indices[source_index],
+                        row_particles,col_particles);
+            } else {
+                p2p_map_type p2p_matrix = get_p2p_matrix(target_index,i);
+                m_expansions.P2P_matrix(
+                        p2p_matrix,
                         m_row_indices[target_index],m_col_indices[source_index],
                         row_particles,col_particles);
-
             }
         }
     }
 
-    m_vector_type& mvm_upward_sweep(const child_iterator& ci) const {
+    m_vector_type& mvm_upward_sweep(const child_iterator& ci, 
+                                    const size_t depth=0) const {
         const size_t my_index = m_query->get_bucket_index(*ci);
         const box_type& target_box = m_query->get_bounds(ci);
         LOG(3,"calculate_dive_P2M_and_M2M with bucket "<<target_box);
         m_vector_type& W = m_W[my_index];
         if (m_query->is_leaf_node(*ci)) { // leaf node
-            W = m_p2m_matrices[my_index]*m_source_vector[my_index];
+            if (m_single_precision) {
+                W = (m_p2m_float_matrices[my_index]*m_source_float_vector[my_index])
+                        .template cast<double>();
+            } else {
+                W = m_p2m_matrices[my_index]*m_source_vector[my_index];
+            }
         } else { 
-            // do M2M 
+            // each child subtree is independent, so dive into them in 
+            // parallel. The M2M accumulation is done afterwards in child 
+            // order so the result does not depend on the number of threads
+            if (depth < m_task_depth) {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    #pragma omp task default(shared) firstprivate(cj)
+                    mvm_upward_sweep(cj,depth+1);
+                }
+                #pragma omp taskwait
+            } else {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    mvm_upward_sweep(cj,depth+1);
+                }
+            }
             W = m_vector_type::Zero();
             for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
                 const size_t child_index = m_query->get_bucket_index(*cj);
-                m_vector_type& child_W = mvm_upward_sweep(cj);
-                W += m_l2l_matrices[child_index].transpose()*child_W;
+                W += m_l2l_matrices[child_index].transpose()*m_W[child_index];
             }
         }
         return W;
@@ -424,7 +722,8 @@ private:
 
     void mvm_downward_sweep(
             const m_vector_type& g_parent, 
-            const child_iterator& ci) const {
+            const child_iterator& ci,
+            const size_t depth=0) const {
         const box_type& target_box = m_query->get_bounds(ci);
         LOG(3,"calculate_dive_M2L_and_L2L with bucket "<<target_box);
         size_t target_index = m_query->get_bucket_index(*ci);
@@ -437,13 +736,33 @@ private:
         for (int i = 0; i < m_weak_connectivity[target_index].size(); ++i) {
             const child_iterator& source_ci = m_weak_connectivity[target_index][i];
             size_t source_index = m_query->get_bucket_index(*source_ci);
-            g += m_m2l_matrices[target_index][i]*m_W[source_index];
+            g += m_m2l_matrices[m_m2l_indices[target_index][i]]*m_W[source_index];
         }
 
         if (!m_query->is_leaf_node(*ci)) { // dive down to next level
-            for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
-                mvm_downward_sweep(g,cj);
+            // children only read this bucket's expansion, and write to their
+            // own expansions and target vectors, so can run in parallel
+            if (depth < m_task_depth) {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    #pragma omp task default(shared) firstprivate(cj)
+                    mvm_downward_sweep(g,cj,depth+1);
+                }
+                #pragma omp taskwait
+            } else {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    mvm_downward_sweep(g,cj,depth+1);
+                }
             }
+        } else if (m_single_precision) {
+            p_float_vector_type target = 
+                m_l2p_float_matrices[target_index]*g.template cast<float>();
+            for (int i = 0; i < m_strong_connectivity[target_index].size(); ++i) {
+                const child_iterator& source_ci = m_strong_connectivity[target_index][i];
+                size_t source_index = m_query->get_bucket_index(*source_ci);
+                target.noalias() += 
+                        get_p2p_float_matrix(target_index,i)*m_source_float_vector[source_index];
+            }
+            m_target_vector[target_index] = target.template cast<double>();
         } else {
             m_target_vector[target_index] = m_l2p_matrices[target_index]*g;
 
@@ -452,20 +771,169 @@ private:
                 const child_iterator& source_ci = m_strong_connectivity[target_index][i];
                 size_t source_index = m_query->get_bucket_index(*source_ci);
                 m_target_vector[target_index] += 
-                        m_p2p_matrices[target_index][i]*m_source_vector[source_index];
+                        get_p2p_matrix(target_index,i)*m_source_vector[source_index];
             }
         }
 
     }
 
+    m_block_type& mmm_upward_sweep(const child_iterator& ci, const size_t nrhs,
+                                   const size_t depth=0) const {
+        const size_t my_index = m_query->get_bucket_index(*ci);
+        m_block_type& W = m_W_block[my_index];
+        if (m_query->is_leaf_node(*ci)) { // leaf node
+            if (m_single_precision) {
+                W = (m_p2m_float_matrices[my_index]*m_source_float_block[my_index])
+                        .template cast<double>();
+            } else {
+                W.noalias() = m_p2m_matrices[my_index]*m_source_block[my_index];
+            }
+        } else { 
+            // do M2M, as for mvm_upward_sweep
+            if (depth < m_task_depth) {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    #pragma omp task default(shared) firstprivate(cj)
+                    mmm_upward_sweep(cj,nrhs,depth+1);
+                }
+                #pragma omp taskwait
+            } else {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    mmm_upward_sweep(cj,nrhs,depth+1);
+                }
+            }
+            W.setZero(m_vector_type::RowsAtCompileTime,nrhs);
+            for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                const size_t child_index = m_query->get_bucket_index(*cj);
+                W.noalias() += m_l2l_matrices[child_index].transpose()*m_W_block[child_index];
+            }
+        }
+        return W;
+    }
+
+    void mmm_downward_sweep(
+            const m_block_type& g_parent, 
+            const child_iterator& ci,
+            const size_t depth=0) const {
+        size_t target_index = m_query->get_bucket_index(*ci);
+        m_block_type& g = m_g_block[target_index];
+
+        // L2L
+        g.noalias() = m_l2l_matrices[target_index]*g_parent;
+
+        // M2L (weakly connected buckets)
+        for (int i = 0; i < m_weak_connectivity[target_index].size(); ++i) {
+            const child_iterator& source_ci = m_weak_connectivity[target_index][i];
+            size_t source_index = m_query->get_bucket_index(*source_ci);
+            g.noalias() += m_m2l_matrices[m_m2l_indices[target_index][i]]*m_W_block[source_index];
+        }
+
+        if (!m_query->is_leaf_node(*ci)) { // dive down to next level
+            if (depth < m_task_depth) {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    #pragma omp task default(shared) firstprivate(cj)
+                    mmm_downward_sweep(g,cj,depth+1);
+                }
+                #pragma omp taskwait
+            } else {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    mmm_downward_sweep(g,cj,depth+1);
+                }
+            }
+        } else if (m_single_precision) {
+            p_float_block_type target = 
+                m_l2p_float_matrices[target_index]*g.template cast<float>();
+            for (int i = 0; i < m_strong_connectivity[target_index].size(); ++i) {
+                const child_iterator& source_ci = m_strong_connectivity[target_index][i];
+                size_t source_index = m_query->get_bucket_index(*source_ci);
+                target.noalias() += 
+                        get_p2p_float_matrix(target_index,i)*m_source_float_block[source_index];
+            }
+            m_target_block[target_index] = target.template cast<double>();
+        } else {
+            p_block_type& target = m_target_block[target_index];
+            target.noalias() = m_l2p_matrices[target_index]*g;
+
+            // direct evaluation (strongly connected buckets)
+            for (int i = 0; i < m_strong_connectivity[target_index].size(); ++i) {
+                const child_iterator& source_ci = m_strong_connectivity[target_index][i];
+                size_t source_index = m_query->get_bucket_index(*source_ci);
+                target.noalias() += 
+                        get_p2p_matrix(target_index,i)*m_source_block[source_index];
+            }
+        }
+    }
+
 
 };
 
 
 template <typename Expansions, typename RowParticlesType, typename ColParticlesType>
 H2Matrix<Expansions,ColParticlesType>
-make_h2_matrix(const RowParticlesType& row_particles, const ColParticlesType& col_particles, const Expansions& expansions) {
-    return H2Matrix<Expansions,ColParticlesType>(row_particles,col_particles,expansions);
+make_h2_matrix(const RowParticlesType& row_particles, const ColParticlesType& col_particles, const Expansions& expansions,
+               const bool cache_m2l=true, const bool single_precision=false) {
+    return H2Matrix<Expansions,ColParticlesType>(row_particles,col_particles,expansions,cache_m2l,single_precision);
+}
+
+/// estimates the statistics of a H2Matrix created by make_h2_matrix() using 
+/// \p particles as both the row and column particles and \p N chebyshev 
+/// nodes in each dimension. Only the tree is used, so this is cheap enough 
+/// to use for choosing parameters before the matrix is created. 
+///
+/// If \p cache_m2l is true, the M2L operators are assumed to be shared 
+/// between bucket pairs with the same level and offset, up to the same limit
+/// on the number of cached operators as the H2Matrix. This is only the case
+/// if the kernel is translation invariant. Otherwise the H2Matrix disables 
+/// its cache and the M2L memory is underestimated. Pass \p cache_m2l = false
+/// to count one M2L operator for every well separated pair, which is an 
+/// upper bound on the M2L memory for any kernel.
+template <unsigned int N, typename ParticlesType>
+fast_method_statistics estimate_h2_statistics(const ParticlesType& particles,
+                                              const bool cache_m2l=true) {
+    typedef typename ParticlesType::query_type query_type;
+    typedef typename query_type::child_iterator child_iterator;
+    static const unsigned int dimension = query_type::dimension;
+    const size_t ncheb = detail::ipow(N,dimension);
+    const query_type& query = particles.get_query();
+    const size_t n = particles.size();
+
+    fast_method_statistics stats;
+    std::set<detail::m2l_key<dimension>> m2l_keys;
+    const size_t max_keys = detail::m2l_cache_max_keys(ncheb);
+    size_t m2l_uncached = 0;
+    size_t p2p_entries = 0;
+    size_t nstrong = 0;
+    detail::for_each_interaction(query,
+        [&](const size_t level, const child_iterator& ci, const child_iterator& cj) {
+            stats.add_weak(level);
+            detail::m2l_key<dimension> key;
+            if (cache_m2l && detail::get_m2l_key(key,query.get_bounds(),
+                                    query.get_bounds(ci),query.get_bounds(cj))
+                && (m2l_keys.size() < max_keys || m2l_keys.count(key))) {
+                m2l_keys.insert(key);
+            } else {
+                ++m2l_uncached;
+            }
+        },
+        [&](const size_t level, const child_iterator& ci, const child_iterator& cj) {
+            stats.add_strong(level);
+            auto target_range = query.get_bucket_particles(*ci);
+            auto source_range = query.get_bucket_particles(*cj);
+            p2p_entries += std::distance(target_range.begin(),target_range.end())
+                           *std::distance(source_range.begin(),source_range.end());
+            ++nstrong;
+        });
+
+    const size_t nbuckets = query.number_of_buckets();
+    stats.p2p_bytes = p2p_entries*sizeof(double) 
+                      + nbuckets*sizeof(std::vector<size_t>)
+                      + nstrong*sizeof(size_t);
+    stats.m2l_bytes = (m2l_keys.size()+m2l_uncached)*ncheb*ncheb*sizeof(double);
+    stats.l2l_bytes = nbuckets*ncheb*ncheb*sizeof(double);
+    stats.p2m_bytes = n*ncheb*sizeof(double);
+    stats.l2p_bytes = n*ncheb*sizeof(double);
+    stats.expansion_bytes = 2*nbuckets*ncheb*sizeof(double) + 2*n*sizeof(double);
+    stats.dense_bytes = n*n*sizeof(double);
+    return stats;
 }
 
 }
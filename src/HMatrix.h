@@ -0,0 +1,411 @@
+/*
+
+Copyright (c) 2005-2016, University of Oxford.
+All rights reserved.
+
+University of Oxford means the Chancellor, Masters and Scholars of the
+University of Oxford, having an administrative office at Wellington
+Square, Oxford OX1 2JD, UK.
+
+This file is part of Aboria.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+ * Neither the name of the University of Oxford nor the names of its
+   contributors may be used to endorse or promote products derived from this
+   software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef H_MATRIX_H_
+#define H_MATRIX_H_
+
+#ifdef HAVE_EIGEN
+
+#include "detail/FastMultipoleMethod.h"
+#include "detail/LowRank.h"
+#include <Eigen/Core>
+#include <vector>
+
+namespace Aboria {
+
+namespace detail {
+
+    // a block of the kernel matrix between a list of row and a list of 
+    // column particles, evaluated on demand. Used as input for the adaptive
+    // cross approximation
+    template <typename Function, unsigned int D>
+    struct kernel_block {
+        typedef Vector<double,D> double_d;
+        typedef Eigen::Index Index;
+        enum {
+            RowsAtCompileTime = Eigen::Dynamic,
+            ColsAtCompileTime = Eigen::Dynamic
+        };
+
+        const Function& m_function;
+        const double_d* m_row_positions;
+        const double_d* m_col_positions;
+        const size_t* m_row_indices;
+        const size_t* m_col_indices;
+        const Index m_rows;
+        const Index m_cols;
+
+        kernel_block(const Function& function,
+                     const double_d* row_positions,
+                     const double_d* col_positions,
+                     const size_t* row_indices, const Index rows,
+                     const size_t* col_indices, const Index cols):
+            m_function(function),
+            m_row_positions(row_positions),
+            m_col_positions(col_positions),
+            m_row_indices(row_indices),
+            m_col_indices(col_indices),
+            m_rows(rows),
+            m_cols(cols)
+        {}
+
+        Index rows() const { return m_rows; }
+        Index cols() const { return m_cols; }
+
+        double coeff(const Index i, const Index j) const {
+            const double_d& pi = m_row_positions[m_row_indices[i]];
+            const double_d& pj = m_col_positions[m_col_indices[j]];
+            return m_function(pj-pi,pi,pj);
+        }
+    };
+
+}
+
+/// \brief A hierarchical matrix that compresses well separated blocks 
+/// using adaptive cross approximation (ACA)
+///
+/// Uses the same tree and admissibility condition as H2Matrix, but instead 
+/// of interpolating the kernel each well separated block is approximated 
+/// by a low rank product U*V calculated using partially pivoted ACA. Only 
+/// kernel evaluations are needed, so this works for kernels that would 
+/// need a very high chebyshev order in H2Matrix (e.g. oscillatory or 
+/// anisotropic kernels). Blocks that are not compressible are stored 
+/// densely.
+///
+/// Rows and columns are stored in tree order, so that the particles in each
+/// bucket are contiguous and every block is a contiguous sub-vector
+template <typename ColParticles, typename Function,
+         typename Query=typename ColParticles::query_type>
+class HMatrix {
+    typedef typename Query::traits_type traits_type;
+    typedef typename Query::pointer pointer;
+    typedef typename Query::child_iterator child_iterator;
+    static const unsigned int dimension = Query::dimension;
+    typedef position_d<dimension> position;
+    typedef Vector<double,dimension> double_d;
+    typedef detail::bbox<dimension> box_type;
+    typedef Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic> matrix_type;
+    typedef Eigen::Matrix<double,Eigen::Dynamic,1> vector_type;
+    typedef std::vector<size_t> indices_type;
+
+    // a block between the particles in two buckets, stored either as a 
+    // low rank product U*V or as a dense matrix U (V empty)
+    struct block_type {
+        size_t target_index;
+        size_t source_index;
+        bool low_rank;
+        matrix_type U;
+        matrix_type V;
+    };
+
+    std::vector<block_type> m_blocks;
+    // blocks with each bucket as the target
+    std::vector<indices_type> m_target_blocks;
+
+    // rows and cols in tree order, m_row_indices[i] is the original index 
+    // of the ith row
+    indices_type m_row_indices;
+    indices_type m_col_indices;
+    indices_type m_row_begin;
+    indices_type m_row_end;
+    indices_type m_col_begin;
+    indices_type m_col_end;
+
+    // vectors used to cache values
+    mutable vector_type m_source_vector;
+    mutable vector_type m_target_vector;
+    mutable std::vector<vector_type> m_low_rank_vectors;
+
+    Function m_function;
+    double m_epsilon;
+    size_t m_max_rank;
+    const Query* m_query;
+    // subtrees below this depth are swept serially within a single task
+    size_t m_task_depth;
+
+public:
+
+    /// creates the hierarchical matrix for kernel \p function, compressing 
+    /// blocks with ACA to a relative tolerance of \p epsilon. The rank of a
+    /// block is limited to \p max_rank
+    template <typename RowParticles>
+    HMatrix(const RowParticles &row_particles, const ColParticles &col_particles, 
+            const Function& function, const double epsilon=1e-8, 
+            const size_t max_rank=256):
+        m_function(function),
+        m_epsilon(epsilon),
+        m_max_rank(max_rank),
+        m_query(&col_particles.get_query())
+    {
+        // spawn tasks only for the top levels of the tree, as for the fmm
+#ifdef HAVE_OPENMP
+        m_task_depth = detail::task_depth(*m_query,8*omp_get_max_threads());
+#else
+        m_task_depth = 0;
+#endif
+        const size_t n = m_query->number_of_buckets();
+        LOG(2,"HMatrix: creating matrix with "<<n<<" buckets, using "<<row_particles.size()<<" row particles and "<<col_particles.size()<<" column particles");
+
+        // find the row and column particles in each leaf
+        std::vector<indices_type> leaf_rows(n);
+        std::vector<indices_type> leaf_cols(n);
+        for (int i = 0; i < row_particles.size(); ++i) {
+            pointer bucket;
+            box_type box;
+            m_query->get_bucket(get<position>(row_particles)[i],bucket,box);
+            leaf_rows[m_query->get_bucket_index(*bucket)].push_back(i);
+        }
+        for (auto& bucket: m_query->get_subtree()) {
+            if (m_query->is_leaf_node(bucket)) { 
+                const size_t index = m_query->get_bucket_index(bucket); 
+                for (auto& p: m_query->get_bucket_particles(bucket)) {
+                    leaf_cols[index].push_back(&get<position>(p)
+                                   - &get<position>(col_particles)[0]);
+                }
+            }
+        }
+
+        // lay out rows and columns in tree order
+        m_row_begin.resize(n);
+        m_row_end.resize(n);
+        m_col_begin.resize(n);
+        m_col_end.resize(n);
+        for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
+            layout(ci,leaf_rows,leaf_cols);
+        }
+        m_source_vector.resize(m_col_indices.size());
+        m_target_vector.resize(m_row_indices.size());
+
+        // find all the blocks 
+        m_target_blocks.resize(n);
+        detail::for_each_interaction(*m_query,
+            [&](const size_t level, const child_iterator& ci, const child_iterator& cj) {
+                add_block(ci,cj,true);
+            },
+            [&](const size_t level, const child_iterator& ci, const child_iterator& cj) {
+                add_block(ci,cj,false);
+            });
+        m_low_rank_vectors.resize(m_blocks.size());
+
+        // each block is independent, so compress them in parallel
+        const double_d* row_positions = &get<position>(row_particles)[0];
+        const double_d* col_positions = &get<position>(col_particles)[0];
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < m_blocks.size(); ++i) {
+            generate_block(m_blocks[i],row_positions,col_positions);
+        }
+
+        size_t nlow_rank = 0;
+        size_t nstored = 0;
+        for (const block_type& block: m_blocks) {
+            nstored += block.U.size() + block.V.size();
+            if (block.low_rank) ++nlow_rank;
+        }
+        LOG(2,"\tdone, created "<<m_blocks.size()<<" blocks ("<<nlow_rank<<" low rank), storing "<<nstored<<" values (dense matrix has "<<m_row_indices.size()*m_col_indices.size()<<")");
+    }
+
+    /// sets the depth of the tree below which subtrees are swept serially, 
+    /// rather than as separate OpenMP tasks. By default this is the first 
+    /// level of the tree with at least 8 nodes per thread
+    void set_task_depth(const size_t depth) {
+        m_task_depth = depth;
+    }
+
+    size_t rows() const {
+        return m_row_indices.size();
+    }
+
+    size_t cols() const {
+        return m_col_indices.size();
+    }
+
+    // target_vector += A*source_vector
+    template <typename VectorTypeTarget, typename VectorTypeSource>
+    void matrix_vector_multiply(VectorTypeTarget& target_vector, 
+                          const VectorTypeSource& source_vector) const {
+
+        // permute source vector to tree order
+        #pragma omp parallel for
+        for (size_t i = 0; i < m_col_indices.size(); ++i) {
+            m_source_vector[i] = source_vector[m_col_indices[i]];
+        }
+
+        // apply the V matrices of the low rank blocks
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < m_blocks.size(); ++i) {
+            const block_type& block = m_blocks[i];
+            if (block.low_rank) {
+                m_low_rank_vectors[i].noalias() = block.V*m_source_vector.segment(
+                        m_col_begin[block.source_index],
+                        m_col_end[block.source_index]-m_col_begin[block.source_index]);
+            }
+        }
+
+        // downward sweep of tree, a child bucket's rows are a subset of 
+        // its parent's so the children are only processed once the parent 
+        // is done
+        m_target_vector.setZero();
+        #pragma omp parallel
+        #pragma omp single
+        {
+            for (child_iterator ci = m_query->get_children(); ci != false; ++ci) {
+                #pragma omp task default(shared) firstprivate(ci)
+                downward_sweep(ci);
+            }
+        }
+
+        // permute target vector back to original order
+        #pragma omp parallel for
+        for (size_t i = 0; i < m_row_indices.size(); ++i) {
+            target_vector[m_row_indices[i]] += m_target_vector[i];
+        }
+    }
+
+private:
+    void layout(const child_iterator& ci, 
+                const std::vector<indices_type>& leaf_rows,
+                const std::vector<indices_type>& leaf_cols) {
+        const size_t index = m_query->get_bucket_index(*ci);
+        m_row_begin[index] = m_row_indices.size();
+        m_col_begin[index] = m_col_indices.size();
+        if (m_query->is_leaf_node(*ci)) {
+            m_row_indices.insert(m_row_indices.end(),
+                    leaf_rows[index].begin(),leaf_rows[index].end());
+            m_col_indices.insert(m_col_indices.end(),
+                    leaf_cols[index].begin(),leaf_cols[index].end());
+        } else {
+            for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                layout(cj,leaf_rows,leaf_cols);
+            }
+        }
+        m_row_end[index] = m_row_indices.size();
+        m_col_end[index] = m_col_indices.size();
+    }
+
+    void add_block(const child_iterator& ci, const child_iterator& cj, 
+                   const bool low_rank) {
+        const size_t target_index = m_query->get_bucket_index(*ci);
+        const size_t source_index = m_query->get_bucket_index(*cj);
+        if (m_row_end[target_index] == m_row_begin[target_index] ||
+            m_col_end[source_index] == m_col_begin[source_index]) {
+            return;
+        }
+        m_target_blocks[target_index].push_back(m_blocks.size());
+        m_blocks.emplace_back();
+        block_type& block = m_blocks.back();
+        block.target_index = target_index;
+        block.source_index = source_index;
+        block.low_rank = low_rank;
+    }
+
+    void generate_block(block_type& block, 
+                        const double_d* row_positions,
+                        const double_d* col_positions) const {
+        const size_t nrows = m_row_end[block.target_index]-m_row_begin[block.target_index];
+        const size_t ncols = m_col_end[block.source_index]-m_col_begin[block.source_index];
+        detail::kernel_block<Function,dimension> Z(m_function,
+                row_positions,col_positions,
+                m_row_indices.data()+m_row_begin[block.target_index],nrows,
+                m_col_indices.data()+m_col_begin[block.source_index],ncols);
+
+        if (block.low_rank) {
+            // only worth storing as U*V if the rank is less than half the 
+            // size of the block
+            const size_t max_k = std::min(std::min(nrows,ncols)/2+1,m_max_rank);
+            block.U.resize(nrows,max_k);
+            block.V.resize(max_k,ncols);
+            const size_t k = detail::adaptive_cross_approximation_partial(
+                    Z,max_k,m_epsilon,block.U,block.V);
+            if (k < max_k) {
+                block.U.conservativeResize(nrows,k);
+                block.V.conservativeResize(k,ncols);
+                return;
+            } else if (max_k == m_max_rank) {
+                LOG(2,"HMatrix: block reached maximum rank "<<m_max_rank<<", accuracy will be reduced");
+                return;
+            }
+            // not compressible, store dense
+            block.low_rank = false;
+            block.V.resize(0,0);
+        }
+        block.U.resize(nrows,ncols);
+        for (size_t i = 0; i < nrows; ++i) {
+            for (size_t j = 0; j < ncols; ++j) {
+                block.U(i,j) = Z.coeff(i,j);
+            }
+        }
+    }
+
+    void downward_sweep(const child_iterator& ci, const size_t depth=0) const {
+        const size_t target_index = m_query->get_bucket_index(*ci);
+        auto target = m_target_vector.segment(m_row_begin[target_index],
+                            m_row_end[target_index]-m_row_begin[target_index]);
+        for (const size_t i: m_target_blocks[target_index]) {
+            const block_type& block = m_blocks[i];
+            if (block.low_rank) {
+                target.noalias() += block.U*m_low_rank_vectors[i];
+            } else {
+                target.noalias() += block.U*m_source_vector.segment(
+                        m_col_begin[block.source_index],
+                        m_col_end[block.source_index]-m_col_begin[block.source_index]);
+            }
+        }
+        if (!m_query->is_leaf_node(*ci)) { 
+            if (depth < m_task_depth) {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    #pragma omp task default(shared) firstprivate(cj)
+                    downward_sweep(cj,depth+1);
+                }
+                #pragma omp taskwait
+            } else {
+                for (child_iterator cj = m_query->get_children(ci); cj != false; ++cj) {
+                    downward_sweep(cj,depth+1);
+                }
+            }
+        }
+    }
+};
+
+template <typename RowParticlesType, typename ColParticlesType, typename Function>
+HMatrix<ColParticlesType,Function>
+make_h_matrix(const RowParticlesType& row_particles, const ColParticlesType& col_particles, 
+              const Function& function, const double epsilon=1e-8) {
+    return HMatrix<ColParticlesType,Function>(row_particles,col_particles,function,epsilon);
+}
+
+}
+
+#endif // HAVE_EIGEN
+#endif // H_MATRIX_H_
@@ -37,6 +37,8 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef KERNELS_H_
 #define KERNELS_H_
 
+#include <cstring>
+#include <numeric>
 #include <type_traits>
 
 #ifdef HAVE_EIGEN
@@ -46,6 +48,8 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "FastMultipoleMethod.h"
 #include "H2Matrix.h"
+#include "HMatrix.h"
+#include "VerletList.h"
 
 
 namespace Aboria {
@@ -133,6 +137,18 @@ namespace Aboria {
             Triplet::TRIPLET_ASSEMBLE_NOT_IMPLEMENTED; 
         }
 
+        // Kernels can also provide a parallel compressed sparse row (CSR) 
+        // assembly (see KernelDense), used by MatrixReplacement::assemble 
+        // if every block provides it: 
+        //
+        // assemble_row_counts(StorageIndex* counts, size_t startI) adds the 
+        // number of non-zeros in each row i of this block to counts[startI+i]
+        //
+        // assemble_rows(StorageIndex* next, StorageIndex* inner, 
+        // Value* values, size_t startI, size_t startJ) writes the non-zeros 
+        // of each row i to inner and values, starting at next[startI+i], and 
+        // advances next[startI+i] past them 
+
         /// Evaluates a matrix-free linear operator given by \p expr \p if_expr,
         /// and particle sets \p a and \p b on a vector rhs and
         /// accumulates the result in vector lhs
@@ -179,6 +195,7 @@ namespace Aboria {
 
             const bool is_periodic = !a.get_periodic().any();
 
+            #pragma omp parallel for
             for (size_t i=0; i<na; ++i) {
                 const_row_reference ai = a[i];
                 for (size_t j=0; j<nb; ++j) {
@@ -223,6 +240,46 @@ namespace Aboria {
             }
         }
 
+        template<typename StorageIndex>
+        void assemble_row_counts(StorageIndex* counts, const size_t startI=0) const {
+            const size_t na = this->m_row_particles.size();
+            const size_t nb = this->m_col_particles.size();
+            for (size_t i=0; i<na; ++i) {
+                counts[startI+i] += nb;
+            }
+        }
+
+        template<typename StorageIndex, typename Value>
+        void assemble_rows(StorageIndex* next, StorageIndex* inner, Value* values,
+                           const size_t startI=0, const size_t startJ=0) const {
+
+            const RowParticles& a = this->m_row_particles;
+            const ColParticles& b = this->m_col_particles;
+
+            const size_t na = a.size();
+            const size_t nb = b.size();
+
+            const bool is_periodic = !a.get_periodic().any();
+
+            #pragma omp parallel for
+            for (size_t i=0; i<na; ++i) {
+                const_row_reference ai = a[i];
+                StorageIndex k = next[startI+i];
+                for (size_t j=0; j<nb; ++j,++k) {
+                    const_col_reference bj = b[j];
+                    position_value_type dx; 
+                    if (is_periodic) { 
+                        dx = b.correct_dx_for_periodicity(get<position>(bj)-get<position>(ai));
+                    } else {
+                        dx = get<position>(bj)-get<position>(ai);
+                    }
+                    inner[k] = j+startJ;
+                    values[k] = this->eval(dx,ai,bj);
+                }
+                next[startI+i] = k;
+            }
+        }
+
         /// Evaluates a matrix-free linear operator given by \p expr \p if_expr,
         /// and particle sets \p a and \p b on a vector rhs and
         /// accumulates the result in vector lhs
@@ -237,39 +294,40 @@ namespace Aboria {
 
             const bool is_periodic = !a.get_periodic().any();
 
+            // rows are processed in blocks, and for each block the columns
+            // are processed in tiles small enough to stay in cache while
+            // they are reused by every row in the block
             const size_t parallel_size = 20;
-            if (na > parallel_size) {
-                #pragma omp parallel for
-                for (size_t i=0; i<na; ++i) {
-                    const_row_reference ai = a[i];
-                    Scalar sum(0);
-                    for (size_t j=0; j<nb; ++j) {
-                        const_col_reference bj = b[j];
-                        position_value_type dx; 
-                        if (is_periodic) { 
-                            dx = b.correct_dx_for_periodicity(get<position>(bj)-get<position>(ai));
-                        } else {
-                            dx = get<position>(bj)-get<position>(ai);
+            const size_t block_size = 64;
+            const size_t tile_size = 256;
+            const size_t nblocks = (na + block_size - 1)/block_size;
+
+            #pragma omp parallel for if (na > parallel_size)
+            for (size_t block = 0; block < nblocks; ++block) {
+                const size_t row_begin = block*block_size;
+                const size_t row_end = std::min(row_begin+block_size,na);
+                std::array<Scalar,block_size> sums;
+                std::fill(sums.begin(),sums.end(),Scalar(0));
+                for (size_t col_begin = 0; col_begin < nb; col_begin += tile_size) {
+                    const size_t col_end = std::min(col_begin+tile_size,nb);
+                    for (size_t i=row_begin; i<row_end; ++i) {
+                        const_row_reference ai = a[i];
+                        Scalar sum = sums[i-row_begin];
+                        for (size_t j=col_begin; j<col_end; ++j) {
+                            const_col_reference bj = b[j];
+                            position_value_type dx; 
+                            if (is_periodic) { 
+                                dx = b.correct_dx_for_periodicity(get<position>(bj)-get<position>(ai));
+                            } else {
+                                dx = get<position>(bj)-get<position>(ai);
+                            }
+                            sum += this->eval(dx,ai,bj)*rhs[j];
                         }
-                        sum += this->eval(dx,ai,bj)*rhs(j);
+                        sums[i-row_begin] = sum;
                     }
-                    lhs[i] += sum;
                 }
-            } else {
-                for (size_t i=0; i<na; ++i) {
-                    const_row_reference ai = a[i];
-                    Scalar sum(0);
-                    for (size_t j=0; j<nb; ++j) {
-                        const_col_reference bj = b[j];
-                        position_value_type dx; 
-                        if (is_periodic) { 
-                            dx = b.correct_dx_for_periodicity(get<position>(bj)-get<position>(ai));
-                        } else {
-                            dx = get<position>(bj)-get<position>(ai);
-                        }
-                        sum += this->eval(dx,ai,bj)*rhs[j];
-                    }
-                    lhs[i] += sum;
+                for (size_t i=row_begin; i<row_end; ++i) {
+                    lhs[i] += sums[i-row_begin];
                 }
             }
        }
@@ -311,50 +369,90 @@ namespace Aboria {
         typedef typename base_type::const_col_reference const_col_reference;
 
         typedef Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic> matrix_type;
+        typedef Eigen::Matrix<float,Eigen::Dynamic,Eigen::Dynamic> float_matrix_type;
 
         matrix_type m_matrix;
+        float_matrix_type m_float_matrix;
+        bool m_symmetric;
+        bool m_single_precision;
     public:
         typedef typename base_type::Scalar Scalar;
 
+        /// The matrix is assembled on construction. If \p symmetric is true 
+        /// and the row and column particles are the same set, the kernel is 
+        /// assumed symmetric (i.e. `function(dx,a,b) == function(-dx,b,a)`) 
+        /// and only the upper triangle is evaluated. If \p single_precision 
+        /// is true the matrix is stored in single precision, which halves 
+        /// the memory used and the memory traffic of evaluate()
         KernelMatrix(const RowParticles& row_particles,
                     const ColParticles& col_particles,
-                    const F& function): base_type(row_particles,
+                    const F& function,
+                    const bool symmetric=false,
+                    const bool single_precision=false): 
+                                        base_type(row_particles,
                                                   col_particles,
-                                                  function) 
+                                                  function),
+                                        m_symmetric(symmetric),
+                                        m_single_precision(single_precision)
         {
             assemble_matrix(); 
         };
 
         void assemble_matrix() {
-            const RowParticles& a = this->m_row_particles;
-            const ColParticles& b = this->m_col_particles;
-
-            const bool is_periodic = !a.get_periodic().any();
-
-            m_matrix.resize(a.size(),b.size());
-            for (size_t i=0; i<a.size(); ++i) {
-                const_row_reference ai = a[i];
-                for (size_t j=0; j<b.size(); ++j) {
-                    const_col_reference bj = b[j];
-                    position_value_type dx; 
-                    if (is_periodic) { 
-                        dx = b.correct_dx_for_periodicity(get<position>(bj)-
-                                                          get<position>(ai));
-                    } else {
-                        dx = get<position>(bj)-get<position>(ai);
-                    }
-                    m_matrix(i,j) = this->eval(dx,ai,bj);
-                }
+            if (m_single_precision) {
+                m_matrix.resize(0,0);
+                assemble_matrix(m_float_matrix);
+            } else {
+                m_float_matrix.resize(0,0);
+                assemble_matrix(m_matrix);
             }
         }
 
+        bool is_single_precision() const {
+            return m_single_precision;
+        }
+
         Scalar coeff(const size_t i, const size_t j) const {
-            return m_matrix(i,j);
+            if (m_single_precision) {
+                return m_float_matrix(i,j);
+            } else {
+                return m_matrix(i,j);
+            }
         }
 
         template<typename MatrixType>
         void assemble(const MatrixType &matrix) const {
-            const_cast< MatrixType& >(matrix) = m_matrix;
+            if (m_single_precision) {
+                const_cast< MatrixType& >(matrix) = 
+                    m_float_matrix.template cast<typename MatrixType::Scalar>();
+            } else {
+                const_cast< MatrixType& >(matrix) = m_matrix;
+            }
+        }
+
+        template<typename StorageIndex>
+        void assemble_row_counts(StorageIndex* counts, const size_t startI=0) const {
+            const size_t na = this->rows();
+            const size_t nb = this->cols();
+            for (size_t i=0; i<na; ++i) {
+                counts[startI+i] += nb;
+            }
+        }
+
+        template<typename StorageIndex, typename Value>
+        void assemble_rows(StorageIndex* next, StorageIndex* inner, Value* values,
+                           const size_t startI=0, const size_t startJ=0) const {
+            const size_t na = this->rows();
+            const size_t nb = this->cols();
+            #pragma omp parallel for
+            for (size_t i=0; i<na; ++i) {
+                StorageIndex k = next[startI+i];
+                for (size_t j=0; j<nb; ++j,++k) {
+                    inner[k] = j+startJ;
+                    values[k] = coeff(i,j);
+                }
+                next[startI+i] = k;
+            }
         }
 
         /// Evaluates a matrix-free linear operator given by \p expr \p if_expr,
@@ -362,7 +460,83 @@ namespace Aboria {
         /// accumulates the result in vector lhs
         template<typename VectorLHS,typename VectorRHS>
         void evaluate(VectorLHS &lhs, const VectorRHS &rhs) const {
-            lhs += m_matrix*rhs;
+            if (m_single_precision) {
+                typedef typename VectorLHS::Scalar lhs_scalar;
+                lhs += (m_float_matrix*rhs.template cast<float>()).template cast<lhs_scalar>();
+            } else {
+                lhs += m_matrix*rhs;
+            }
+        }
+
+        /// Evaluates the stored matrix on a block of right hand sides \p rhs
+        /// (one per column) and accumulates the result in matrix lhs
+        template<typename MatrixLHS,typename MatrixRHS>
+        void evaluate_block(MatrixLHS &lhs, const MatrixRHS &rhs) const {
+            if (m_single_precision) {
+                typedef typename MatrixLHS::Scalar lhs_scalar;
+                lhs += (m_float_matrix*rhs.template cast<float>()).template cast<lhs_scalar>();
+            } else {
+                lhs += m_matrix*rhs;
+            }
+        }
+
+    private:
+        bool is_same_set() const {
+            return static_cast<const void*>(&this->m_row_particles) == 
+                   static_cast<const void*>(&this->m_col_particles);
+        }
+
+        // the matrix is filled in parallel, one square tile at a time so 
+        // that the particles of each tile stay in cache. For a symmetric 
+        // kernel only the tiles on or above the diagonal are evaluated, and 
+        // each value is also written to its transposed position
+        template<typename MatrixType>
+        void assemble_matrix(MatrixType& matrix) const {
+            typedef typename MatrixType::Scalar matrix_scalar;
+            const RowParticles& a = this->m_row_particles;
+            const ColParticles& b = this->m_col_particles;
+            const size_t na = a.size();
+            const size_t nb = b.size();
+
+            const bool is_periodic = !a.get_periodic().any();
+            const bool symmetric = m_symmetric && is_same_set();
+
+            matrix.resize(na,nb);
+
+            const size_t tile_size = 64;
+            const size_t ntiles_i = (na + tile_size - 1)/tile_size;
+            const size_t ntiles_j = (nb + tile_size - 1)/tile_size;
+
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t tile = 0; tile < ntiles_i*ntiles_j; ++tile) {
+                const size_t tile_i = tile/ntiles_j;
+                const size_t tile_j = tile%ntiles_j;
+                if (symmetric && tile_j < tile_i) continue;
+                const size_t row_begin = tile_i*tile_size;
+                const size_t row_end = std::min(row_begin+tile_size,na);
+                const size_t col_begin = tile_j*tile_size;
+                const size_t col_end = std::min(col_begin+tile_size,nb);
+                // matrices are column major, so rows are the inner loop
+                for (size_t j=col_begin; j<col_end; ++j) {
+                    const_col_reference bj = b[j];
+                    const size_t i_end = (symmetric && tile_i == tile_j) ? j+1 : row_end;
+                    for (size_t i=row_begin; i<i_end; ++i) {
+                        const_row_reference ai = a[i];
+                        position_value_type dx; 
+                        if (is_periodic) { 
+                            dx = b.correct_dx_for_periodicity(get<position>(bj)-
+                                                              get<position>(ai));
+                        } else {
+                            dx = get<position>(bj)-get<position>(ai);
+                        }
+                        const matrix_scalar value = this->eval(dx,ai,bj);
+                        matrix(i,j) = value;
+                        if (symmetric) {
+                            matrix(j,i) = value;
+                        }
+                    }
+                }
+            }
         }
     };
 
@@ -516,9 +690,12 @@ namespace Aboria {
 
         KernelH2(const RowParticles& row_particles,
                         const ColParticles& col_particles,
-                        const PositionF& function): 
+                        const PositionF& function,
+                        const bool cache_m2l=true,
+                        const bool single_precision=false): 
                                             m_h2_matrix(row_particles,col_particles,
-                                                        expansions_type(function)),
+                                                        expansions_type(function),
+                                                        cache_m2l,single_precision),
                                             m_position_function(function),
                                             base_type(row_particles,
                                                   col_particles,
@@ -550,6 +727,62 @@ namespace Aboria {
         void evaluate(VectorLHS &lhs, const VectorRHS &rhs) const {
             m_h2_matrix.matrix_vector_multiply(lhs,rhs);
         }
+
+        /// Evaluates the h2 matrix linear operator on a block of right hand 
+        /// sides \p rhs (one per column) in a single traversal of the tree, 
+        /// and accumulates the result in matrix lhs
+        template<typename MatrixLHS,typename MatrixRHS>
+        void evaluate_block(MatrixLHS &lhs, const MatrixRHS &rhs) const {
+            m_h2_matrix.matrix_matrix_multiply(lhs,rhs);
+        }
+    };
+
+    template<typename RowParticles, typename ColParticles, typename PositionF,
+        typename F=detail::position_lambda<RowParticles,ColParticles,PositionF>>
+    class KernelHMatrix: public KernelDense<RowParticles,ColParticles,F> {
+        typedef KernelDense<RowParticles,ColParticles,F> base_type;
+        typedef typename base_type::position position;
+        typedef typename base_type::double_d double_d;
+        typedef typename base_type::int_d int_d;
+        typedef typename base_type::const_position_reference const_position_reference;
+        typedef typename base_type::const_row_reference const_row_reference;
+        typedef typename base_type::const_col_reference const_col_reference;
+        static const unsigned int dimension = base_type::dimension;
+        typedef HMatrix<ColParticles,PositionF> h_matrix_type;
+
+        h_matrix_type m_h_matrix;
+        PositionF m_position_function;
+
+    public:
+        typedef typename base_type::Scalar Scalar;
+        typedef PositionF position_function_type;
+
+        KernelHMatrix(const RowParticles& row_particles,
+                        const ColParticles& col_particles,
+                        const PositionF& function,
+                        const double epsilon): 
+                                            m_h_matrix(row_particles,col_particles,
+                                                        function,epsilon),
+                                            m_position_function(function),
+                                            base_type(row_particles,
+                                                  col_particles,
+                                                  F(function)) {
+        }
+
+        const h_matrix_type& get_h_matrix() const {
+            return m_h_matrix;
+        }
+
+        const PositionF& get_position_function() const {
+            return m_position_function;
+        }
+
+        /// Evaluates the ACA hierarchical matrix linear operator on a 
+        /// vector rhs and accumulates the result in vector lhs
+        template<typename VectorLHS,typename VectorRHS>
+        void evaluate(VectorLHS &lhs, const VectorRHS &rhs) const {
+            m_h_matrix.matrix_vector_multiply(lhs,rhs);
+        }
     };
 
 #endif
@@ -578,10 +811,12 @@ namespace Aboria {
 
         KernelFMM(const RowParticles& row_particles,
                         const ColParticles& col_particles,
-                        const PositionF& function): 
+                        const PositionF& function,
+                        const bool cache_m2l=true): 
                                             m_expansions(function),
                                             m_fmm(col_particles,
-                                                  m_expansions),
+                                                  m_expansions,
+                                                  cache_m2l),
                                             base_type(row_particles,
                                                   col_particles,
                                                   F(function)) {
@@ -607,16 +842,74 @@ namespace Aboria {
         typedef typename base_type::const_col_reference const_col_reference;
     public:
         typedef typename base_type::Scalar Scalar;
+        typedef FRadius radius_function_type;
 
         KernelSparse(const RowParticles& row_particles,
                     const ColParticles& col_particles,
                     const FRadius& radius_function,
                     const F& function): m_radius_function(radius_function),
+                                        m_verlet_list(nullptr),
+                                        m_cache_pattern(false),
+                                        m_cache_values(false),
+                                        m_cache_valid(false),
+                                        m_number_of_cache_builds(0),
                                         base_type(row_particles,
                                                   col_particles,
                                                   function) 
         {};
 
+        typedef VerletList<RowParticles,ColParticles> verlet_list_type;
+
+        /// use the Verlet list \p verlet_list to find neighbouring particles,
+        /// rather than the neighbour search of the column particles. The list
+        /// is updated (and rebuilt if neccessary) at the start of each call
+        /// to assemble() or evaluate(), and its radius must be greater than or 
+        /// equal to the radius returned by the radius function. 
+        void set_verlet_list(verlet_list_type& verlet_list) {
+            ASSERT(&verlet_list.get_row_particles() == &this->m_row_particles,
+                    "Verlet list row particles not the same as kernel");
+            ASSERT(&verlet_list.get_col_particles() == &this->m_col_particles,
+                    "Verlet list column particles not the same as kernel");
+            m_verlet_list = &verlet_list;
+        }
+
+        /// cache the sparsity pattern of the operator in compressed sparse 
+        /// row (CSR) format, so that evaluate() does not need to search for 
+        /// the neighbouring particles. If \p cache_values is true the kernel 
+        /// values are also cached, and evaluate() becomes a plain sparse 
+        /// matrix-vector product. 
+        ///
+        /// The cache is rebuilt at the start of evaluate() if the number, 
+        /// order or positions of the row or column particles have changed 
+        /// since it was built. If \p function depends on other particle 
+        /// variables, call invalidate_cache() after changing them
+        void set_cache(const bool cache_pattern=true, const bool cache_values=false) {
+            m_cache_pattern = cache_pattern || cache_values;
+            m_cache_values = cache_values;
+            invalidate_cache();
+        }
+
+        /// force the cache to be rebuilt on the next call to evaluate()
+        void invalidate_cache() {
+            m_cache_valid = false;
+        }
+
+        /// the number of times the cached sparsity pattern has been built
+        size_t number_of_cache_builds() const {
+            return m_number_of_cache_builds;
+        }
+
+        /// the search radius around row particle \p a
+        double get_radius(const_row_reference a) const {
+            return m_radius_function(a);
+        }
+
+        /// true if evaluate() uses the neighbour search of the column 
+        /// particles, rather than a Verlet list or a cached pattern
+        bool uses_neighbour_search() const {
+            return m_verlet_list == nullptr && !m_cache_pattern;
+        }
+
         Scalar coeff(const size_t i, const size_t j) const {
             ASSERT(i < this->m_row_particles.size(),"i greater than a.size()");
             ASSERT(j < this->m_col_particles.size(),"j greater than b.size()");
@@ -641,7 +934,26 @@ namespace Aboria {
 
             const_cast< MatrixType& >(matrix).setZero();
 
+            if (m_verlet_list != nullptr) {
+                m_verlet_list->update();
+                #pragma omp parallel for
+                for (size_t i=0; i<na; ++i) {
+                    const_row_reference ai = a[i];
+                    const double radius = m_radius_function(ai);
+                    ASSERT(radius <= m_verlet_list->get_radius(),"radius larger than Verlet list radius");
+                    for (const size_t j: m_verlet_list->get_neighbours(i)) {
+                        const_col_reference bj = b[j];
+                        const double_d dx = b.correct_dx_for_periodicity(get<position>(bj)-get<position>(ai));
+                        if (dx.squaredNorm() <= radius*radius) {
+                            const_cast< MatrixType& >(matrix)(i,j) = this->m_function(dx,ai,bj);
+                        }
+                    }
+                }
+                return;
+            }
+
             //sparse a x b block
+            #pragma omp parallel for
             for (size_t i=0; i<na; ++i) {
                 const_row_reference ai = a[i];
                 const double radius = m_radius_function(ai);
@@ -666,6 +978,23 @@ namespace Aboria {
             const size_t na = a.size();
             const size_t nb = b.size();
 
+            if (m_verlet_list != nullptr) {
+                m_verlet_list->update();
+                for (size_t i=0; i<na; ++i) {
+                    const_row_reference ai = a[i];
+                    const double radius = m_radius_function(ai);
+                    ASSERT(radius <= m_verlet_list->get_radius(),"radius larger than Verlet list radius");
+                    for (const size_t j: m_verlet_list->get_neighbours(i)) {
+                        const_col_reference bj = b[j];
+                        const double_d dx = b.correct_dx_for_periodicity(get<position>(bj)-get<position>(ai));
+                        if (dx.squaredNorm() <= radius*radius) {
+                            triplets.push_back(Triplet(i+startI,j+startJ,this->m_function(dx,ai,bj)));
+                        }
+                    }
+                }
+                return;
+            }
+
             //sparse a x b block
             //std::cout << "sparse a x b block" << std::endl;
             for (size_t i=0; i<na; ++i) {
@@ -680,6 +1009,41 @@ namespace Aboria {
             }
         }
 
+        template<typename StorageIndex>
+        void assemble_row_counts(StorageIndex* counts, const size_t startI=0) const {
+            if (m_verlet_list != nullptr) {
+                m_verlet_list->update();
+            }
+            const size_t na = this->m_row_particles.size();
+            #pragma omp parallel for
+            for (size_t i=0; i<na; ++i) {
+                StorageIndex count = 0;
+                for_each_neighbour(i,[&](const size_t j, const double_d& dx) { 
+                        ++count; 
+                        });
+                counts[startI+i] += count;
+            }
+        }
+
+        template<typename StorageIndex, typename Value>
+        void assemble_rows(StorageIndex* next, StorageIndex* inner, Value* values,
+                           const size_t startI=0, const size_t startJ=0) const {
+            const RowParticles& a = this->m_row_particles;
+            const ColParticles& b = this->m_col_particles;
+            const size_t na = a.size();
+            #pragma omp parallel for
+            for (size_t i=0; i<na; ++i) {
+                const_row_reference ai = a[i];
+                StorageIndex k = next[startI+i];
+                for_each_neighbour(i,[&](const size_t j, const double_d& dx) { 
+                        inner[k] = j+startJ;
+                        values[k] = this->m_function(dx,ai,b[j]);
+                        ++k;
+                        });
+                next[startI+i] = k;
+            }
+        }
+
         /// Evaluates a matrix-free linear operator given by \p expr \p if_expr,
         /// and particle sets \p a and \p b on a vector rhs and
         /// accumulates the result in vector lhs
@@ -692,6 +1056,49 @@ namespace Aboria {
             const size_t na = a.size();
             const size_t nb = b.size();
 
+            if (m_cache_pattern) {
+                update_cache();
+                #pragma omp parallel for
+                for (size_t i=0; i<na; ++i) {
+                    Scalar sum(0);
+                    if (m_cache_values) {
+                        for (size_t k=m_row_offsets[i]; k<m_row_offsets[i+1]; ++k) {
+                            sum += m_values[k]*rhs[m_col_indices[k]];
+                        }
+                    } else {
+                        const_row_reference ai = a[i];
+                        for (size_t k=m_row_offsets[i]; k<m_row_offsets[i+1]; ++k) {
+                            const size_t j = m_col_indices[k];
+                            const_col_reference bj = b[j];
+                            const double_d dx = b.correct_dx_for_periodicity(get<position>(bj)-get<position>(ai));
+                            sum += this->m_function(dx,ai,bj)*rhs[j];
+                        }
+                    }
+                    lhs[i] += sum;
+                }
+                return;
+            }
+
+            if (m_verlet_list != nullptr) {
+                m_verlet_list->update();
+                #pragma omp parallel for
+                for (size_t i=0; i<na; ++i) {
+                    const_row_reference ai = a[i];
+                    Scalar sum(0);
+                    const double radius = m_radius_function(ai);
+                    ASSERT(radius <= m_verlet_list->get_radius(),"radius larger than Verlet list radius");
+                    for (const size_t j: m_verlet_list->get_neighbours(i)) {
+                        const_col_reference bj = b[j];
+                        const double_d dx = b.correct_dx_for_periodicity(get<position>(bj)-get<position>(ai));
+                        if (dx.squaredNorm() <= radius*radius) {
+                            sum += this->m_function(dx,ai,bj)*rhs[j];
+                        }
+                    }
+                    lhs[i] += sum;
+                }
+                return;
+            }
+
             #pragma omp parallel for
             for (size_t i=0; i<na; ++i) {
                 const_row_reference ai = a[i];
@@ -707,7 +1114,106 @@ namespace Aboria {
             }
        }
     private:
+        // the positions are compared bitwise, so any change to a position 
+        // (or to the order of the particles) invalidates the cache
+        template <typename Particles>
+        static bool same_positions(const Particles& p, const std::vector<double_d>& positions) {
+            return p.size() == positions.size() && 
+                   std::memcmp(get<position>(p).data(),positions.data(),
+                               positions.size()*sizeof(double_d)) == 0;
+        }
+
+        void update_cache() const {
+            const RowParticles& a = this->m_row_particles;
+            const ColParticles& b = this->m_col_particles;
+            if (m_cache_valid && same_positions(a,m_cached_row_positions) 
+                              && same_positions(b,m_cached_col_positions)) {
+                return;
+            }
+            build_cache();
+        }
+
+        // the cache is built in two passes (count the non-zeros of each row, 
+        // then fill them in) so that each row can be processed in parallel
+        void build_cache() const {
+            const RowParticles& a = this->m_row_particles;
+            const ColParticles& b = this->m_col_particles;
+            const size_t na = a.size();
+
+            if (m_verlet_list != nullptr) {
+                m_verlet_list->update();
+            }
+
+            m_row_offsets.assign(na+1,0);
+            #pragma omp parallel for
+            for (size_t i=0; i<na; ++i) {
+                size_t count = 0;
+                for_each_neighbour(i,[&](const size_t j, const double_d& dx) { 
+                        ++count; 
+                        });
+                m_row_offsets[i+1] = count;
+            }
+            std::partial_sum(m_row_offsets.begin(),m_row_offsets.end(),m_row_offsets.begin());
+
+            m_col_indices.resize(m_row_offsets[na]);
+            m_values.resize(m_cache_values ? m_row_offsets[na] : 0);
+            #pragma omp parallel for
+            for (size_t i=0; i<na; ++i) {
+                const_row_reference ai = a[i];
+                size_t k = m_row_offsets[i];
+                for_each_neighbour(i,[&](const size_t j, const double_d& dx) { 
+                        m_col_indices[k] = j;
+                        if (m_cache_values) {
+                            m_values[k] = this->m_function(dx,ai,b[j]);
+                        }
+                        ++k;
+                        });
+            }
+
+            m_cached_row_positions.assign(get<position>(a).begin(),get<position>(a).end());
+            m_cached_col_positions.assign(get<position>(b).begin(),get<position>(b).end());
+            m_cache_valid = true;
+            ++m_number_of_cache_builds;
+            LOG(2,"KernelSparse: cached "<<m_row_offsets[na]<<" non-zeros for "<<na<<" rows");
+        }
+
+        // call f(j,dx) for each column particle j within the radius of row 
+        // particle i, in the same order as evaluate() without the cache
+        template <typename Function>
+        void for_each_neighbour(const size_t i, Function f) const {
+            const RowParticles& a = this->m_row_particles;
+            const ColParticles& b = this->m_col_particles;
+            const_row_reference ai = a[i];
+            const double radius = m_radius_function(ai);
+            if (m_verlet_list != nullptr) {
+                ASSERT(radius <= m_verlet_list->get_radius(),"radius larger than Verlet list radius");
+                for (const size_t j: m_verlet_list->get_neighbours(i)) {
+                    const double_d dx = b.correct_dx_for_periodicity(get<position>(b[j])-get<position>(ai));
+                    if (dx.squaredNorm() <= radius*radius) {
+                        f(j,dx);
+                    }
+                }
+            } else {
+                for (auto pairj: euclidean_search(b.get_query(),get<position>(ai),radius)) {
+                    const_position_reference dx = detail::get_impl<1>(pairj);
+                    const_col_reference bj = detail::get_impl<0>(pairj);
+                    f(&get<position>(bj) - get<position>(b).data(),dx);
+                }
+            }
+        }
+
         FRadius m_radius_function;
+        verlet_list_type* m_verlet_list;
+
+        bool m_cache_pattern;
+        bool m_cache_values;
+        mutable bool m_cache_valid;
+        mutable size_t m_number_of_cache_builds;
+        mutable std::vector<size_t> m_row_offsets;
+        mutable std::vector<size_t> m_col_indices;
+        mutable std::vector<Scalar> m_values;
+        mutable std::vector<double_d> m_cached_row_positions;
+        mutable std::vector<double_d> m_cached_col_positions;
     };
 
     namespace detail {
@@ -796,6 +1302,15 @@ namespace Aboria {
                       ) const {
         }
 
+        template<typename StorageIndex>
+        void assemble_row_counts(StorageIndex* counts, const size_t startI=0) const {
+        }
+
+        template<typename StorageIndex, typename Value>
+        void assemble_rows(StorageIndex* next, StorageIndex* inner, Value* values,
+                           const size_t startI=0, const size_t startJ=0) const {
+        }
+
         /// Evaluates a matrix-free linear operator given by \p expr \p if_expr,
         /// and particle sets \p a and \p b on a vector rhs and
         /// accumulates the result in vector lhs
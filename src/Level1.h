@@ -53,6 +53,7 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "NanoFlannAdaptor.h"
 #include "OctTree.h"
 #include "PrintTuple.h"
+#include "Trajectory.h"
 #include "Utils.h"
 
 
@@ -47,6 +47,8 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <iostream>
 #include <set>
+#include <algorithm>
+#include <numeric>
 
 namespace Aboria {
 
@@ -117,7 +119,8 @@ public:
 
     nanoflann_adaptor():
         base_type(), 
-        m_kd_tree(dimension,*this) 
+        m_kd_tree(dimension,*this),
+        m_tree_is_sorted(false)
     {
         //init an empty tree
         std::vector<int> empty;
@@ -185,6 +188,7 @@ public:
 private:
     void set_domain_impl() {
         m_kd_tree.set_leaf_max_size(this->m_n_particles_in_leaf);
+        m_tree_is_sorted = false;
 
         this->m_query.m_bounds.bmin = this->m_bounds.bmin;
         this->m_query.m_bounds.bmax = this->m_bounds.bmax;
@@ -249,7 +253,24 @@ private:
                                const bool call_set_domain=true) {
         ASSERT(update_begin==this->m_particles_begin && update_end==this->m_particles_end,"error should be update all");
 
-	    m_kd_tree.buildIndex(this->m_alive_indices.begin());
+        // the tree can only be refit if the same particles are still in the 
+        // same (tree) order 
+        const size_t num_points = this->m_alive_indices.size();
+        const bool can_refit = m_tree_is_sorted 
+                                && num_points > 0
+                                && num_points == m_kd_tree.size_points()
+                                && update_end-update_begin == num_points;
+
+        if (can_refit && refit_tree()) {
+            LOG(2,"nanoflann_adaptor: refit tree");
+        } else {
+            m_kd_tree.buildIndex(this->m_alive_indices.begin());
+            m_leaves.clear();
+            if (num_points > 0) {
+                get_leaves(m_kd_tree.get_root_node());
+            }
+        }
+        m_tree_is_sorted = true;
 
         //std::swap(this->m_order,m_kd_tree.get_vind());
 
@@ -267,6 +288,109 @@ private:
     }
 
 
+    // store the leaves in tree order, so that their particle ranges are
+    // contiguous and increasing
+    void get_leaves(node_type* node) {
+        if (this->m_query.is_leaf_node(*node)) {
+            m_leaves.push_back(node);
+        } else {
+            get_leaves(node->child1);
+            get_leaves(node->child2);
+        }
+    }
+
+    // find the leaf containing position \p p, returns its index in m_leaves
+    size_t find_leaf(const double_d& p) const {
+        const node_type* node = m_kd_tree.get_root_node();
+        while (!this->m_query.is_leaf_node(*node)) {
+            node = p[node->node_type.sub.divfeat] < node->node_type.sub.divlow ?
+                        node->child1 : node->child2;
+        }
+        return std::lower_bound(m_leaves.begin(),m_leaves.end(),node,
+                [](const node_type* a, const node_type* b) {
+                    return a->node_type.lr.left < b->node_type.lr.left;
+                }) - m_leaves.begin();
+    }
+
+    // Keeps the topology and cut planes of the tree, and only moves the 
+    // particles that have left their leaf into their new leaf. Returns false
+    // (and does nothing) if the resultant tree is too unbalanced, i.e. if a 
+    // leaf contains more than m_max_leaf_imbalance times the requested 
+    // number of particles per leaf, in which case the tree is rebuilt.
+    bool refit_tree() {
+        const size_t n = this->m_alive_indices.size();
+        const size_t nleaves = m_leaves.size();
+        const double_d* positions = iterator_to_raw_pointer(
+                                        get<position>(this->m_particles_begin));
+
+        // 1. find the particles that have left their leaf
+        std::vector<int> new_leaf(n);
+        std::vector<int> counts(nleaves+1,0);
+        #pragma omp parallel for
+        for (size_t l = 0; l < nleaves; ++l) {
+            const node_type* leaf = m_leaves[l];
+            int count = 0;
+            for (int i = leaf->node_type.lr.left; i < leaf->node_type.lr.right; ++i) {
+                bool inside = true;
+                for (int d = 0; d < dimension; ++d) {
+                    inside &= positions[i][d] >= leaf->bbox[d].low &&
+                              positions[i][d] <= leaf->bbox[d].high; 
+                }
+                if (inside) {
+                    new_leaf[i] = l;
+                    ++count;
+                } else {
+                    new_leaf[i] = -1;
+                }
+            }
+            counts[l] = count;
+        }
+
+        // 2. find the new leaf for each moved particle 
+        std::vector<int> moved_indices;
+        for (size_t i = 0; i < n; ++i) {
+            if (new_leaf[i] < 0) {
+                new_leaf[i] = find_leaf(positions[i]);
+                ++counts[new_leaf[i]];
+                moved_indices.push_back(i);
+            }
+        }
+        LOG(3,"nanoflann_adaptor: "<<moved_indices.size()<<" of "<<n<<" particles have left their leaf");
+
+        const int max_count = *std::max_element(counts.begin(),counts.end());
+        if (max_count > m_max_leaf_imbalance*this->m_n_particles_in_leaf) {
+            LOG(3,"nanoflann_adaptor: leaf with "<<max_count<<" particles, rebuilding tree");
+            return false;
+        }
+
+        // 3. the new particle ranges for each leaf
+        std::vector<int> offsets(nleaves+1);
+        offsets[0] = 0;
+        std::partial_sum(counts.begin(),counts.end()-1,offsets.begin()+1);
+
+        // 4. stable counting sort by leaf, particles that stayed go first
+        std::vector<int> next(nleaves);
+        #pragma omp parallel for
+        for (size_t l = 0; l < nleaves; ++l) {
+            node_type* leaf = m_leaves[l];
+            int index = offsets[l];
+            for (int i = leaf->node_type.lr.left; i < leaf->node_type.lr.right; ++i) {
+                if (new_leaf[i] == l) {
+                    this->m_alive_indices[index++] = i;
+                }
+            }
+            next[l] = index;
+        }
+        for (const int i: moved_indices) {
+            this->m_alive_indices[next[new_leaf[i]]++] = i;
+        }
+        for (size_t l = 0; l < nleaves; ++l) {
+            m_leaves[l]->node_type.lr.left = offsets[l];
+            m_leaves[l]->node_type.lr.right = offsets[l+1];
+        }
+        return true;
+    }
+
     /*
     bool add_points_at_end_impl(const size_t dist) {
         return embed_points_impl();
@@ -292,6 +416,11 @@ private:
 
     kd_tree_type m_kd_tree;
     nanoflann_adaptor_query<Traits> m_query;
+
+    // true if the particles are sorted by the current tree
+    bool m_tree_is_sorted;
+    std::vector<node_type*> m_leaves;
+    static constexpr double m_max_leaf_imbalance = 2.0;
 };
 
 template <typename Traits>
@@ -180,7 +180,7 @@ public:
         LOG_CUDA(2,"neighbour_search_base: constructor, setting default domain");
         const double min = std::numeric_limits<double>::min();
         const double max = std::numeric_limits<double>::max();
-        set_domain(double_d(min/3.0),double_d(max/3.0),bool_d(false),10,false); 
+        set_domain(double_d(min/3.0),double_d(max/3.0),bool_d(false),10,false,false); 
     };
 
     static constexpr bool ordered() {
@@ -231,19 +231,23 @@ public:
     /// \param high the upper extent of the search domain
     /// \param _max_interaction_radius the side length of each bucket
     /// \param periodic a boolean vector indicating wether each dimension
-    void set_domain(const double_d &min_in, const double_d &max_in, const bool_d& periodic_in, const double n_particles_in_leaf=10, const bool not_in_constructor=true) {
+    /// \param morton_order number the buckets (and hence order the particles 
+    /// for ordered data structures) along a Morton curve rather than row-major
+    void set_domain(const double_d &min_in, const double_d &max_in, const bool_d& periodic_in, const double n_particles_in_leaf=10, const bool morton_order=false, const bool not_in_constructor=true) {
         LOG(2,"neighbour_search_base: set_domain:");
         m_domain_has_been_set = not_in_constructor;
         m_bounds.bmin = min_in;
         m_bounds.bmax = max_in;
         m_periodic = periodic_in;
         m_n_particles_in_leaf = n_particles_in_leaf; 
+        m_morton_order = morton_order;
         if (not_in_constructor) {
             cast().set_domain_impl();
         }
         LOG(2,"\tbounds = "<<m_bounds);
 	    LOG(2,"\tparticles_in_leaf = "<<m_n_particles_in_leaf);
         LOG(2,"\tperiodic = "<<m_periodic);
+        LOG(2,"\tmorton_order = "<<m_morton_order);
     }
 
     size_t find_id_map(const size_t id) const {
@@ -619,6 +623,9 @@ public:
     const double_d& get_max() const { return m_bounds.bmax; }
     const bool_d& get_periodic() const { return m_periodic; }
     bool domain_has_been_set() const { return m_domain_has_been_set; }
+    bool morton_order() const { return m_morton_order; }
+    double get_n_particles_in_leaf() const { return m_n_particles_in_leaf; }
+    bool has_id_map() const { return m_id_map; }
 
 protected:
     iterator m_particles_begin;
@@ -632,6 +639,7 @@ protected:
     bool m_domain_has_been_set;
     detail::bbox<Traits::dimension> m_bounds;
     double m_n_particles_in_leaf; 
+    bool m_morton_order;
 };
 
 // assume that these iterators, and query functions, are only called from device code
@@ -45,6 +45,9 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "detail/SpatialUtil.h"
 #include "Particles.h"
 
+#include <algorithm>
+#include <numeric>
+
 namespace Aboria {
 
 template <typename Traits>
@@ -80,7 +83,7 @@ class octtree:
 
 
 public:
-    octtree():base_type(),m_max_level(32/dimension - 2) {
+    octtree():base_type(),m_max_level(32/dimension - 2),m_tree_is_sorted(false) {
 
         // need to init a tree with 1 level (for 0 particles) in case
         // someone does a query on an empty data structure
@@ -96,6 +99,8 @@ public:
     }
 
     void build_tree();
+    bool update_tree_incremental(std::true_type);
+    bool update_tree_incremental(std::false_type) { return false; }
     struct classify_point;
     struct child_index_to_tag_mask;
     struct classify_node;
@@ -115,6 +120,7 @@ private:
 
     void set_domain_impl() {
         const size_t n = this->m_particles_end - this->m_particles_begin;
+        m_tree_is_sorted = false;
 
         this->m_query.m_periodic = this->m_periodic;
         this->m_query.m_bounds = this->m_bounds;
@@ -131,6 +137,12 @@ private:
 
         const size_t num_points  = this->m_alive_indices.size();
 
+        // the previous tree can only be updated if the same particles are
+        // still in the same (sorted) order 
+        const bool can_update_incrementally = m_tree_is_sorted 
+                                   && num_points == m_tags.size()
+                                   && update_end-update_begin == num_points;
+
         m_tags.resize(num_points);
         if (m_tags.size() > 0) {
             /******************************************
@@ -158,14 +170,24 @@ private:
                     classify_point(this->m_bounds, m_max_level));
             }
 
-            /******************************************
-             * 4. Sort according to classification    *
-             ******************************************/
-            detail::sort_by_key(m_tags.begin(), m_tags.end(), 
-                                this->m_alive_indices.begin());
         }
-        
-        build_tree();
+
+        if (can_update_incrementally && m_tags.size() > 0 &&
+                update_tree_incremental(
+                    typename detail::is_std_iterator<
+                        typename vector_int::iterator>::type())) {
+            LOG(2,"octtree: updated tree incrementally");
+        } else {
+            if (m_tags.size() > 0) {
+                /******************************************
+                 * 4. Sort according to classification    *
+                 ******************************************/
+                detail::sort_by_key(m_tags.begin(), m_tags.end(), 
+                                    this->m_alive_indices.begin());
+            }
+            build_tree();
+        }
+        m_tree_is_sorted = true;
 
 #ifndef __CUDA_ARCH__
         if (3 <= ABORIA_LOG_LEVEL) { 
@@ -275,9 +297,14 @@ private:
     int m_max_level;
     unsigned m_number_of_levels;
 
+    // true if m_tags and the particles are sorted by the current tree
+    bool m_tree_is_sorted;
+
     vector_int m_tags;
     vector_int m_nodes;
     vector_int2 m_leaves;
+    // the (inclusive) range of tags covered by each leaf
+    vector_int2 m_leaf_tags;
 
     octtree_query<Traits> m_query;
 };
@@ -288,6 +315,7 @@ template <typename traits>
 void octtree<traits>::build_tree() {
     m_nodes.clear();
     m_leaves.clear();
+    m_leaf_tags.clear();
     vector_int active_nodes(1,0);
 
     LOG(4,"octree: building tree with max_level = "<<m_max_level);
@@ -420,6 +448,19 @@ void octtree<traits>::build_tree() {
                 m_leaves.begin() + children_begin,
                 detail::is_a<detail::LEAF>());
 
+        m_leaf_tags.resize(m_leaves.size());
+
+        auto make_leaf_tags = [=] CUDA_HOST_DEVICE (const int tag) { 
+            return vint2(tag,tag+length); 
+        };
+        detail::scatter_if(
+                detail::make_transform_iterator(children.begin(),make_leaf_tags),
+                detail::make_transform_iterator(children.end(),make_leaf_tags),
+                leaves_on_this_level.begin(),
+                child_node_kind.begin(),
+                m_leaf_tags.begin() + children_begin,
+                detail::is_a<detail::LEAF>());
+
         /*
         detail::print_active_nodes<dimension>(active_nodes,m_max_level);
         detail::print_children<dimension>(children,m_max_level);
@@ -450,6 +491,103 @@ void octtree<traits>::build_tree() {
 
 }
 
+// Update a tree built on the previous particle positions. m_tags holds the 
+// new tags in the previous (sorted) particle order. Only the particles that 
+// have left their leaf are sorted, and merged back into the rest. If every 
+// leaf still holds a valid number of particles then only the leaf particle 
+// ranges are updated, otherwise the nodes are rebuilt from the sorted tags.
+// Returns false (and does nothing) if too many particles have moved, in which
+// case a full sort and rebuild is cheaper.
+template <typename traits>
+bool octtree<traits>::update_tree_incremental(std::true_type) {
+    const size_t n = m_tags.size();
+    const size_t nleaves = m_leaves.size();
+
+    // 1. find the particles that have left their leaf
+    std::vector<int> moved(n+1,0);
+    #pragma omp parallel for
+    for (size_t l = 0; l < nleaves; ++l) {
+        const vint2& tags = m_leaf_tags[l];
+        for (int i = m_leaves[l][0]; i < m_leaves[l][1]; ++i) {
+            moved[i] = m_tags[i] < tags[0] || m_tags[i] > tags[1];
+        }
+    }
+    std::partial_sum(moved.begin(),moved.end(),moved.begin());
+    const size_t num_moved = moved[n-1];
+    LOG(3,"octtree: "<<num_moved<<" of "<<n<<" particles have left their leaf");
+    if (num_moved > 0.1*n) return false;
+
+    // moved[i] now holds the number of moved particles in [0,i], so
+    // shift to an exclusive sum
+    std::copy_backward(moved.begin(),moved.end()-1,moved.end());
+    moved[0] = 0;
+
+    // 2. split into particles that stayed, and those that moved 
+    std::vector<int> stayed(n-num_moved);
+    std::vector<int> moved_indices(num_moved);
+    for (size_t i = 0; i < n; ++i) {
+        if (moved[i+1] == moved[i]) {
+            stayed[i-moved[i]] = i;
+        } else {
+            moved_indices[moved[i]] = i;
+        }
+    }
+    auto tag_less = [&](const int i, const int j) { 
+        return m_tags[i] < m_tags[j]; 
+    };
+
+    // 3. leaves are already in tag order, so only need to sort the particles 
+    // that stayed within each leaf 
+    #pragma omp parallel for
+    for (size_t l = 0; l < nleaves; ++l) {
+        const int begin = m_leaves[l][0];
+        const int end = m_leaves[l][1];
+        std::sort(stayed.begin()+begin-moved[begin],
+                  stayed.begin()+end-moved[end],tag_less);
+    }
+    std::sort(moved_indices.begin(),moved_indices.end(),tag_less);
+
+    // 4. merge moved particles back in 
+    std::merge(stayed.begin(),stayed.end(),
+               moved_indices.begin(),moved_indices.end(),
+               this->m_alive_indices.begin(),tag_less);
+    vector_int new_tags(n);
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; ++i) {
+        new_tags[i] = m_tags[this->m_alive_indices[i]];
+    }
+    m_tags.swap(new_tags);
+
+    // 5. update leaf ranges, and check that the tree topology is still valid
+    // (i.e. no leaves need splitting or have become empty, and no particles
+    // are in empty nodes)
+    vector_int2 new_leaves(nleaves);
+    int num_in_leaves = 0;
+    bool valid_topology = true;
+    #pragma omp parallel for reduction(+:num_in_leaves) reduction(&&:valid_topology)
+    for (size_t l = 0; l < nleaves; ++l) {
+        const vint2& tags = m_leaf_tags[l];
+        const int lower = std::lower_bound(m_tags.begin(),m_tags.end(),tags[0])
+                                - m_tags.begin();
+        const int upper = std::upper_bound(m_tags.begin()+lower,m_tags.end(),tags[1])
+                                - m_tags.begin();
+        const int count = upper-lower;
+        const bool last_level = tags[0] == tags[1];
+        new_leaves[l] = vint2(lower,upper);
+        num_in_leaves += count;
+        valid_topology = valid_topology && count > 0 && 
+                            (last_level || count <= this->m_n_particles_in_leaf);
+    }
+
+    if (valid_topology && num_in_leaves == n) {
+        m_leaves.swap(new_leaves);
+    } else {
+        LOG(3,"octtree: leaf split or merge required, rebuilding nodes");
+        build_tree();
+    }
+    return true;
+}
+
 // Classify a point with respect to the bounding box.
 template <typename traits>
 struct octtree<traits>::classify_point {
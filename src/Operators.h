@@ -37,6 +37,8 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef OPERATORS_H_
 #define OPERATORS_H_
 
+#include <algorithm>
+#include <numeric>
 #include <type_traits>
 
 namespace Aboria {
@@ -92,8 +94,8 @@ class MatrixReplacement : public Eigen::EigenBase<MatrixReplacement<NI,NJ,Blocks
         };
         typedef detail::InnerIterator<MatrixReplacement> InnerIterator;
 
-        MatrixReplacement(const Blocks& blocks):m_blocks(blocks) {};
-        MatrixReplacement(Blocks&& blocks):m_blocks(std::move(blocks)) {};
+        MatrixReplacement(const Blocks& blocks):m_blocks(blocks),m_fused(false) {};
+        MatrixReplacement(Blocks&& blocks):m_blocks(std::move(blocks)),m_fused(false) {};
 
         CUDA_HOST_DEVICE
         Index rows() const {
@@ -163,6 +165,33 @@ class MatrixReplacement : public Eigen::EigenBase<MatrixReplacement<NI,NJ,Blocks
             return get_kernel<0,0>();
         }
 
+        template <unsigned int I, unsigned int J>
+        typename std::tuple_element<I*NJ+J,Blocks>::type& 
+        get_kernel() {
+            return std::get<I*NJ+J>(m_blocks);
+        }
+
+        typename std::tuple_element<0,Blocks>::type& 
+        get_first_kernel() {
+            return get_kernel<0,0>();
+        }
+
+        /// evaluate all the blocks in a single pass over the row particles, 
+        /// with one neighbour search per row particle shared by every block. 
+        /// This is used for matrix-vector products if every block is a 
+        /// sparse kernel over the same row and column particle sets, without 
+        /// a Verlet list or cache. Otherwise the blocks are evaluated in turn
+        void set_fused(const bool fused=true) {
+            m_fused = fused;
+        }
+
+        /// true if matrix-vector products use the fused evaluation
+        bool is_fused() const {
+            return m_fused && detail::can_fuse(*this,
+                    typename detail::is_fusable<Blocks>::type(),
+                    detail::make_index_sequence<NI*NJ>());
+        }
+
         template<typename Derived>
         void assemble(Eigen::DenseBase<Derived>& matrix) const {
             const size_t na = rows();
@@ -178,17 +207,106 @@ class MatrixReplacement : public Eigen::EigenBase<MatrixReplacement<NI,NJ,Blocks
             const size_t nb = cols();
             //matrix.resize(na,nb);
             CHECK((matrix.rows() == na) && (matrix.cols() == nb), "matrix size is not compatible with expression.");
+            assemble_sparse_impl(matrix,typename detail::is_csr_assemblable<Blocks>::type());
+        }
 
+        // if any block does not provide the compressed sparse row (CSR) 
+        // assembly methods, the matrix is assembled from triplets. Repeated 
+        // entries are summed by setFromTriplets
+        template <int _Options, typename _StorageIndex>
+        void assemble_sparse_impl(Eigen::SparseMatrix<Scalar,_Options,_StorageIndex>& matrix,
+                                  std::false_type) const {
             typedef Eigen::Triplet<Scalar> triplet_type;
             std::vector<triplet_type> tripletList;
             // TODO: can we estimate this better?
-            tripletList.reserve(na*5);
+            tripletList.reserve(rows()*5);
 
             assemble_impl(tripletList,detail::make_index_sequence<NI*NJ>());
 
             matrix.setFromTriplets(tripletList.begin(),tripletList.end());
         }
 
+        // otherwise the matrix is assembled directly in CSR format in two 
+        // passes over the rows of each block. The first counts the non-zeros 
+        // in each row, and the second fills them in. Both passes are 
+        // parallel over the rows of each block
+        template <int _Options, typename _StorageIndex>
+        void assemble_sparse_impl(Eigen::SparseMatrix<Scalar,_Options,_StorageIndex>& matrix,
+                                  std::true_type) const {
+            const size_t na = rows();
+            const size_t nb = cols();
+            typedef Eigen::SparseMatrix<Scalar,Eigen::RowMajor,_StorageIndex> csr_type;
+            std::vector<_StorageIndex> offsets(na+1,0);
+            assemble_row_counts_impl(offsets.data()+1,detail::make_index_sequence<NI*NJ>());
+            std::partial_sum(offsets.begin(),offsets.end(),offsets.begin());
+
+            csr_type csr(na,nb);
+            csr.resizeNonZeros(offsets[na]);
+            std::copy(offsets.begin(),offsets.end(),csr.outerIndexPtr());
+            
+            // offsets is reused as the insertion point of each row
+            assemble_rows_impl(offsets.data(),csr.innerIndexPtr(),csr.valuePtr(),
+                               detail::make_index_sequence<NI*NJ>());
+
+            // each row is sorted by column index, since the neighbour search 
+            // does not return the column particles in order. A periodic 
+            // search can also return the same column particle more than once 
+            // (e.g. if the radius is more than half the domain), so repeated 
+            // columns are merged by summing their values. offsets[i+1] is 
+            // reused as the number of unique columns in row i
+            _StorageIndex* outer = csr.outerIndexPtr();
+            _StorageIndex* inner = csr.innerIndexPtr();
+            Scalar* values = csr.valuePtr();
+            #pragma omp parallel
+            {
+                // scratch space for sorting, reused for each row
+                std::vector<std::pair<_StorageIndex,Scalar>> row;
+                #pragma omp for
+                for (size_t i=0; i<na; ++i) {
+                    const _StorageIndex begin = outer[i];
+                    const _StorageIndex end = outer[i+1];
+                    if (!std::is_sorted(inner+begin,inner+end)) {
+                        row.resize(end-begin);
+                        for (_StorageIndex k=begin; k<end; ++k) {
+                            row[k-begin] = std::make_pair(inner[k],values[k]);
+                        }
+                        std::sort(row.begin(),row.end());
+                        for (_StorageIndex k=begin; k<end; ++k) {
+                            inner[k] = row[k-begin].first;
+                            values[k] = row[k-begin].second;
+                        }
+                    }
+                    _StorageIndex last = begin;
+                    for (_StorageIndex k=begin+1; k<end; ++k) {
+                        if (inner[k] == inner[last]) {
+                            values[last] += values[k];
+                        } else {
+                            ++last;
+                            inner[last] = inner[k];
+                            values[last] = values[k];
+                        }
+                    }
+                    offsets[i+1] = end > begin ? last+1-begin : 0;
+                }
+            }
+
+            // compact the rows if any columns were merged. Each row only 
+            // moves towards the start of the arrays
+            offsets[0] = 0;
+            std::partial_sum(offsets.begin(),offsets.end(),offsets.begin());
+            if (offsets[na] < outer[na]) {
+                for (size_t i=0; i<na; ++i) {
+                    const _StorageIndex n = offsets[i+1]-offsets[i];
+                    std::copy(inner+outer[i],inner+outer[i]+n,inner+offsets[i]);
+                    std::copy(values+outer[i],values+outer[i]+n,values+offsets[i]);
+                }
+                std::copy(offsets.begin(),offsets.end(),outer);
+                csr.resizeNonZeros(offsets[na]);
+            }
+
+            assign_csr(matrix,csr);
+        }
+
         
 
         template<std::size_t... I>
@@ -255,6 +373,37 @@ class MatrixReplacement : public Eigen::EigenBase<MatrixReplacement<NI,NJ,Blocks
             block.assemble(matrix);
         }
 
+        template <typename _StorageIndex>
+        static void assign_csr(Eigen::SparseMatrix<Scalar,Eigen::RowMajor,_StorageIndex>& matrix,
+                               Eigen::SparseMatrix<Scalar,Eigen::RowMajor,_StorageIndex>& csr) {
+            matrix.swap(csr);
+        }
+
+        template <typename _StorageIndex>
+        static void assign_csr(Eigen::SparseMatrix<Scalar,Eigen::ColMajor,_StorageIndex>& matrix,
+                               Eigen::SparseMatrix<Scalar,Eigen::RowMajor,_StorageIndex>& csr) {
+            matrix = csr;
+        }
+
+        template<typename StorageIndex, std::size_t... I>
+        void assemble_row_counts_impl(StorageIndex* counts, detail::index_sequence<I...>) const {
+            int dummy[] = { 0, (
+                    std::get<I>(m_blocks).assemble_row_counts(
+                        counts,start_row<I/NJ>()),void(),0)... };
+            static_cast<void>(dummy);
+        }
+
+        // blocks are filled in column order, so rows spanning several blocks 
+        // stay sorted by column index
+        template<typename StorageIndex, std::size_t... I>
+        void assemble_rows_impl(StorageIndex* next, StorageIndex* inner, Scalar* values, 
+                                detail::index_sequence<I...>) const {
+            int dummy[] = { 0, (
+                    std::get<I>(m_blocks).assemble_rows(
+                        next,inner,values,start_row<I/NJ>(),start_col<I%NJ>()),void(),0)... };
+            static_cast<void>(dummy);
+        }
+
         template<std::size_t... I>
         void assemble_impl(std::vector<Eigen::Triplet<Scalar>>& triplets, detail::index_sequence<I...>) const {
             int dummy[] = { 0, (
@@ -276,7 +425,8 @@ class MatrixReplacement : public Eigen::EigenBase<MatrixReplacement<NI,NJ,Blocks
             static_cast<void>(dummy);
         }
 
-        const Blocks m_blocks;
+        Blocks m_blocks;
+        bool m_fused;
 
 };
 
@@ -321,6 +471,10 @@ Operator create_dense_operator(const RowParticles& row_particles,
 ///                      first particle set
 /// \param function A function object that returns the value of the operator
 ///                 for a given particle pair
+/// \param symmetric If true, and \p row_particles and \p col_particles are 
+///                  the same set, \p function is assumed symmetric and only 
+///                  half of the matrix is evaluated
+/// \param single_precision If true, the matrix is stored in single precision
 ///
 ///
 /// \tparam RowParticles The type of the row particle set
@@ -332,10 +486,13 @@ template<typename RowParticles, typename ColParticles, typename F,
                 >
 Operator create_matrix_operator(const RowParticles& row_particles,
                                const ColParticles& col_particles,
-                               const F& function) {
+                               const F& function,
+                               const bool symmetric=false,
+                               const bool single_precision=false) {
         return Operator(
                 std::make_tuple(
-                    Kernel(row_particles,col_particles,function)
+                    Kernel(row_particles,col_particles,function,
+                           symmetric,single_precision)
                     )
                 );
     }
@@ -389,6 +546,10 @@ Operator create_chebyshev_operator(const RowParticles& row_particles,
 ///                      first particle set
 /// \param function A function object that returns the value of the operator
 ///                 for a given particle pair
+/// \param cache_m2l If true (the default) the M2L operators are shared 
+///                  between box pairs with the same level and offset, which
+///                  assumes that \p function is translation invariant. Set
+///                  to false to calculate every M2L operator directly
 ///
 /// \tparam N The number of chebyshev nodes in each dimension to use
 /// \tparam RowParticles The type of the row particle set
@@ -400,10 +561,11 @@ template<unsigned int N, typename RowParticles, typename ColParticles, typename
                 >
 Operator create_fmm_operator(const RowParticles& row_particles,
                                const ColParticles& col_particles,
-                               const F& function) {
+                               const F& function,
+                               const bool cache_m2l=true) {
         return Operator(
                 std::make_tuple(
-                    Kernel(row_particles,col_particles,function)
+                    Kernel(row_particles,col_particles,function,cache_m2l)
                     )
                 );
     }
@@ -423,6 +585,14 @@ Operator create_fmm_operator(const RowParticles& row_particles,
 ///                      first particle set
 /// \param function A function object that returns the value of the operator
 ///                 for a given particle pair
+/// \param cache_m2l If true (the default) the M2L operators are shared 
+///                  between box pairs with the same level and offset, which
+///                  assumes that \p function is translation invariant. Set
+///                  to false to calculate every M2L operator directly
+/// \param single_precision If true, the leaf (P2M, L2P and P2P) matrices are
+///                  stored and multiplied in single precision, halving 
+///                  their memory. Useful as the low precision operator in 
+///                  IterativeRefinement
 ///
 /// \tparam N The number of chebyshev nodes in each dimension to use
 /// \tparam RowParticles The type of the row particle set
@@ -434,10 +604,48 @@ template<unsigned int N, typename RowParticles, typename ColParticles, typename
                 >
 Operator create_h2_operator(const RowParticles& row_particles,
                                const ColParticles& col_particles,
-                               const F& function) {
+                               const F& function,
+                               const bool cache_m2l=true,
+                               const bool single_precision=false) {
         return Operator(
                 std::make_tuple(
-                    Kernel(row_particles,col_particles,function)
+                    Kernel(row_particles,col_particles,function,cache_m2l,single_precision)
+                    )
+                );
+    }
+
+/// \brief creates a matrix-free linear operator using a hierarchical
+///        matrix compressed with adaptive cross approximation (ACA)
+///
+/// This function returns a MatrixReplacement object that acts like a 
+/// dense linear operator (i.e. matrix) in Eigen. It internally creates
+/// a hierarchical matrix where each well separated block is approximated
+/// by a low rank product found by ACA. Unlike create_h2_operator this
+/// only requires evaluations of the kernel, so it is suitable for kernels 
+/// that are not smooth enough for chebyshev interpolation
+///
+/// \param row_particles The rows of the linear operator index this 
+///                      first particle set
+/// \param col_particles The columns of the linear operator index this 
+///                      first particle set
+/// \param function A function object that returns the value of the operator
+///                 for a given particle pair
+/// \param epsilon The relative tolerance used for the ACA of each block
+///
+/// \tparam RowParticles The type of the row particle set
+/// \tparam ColParticles The type of the column particle set
+/// \tparam F The type of the function object
+template<typename RowParticles, typename ColParticles, typename F,
+         typename Kernel=KernelHMatrix<RowParticles,ColParticles,F>,
+         typename Operator=MatrixReplacement<1,1,std::tuple<Kernel>>
+                >
+Operator create_hmatrix_operator(const RowParticles& row_particles,
+                               const ColParticles& col_particles,
+                               const F& function,
+                               const double epsilon=1e-8) {
+        return Operator(
+                std::make_tuple(
+                    Kernel(row_particles,col_particles,function,epsilon)
                     )
                 );
     }
@@ -548,6 +756,42 @@ Operator create_sparse_operator(const RowParticles& row_particles,
                 );
     }
 
+/// \brief creates a sparse matrix-free linear operator for use with Eigen,
+/// using a Verlet list to find the non-zero particle pairs
+///
+/// This is the same as create_sparse_operator(), but the neighbouring 
+/// particles are taken from \p verlet_list, rather than found using the 
+/// neighbour search. The list is updated (and rebuilt if the particles have 
+/// moved too far) at the start of every assembly or matrix-vector product. 
+///
+/// \param row_particles The rows of the linear operator index this 
+///                      first particle set
+/// \param col_particles The columns of the linear operator index this 
+///                      first particle set
+/// \param verlet_list A Verlet list built from \p row_particles and 
+///                    \p col_particles, with a radius >= \p radius
+/// \param radius   It is assumed that \p function 
+///                 returns a zero value
+///                 for all particle pairs with a separation greater than
+///                 this value
+/// \param function A function object that returns the value of the operator
+///                 for a given particle pair
+///
+/// \see VerletList
+template<typename RowParticles, typename ColParticles, typename F,
+         typename Kernel=KernelSparseConst<RowParticles,ColParticles,F>,
+         typename Operator=MatrixReplacement<1,1,std::tuple<Kernel>>
+                >
+Operator create_sparse_operator(const RowParticles& row_particles,
+                                const ColParticles& col_particles,
+                                VerletList<RowParticles,ColParticles>& verlet_list,
+                                const double radius,
+                                const F& function) {
+        Kernel kernel(row_particles,col_particles,radius,function);
+        kernel.set_verlet_list(verlet_list);
+        return Operator(std::make_tuple(kernel));
+    }
+
 
 /// \brief creates a zero matrix-free linear operator for use with Eigen
 ///
@@ -70,6 +70,20 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 namespace Aboria {
 namespace detail {
 
+// true if the particle at index \p i of the update range moves
+struct out_of_place_lambda {
+    const int* order;
+    int offset;
+
+    out_of_place_lambda(const int* order, const int offset):
+        order(order),offset(offset) {}
+
+    CUDA_HOST_DEVICE
+    bool operator()(const int i) const {
+        return order[i] != offset + i;
+    }
+};
+
 template <typename Reference>
 struct resize_lambda {
     uint32_t seed;
@@ -404,6 +418,14 @@ public:
         return traits_type::cend(data);
     }
 
+    /// reserve storage for at least \p n particles. This also reserves the 
+    /// second buffer used when the neighbour search reorders the particles,
+    /// so that subsequent calls to update_positions() do not reallocate
+    void reserve(size_type n) {
+        traits_type::reserve(data,n);
+        traits_type::reserve(other_data,n);
+    }
+
     /// sets container to empty and deletes all particles
     void clear() {
         return traits_type::clear(data);
@@ -531,11 +553,20 @@ public:
     /// to each other than this length are considered neighbours
     /// \param periodic a boolean 3d vector indicating whether each dimension 
     /// is periodic (true) or not (false)
+    /// \param n_particles_in_leaf the target number of particles per bucket/leaf
+    /// \param morton_order number the buckets of the bucket search data 
+    /// structures along a Morton (Z-order) curve, so that neighbouring buckets
+    /// (and, for bucket_search_parallel, their particles) are close in memory.
+    /// The number of buckets in each dimension is rounded down to a power of
+    /// two. 
+    /// The octtree is always Morton ordered and the kd-tree is always stored 
+    /// in tree order, so this has no effect for these data structures
     void init_neighbour_search(const double_d& low, const double_d& high, const bool_d& periodic,
-                                const double n_particles_in_leaf=10.0) {
-        LOG(2, "Particles:init_neighbour_search: low = "<<low<<" high = "<<high<<" periodic = "<<periodic<<" n_particles_in_leaf = "<<n_particles_in_leaf);
+                                const double n_particles_in_leaf=10.0, 
+                                const bool morton_order=false) {
+        LOG(2, "Particles:init_neighbour_search: low = "<<low<<" high = "<<high<<" periodic = "<<periodic<<" n_particles_in_leaf = "<<n_particles_in_leaf<<" morton_order = "<<morton_order);
 
-        search.set_domain(low,high,periodic,n_particles_in_leaf);
+        search.set_domain(low,high,periodic,n_particles_in_leaf,morton_order);
         update_positions(begin(),end());
 
         searchable = true;
@@ -672,6 +703,127 @@ public:
         traits_type::serialize(data,ar,version);
     }
 
+    /// write the particles to the file \p filename using a columnar binary 
+    /// format. The file starts with a header listing the name, type and 
+    /// size of each variable, followed by the data of each variable, which 
+    /// is written with a single contiguous write. The neighbour search 
+    /// settings (domain, periodicity, bucket size and ordering) are also 
+    /// stored, but not the search data structure itself, so load_binary() 
+    /// rebuilds the neighbour search from these settings. 
+    ///
+    /// Note that the data is written using the native byte order and type 
+    /// layout, so the file should be read using the same platform and 
+    /// compiler
+    /// \see load_binary()
+    void save_binary(const std::string& filename) const {
+        LOG(2,"Particles:save_binary: writing "<<size()<<" particles to "<<filename);
+        constexpr size_t n_columns = mpl::size<mpl_type_vector>::type::value;
+
+        detail::binary_file_header header;
+        std::memset(&header,0,sizeof(header));
+        std::memcpy(header.magic,detail::binary_file_magic,sizeof(header.magic));
+        header.version = detail::binary_file_version;
+        header.dimension = dimension;
+        header.size = size();
+        header.next_id = next_id;
+        header.seed = seed;
+        header.number_of_columns = n_columns;
+        header.neighbour_search = searchable && search.domain_has_been_set();
+        header.id_search = searchable && search.has_id_map();
+        header.morton_order = search.morton_order();
+        header.n_particles_in_leaf = search.get_n_particles_in_leaf();
+
+        double_d low = get_min();
+        double_d high = get_max();
+        uint8_t periodic[dimension];
+        for (size_t d = 0; d < dimension; ++d) {
+            periodic[d] = get_periodic()[d];
+        }
+
+        const uint64_t header_bytes = sizeof(header) 
+                                    + 2*dimension*sizeof(double) 
+                                    + sizeof(periodic)
+                                    + n_columns*sizeof(detail::binary_column_header);
+        detail::binary_column_header columns[n_columns];
+        detail::make_binary_column_header make_header(columns,header_bytes);
+        traits_type::for_each_column(data,make_header);
+
+        std::ofstream os(filename,std::ios::binary);
+        CHECK(os.good(),"could not open file "<<filename<<" for writing");
+        os.write(reinterpret_cast<const char*>(&header),sizeof(header));
+        os.write(reinterpret_cast<const char*>(low.data()),dimension*sizeof(double));
+        os.write(reinterpret_cast<const char*>(high.data()),dimension*sizeof(double));
+        os.write(reinterpret_cast<const char*>(periodic),sizeof(periodic));
+        os.write(reinterpret_cast<const char*>(columns),sizeof(columns));
+        detail::write_binary_column write_column(os,columns,header_bytes);
+        traits_type::for_each_column(data,write_column);
+        CHECK(os.good(),"error writing to file "<<filename);
+    }
+
+    /// replace the particles in the container with those in the file 
+    /// \p filename, written by save_binary(). The file is memory mapped
+    /// (where supported) and each variable is copied directly from the 
+    /// mapped file. If the saved container had neighbour or id searching 
+    /// enabled, this is rebuilt using the saved domain and settings by 
+    /// calling init_neighbour_search(), so costs the same as building the 
+    /// search for a new container
+    /// \see save_binary()
+    void load_binary(const std::string& filename) {
+        LOG(2,"Particles:load_binary: reading particles from "<<filename);
+        constexpr size_t n_columns = mpl::size<mpl_type_vector>::type::value;
+
+        detail::mapped_file file(filename);
+        const char* file_data = file.data();
+        detail::binary_file_header header;
+        CHECK(file.size() >= sizeof(header),filename<<" is not a binary particles file");
+        std::memcpy(&header,file_data,sizeof(header));
+        CHECK(std::memcmp(header.magic,detail::binary_file_magic,sizeof(header.magic)) == 0,
+                filename<<" is not a binary particles file");
+        CHECK(header.version == detail::binary_file_version,
+                "unsupported binary file version "<<header.version);
+        CHECK(header.dimension == dimension,
+                "binary file has dimension "<<header.dimension<<", expected "<<dimension);
+        CHECK(header.number_of_columns == n_columns,
+                "binary file has "<<header.number_of_columns<<" variables, expected "<<n_columns);
+        
+        double_d low,high;
+        uint8_t periodic_in[dimension];
+        detail::binary_column_header columns[n_columns];
+        const char* p = file_data + sizeof(header);
+        CHECK(file.size() >= sizeof(header) + 2*sizeof(low) + sizeof(periodic_in) + sizeof(columns),
+                "binary file "<<filename<<" is truncated");
+        std::memcpy(low.data(),p,dimension*sizeof(double));
+        p += dimension*sizeof(double);
+        std::memcpy(high.data(),p,dimension*sizeof(double));
+        p += dimension*sizeof(double);
+        std::memcpy(periodic_in,p,sizeof(periodic_in));
+        p += sizeof(periodic_in);
+        std::memcpy(columns,p,sizeof(columns));
+
+        detail::read_binary_column read_column(file_data,file.size(),columns,header.size);
+        traits_type::for_each_column(data,read_column);
+        next_id = header.next_id;
+        seed = header.seed;
+
+        // the search data structure is not stored in the file, so it is 
+        // rebuilt from scratch
+        search.update_iterators(begin(),end());
+        searchable = false;
+        if (header.neighbour_search) {
+            bool_d periodic;
+            for (size_t d = 0; d < dimension; ++d) {
+                periodic[d] = periodic_in[d];
+            }
+            if (header.id_search) {
+                search.init_id_map();
+            }
+            init_neighbour_search(low,high,periodic,
+                                  header.n_particles_in_leaf,header.morton_order);
+        } else if (header.id_search) {
+            init_id_search();
+        }
+    }
+
 
 #ifdef HAVE_VTK
     
@@ -792,16 +944,41 @@ private:
                  const typename vector_int::const_iterator& order_end) {
         LOG(2,"Particles: reordering particles");
         ASSERT(update_end==end(),"if triggering a reorder, should be updating the end");
-        const size_t n_update = update_end-update_begin;
-        const size_t n_alive = order_end-order_start;
         const size_t old_n = size();
-        const size_t new_n = old_n-(n_update-n_alive);
-        if (n_alive > old_n/2) {
+        const size_t new_n = old_n-((update_end-update_begin)-(order_end-order_start));
+
+        // particles at the start of the update range that are already in 
+        // order do not need to be moved, so shrink the update range to 
+        // start at the first particle that does
+#if defined(__CUDACC__)
+        typedef typename thrust::detail::iterator_category_to_system<
+            typename vector_int::iterator::iterator_category
+            >::type system;
+        detail::counting_iterator<int,system> count(update_begin-begin());
+#else
+        detail::counting_iterator<int> count(update_begin-begin());
+#endif
+        const size_t n_in_order = 
+            detail::mismatch(order_start,order_end,count).first-order_start;
+        update_begin += n_in_order;
+        typename vector_int::const_iterator order_first = order_start+n_in_order;
+
+        const size_t n_update = update_end-update_begin;
+        const size_t n_alive = order_end-order_first;
+        if (n_alive == 0) {
+            // nothing to move, just remove any dead particles at the end
+            traits_type::resize(data,new_n);         
+            search.update_iterators(begin(),end());
+        } else if (n_alive == n_update && 
+                   move_out_of_place(update_begin,order_first,order_end)) {
+            // only the particles that change position have been moved
+            search.update_iterators(begin(),end());
+        } else if (n_alive > old_n/2) {
             traits_type::resize(other_data,new_n);
             // copy non-update region to other data buffer
             std::copy(begin(),update_begin,traits_type::begin(other_data));
             // gather update_region according to order to other data buffer
-            detail::gather(order_start,order_end,
+            detail::gather(order_first,order_end,
                     traits_type::begin(data),
                     traits_type::begin(other_data)+(update_begin-begin()));
             // swap to using other data buffer
@@ -810,7 +987,7 @@ private:
         } else {
             traits_type::resize(other_data,n_alive);
             // gather update_region to other buffer
-            detail::gather(order_start,order_end,
+            detail::gather(order_first,order_end,
                     traits_type::begin(data),
                     traits_type::begin(other_data));
             traits_type::resize(data,new_n);         
@@ -854,6 +1031,50 @@ private:
             */
     }
 
+    // if no particles are removed, a reorder often only changes the 
+    // position of a small number of particles (e.g. those that have moved 
+    // to a different bucket). If so, only move these particles and 
+    // return true
+    bool move_out_of_place(iterator update_begin,
+                 const typename vector_int::const_iterator& order_start,
+                 const typename vector_int::const_iterator& order_end) {
+        const size_t n = order_end-order_start;
+#if defined(__CUDACC__)
+        typedef typename thrust::detail::iterator_category_to_system<
+            typename vector_int::iterator::iterator_category
+            >::type system;
+        detail::counting_iterator<int,system> count(0);
+#else
+        detail::counting_iterator<int> count(0);
+#endif
+#ifdef __aboria_have_thrust__
+        const int* order_pointer = thrust::raw_pointer_cast(&*order_start);
+#else
+        const int* order_pointer = &*order_start;
+#endif
+        m_reorder_indicies.resize(n);
+        const size_t n_moved = detail::copy_if(count,count+n,count,
+                m_reorder_indicies.begin(),
+                detail::out_of_place_lambda(order_pointer,update_begin-begin()))
+            - m_reorder_indicies.begin();
+        if (n_moved > n/2) return false;
+
+        LOG(3,"Particles: moving "<<n_moved<<" out of place particles");
+        traits_type::resize(other_data,n_moved);
+        detail::gather(
+                detail::make_permutation_iterator(order_start,
+                                                  m_reorder_indicies.cbegin()),
+                detail::make_permutation_iterator(order_start,
+                                                  m_reorder_indicies.cbegin()+n_moved),
+                traits_type::begin(data),
+                traits_type::begin(other_data));
+        detail::scatter(traits_type::begin(other_data),
+                        traits_type::end(other_data),
+                        m_reorder_indicies.cbegin(),
+                        update_begin);
+        return true;
+    }
+
     template <class InputIterator>
     iterator insert_dispatch (iterator position, InputIterator first, InputIterator last, 
             std::false_type) {
@@ -880,6 +1101,8 @@ private:
     uint32_t seed;
     search_type search;
     vector_int m_delete_indicies;
+    // the particles moved by the last reorder
+    vector_int m_reorder_indicies;
 
 
 #ifdef HAVE_VTK
@@ -38,6 +38,10 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef HAVE_EIGEN
 
+#include "detail/LowRank.h"
+#include <functional>
+#include <numeric>
+
 namespace Aboria {
 
 template <template<typename> class Solver=Eigen::HouseholderQR>
@@ -53,6 +57,9 @@ class RASMPreconditioner {
     connectivity_type m_domain_buffer;
     connectivity_type m_domain_random;
     std::vector<solver_type> m_domain_factorized_matrix;
+    // scratch vectors used by _solve_impl, one pair per thread
+    mutable std::vector<vector_type> m_domain_x;
+    mutable std::vector<vector_type> m_domain_b;
     Scalar m_buffer;
     size_t m_goal;
     size_t m_random;
@@ -94,6 +101,11 @@ class RASMPreconditioner {
         m_random = n;
     }
 
+    /// returns the indicies of the particles in the interior of each domain
+    const std::vector<std::vector<size_t>>& get_domain_indicies() const {
+        return m_domain_indicies;
+    }
+
     template<typename Kernel, typename Query,
         unsigned int D = Query::dimension,
         typename box_type = detail::bbox<D>
@@ -332,62 +344,72 @@ class RASMPreconditioner {
 
         m_domain_factorized_matrix.resize(m_domain_indicies.size());
 
-        matrix_type domain_matrix;
+        // domains are independent, so factorize them in parallel with one
+        // domain matrix per thread. Domain sizes vary, so use dynamic 
+        // scheduling
+        #pragma omp parallel
+        {
+            matrix_type domain_matrix;
 
-        for (int domain_index = 0; domain_index < m_domain_factorized_matrix.size(); ++domain_index) {
-            const storage_vector_type& buffer = m_domain_buffer[domain_index];
-            const storage_vector_type& indicies = m_domain_indicies[domain_index];
-            const storage_vector_type& random = m_domain_random[domain_index];
-            solver_type& solver = m_domain_factorized_matrix[domain_index];
+            #pragma omp for schedule(dynamic)
+            for (int domain_index = 0; domain_index < m_domain_factorized_matrix.size(); ++domain_index) {
+                const storage_vector_type& buffer = m_domain_buffer[domain_index];
+                const storage_vector_type& indicies = m_domain_indicies[domain_index];
+                const storage_vector_type& random = m_domain_random[domain_index];
+                solver_type& solver = m_domain_factorized_matrix[domain_index];
 
-            const size_t size = indicies.size()+buffer.size()+random.size();
-            //std::cout << "domain "<<domain_index<<"indicies = "<<indicies.size()<<" buffer =  "<<buffer.size()<<" random = "<<random.size()<<std::endl;
+                const size_t size = indicies.size()+buffer.size()+random.size();
 
-            domain_matrix.resize(size,size);
+                domain_matrix.resize(size,size);
 
-            size_t i = 0;
-            for (const size_t& big_index_i: indicies) {
-                size_t j = 0;
-                for (const size_t& big_index_j: indicies) {
-                    domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
-                }
-                for (const size_t& big_index_j: buffer) {
-                    domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
-                }
-                for (const size_t& big_index_j: random) {
-                    domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
-                }
-                ++i;
-            }
-            for (const size_t& big_index_i: buffer) {
-                size_t j = 0;
-                for (const size_t& big_index_j: indicies) {
-                    domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
-                }
-                for (const size_t& big_index_j: buffer) {
-                    domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
-                }
-                for (const size_t& big_index_j: random) {
-                    domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
-                }
-                ++i;
-            }
-            for (const size_t& big_index_i: random) {
-                size_t j = 0;
-                for (const size_t& big_index_j: indicies) {
-                    domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                size_t i = 0;
+                for (const size_t& big_index_i: indicies) {
+                    size_t j = 0;
+                    for (const size_t& big_index_j: indicies) {
+                        domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                    }
+                    for (const size_t& big_index_j: buffer) {
+                        domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                    }
+                    for (const size_t& big_index_j: random) {
+                        domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                    }
+                    ++i;
                 }
-                for (const size_t& big_index_j: buffer) {
-                    domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                for (const size_t& big_index_i: buffer) {
+                    size_t j = 0;
+                    for (const size_t& big_index_j: indicies) {
+                        domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                    }
+                    for (const size_t& big_index_j: buffer) {
+                        domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                    }
+                    for (const size_t& big_index_j: random) {
+                        domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                    }
+                    ++i;
                 }
-                for (const size_t& big_index_j: random) {
-                    domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                for (const size_t& big_index_i: random) {
+                    size_t j = 0;
+                    for (const size_t& big_index_j: indicies) {
+                        domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                    }
+                    for (const size_t& big_index_j: buffer) {
+                        domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                    }
+                    for (const size_t& big_index_j: random) {
+                        domain_matrix(i,j++) = mat.coeff(big_index_i,big_index_j);
+                    }
+                    ++i;
                 }
-                ++i;
+                solver.compute(domain_matrix);
             }
-            solver.compute(domain_matrix);
         }
 
+        m_domain_x.clear();
+        m_domain_b.clear();
+        allocate_scratch();
+
         m_isInitialized = true;
 
         return *this;
@@ -405,20 +427,26 @@ class RASMPreconditioner {
     void _solve_impl(const Rhs& b, Dest& x) const
     {
         // loop over domains and invert relevent sub-matricies in
-        // mat
-        vector_type domain_x;
-        vector_type domain_b;
+        // mat. Each particle is in the interior of only one domain, so 
+        // domains can be solved in parallel without conflicting writes to x
+        allocate_scratch();
         x = b;
+        #pragma omp parallel for schedule(dynamic)
         for (int i = 0; i < m_domain_indicies.size(); ++i) {
             if (m_domain_indicies.size() == 0) continue;
 
+#ifdef HAVE_OPENMP
+            const size_t thread = omp_get_thread_num();
+#else
+            const size_t thread = 0;
+#endif
             const storage_vector_type& buffer = m_domain_buffer[i];
             const storage_vector_type& indicies = m_domain_indicies[i];
             const storage_vector_type& random = m_domain_random[i];
             
             const size_t nb = indicies.size()+buffer.size()+random.size();
-            domain_x.resize(nb);
-            domain_b.resize(nb);
+            auto domain_x = m_domain_x[thread].head(nb);
+            auto domain_b = m_domain_b[thread].head(nb);
 
             // copy x values from big vector
             size_t sub_index = 0;
@@ -456,9 +484,802 @@ class RASMPreconditioner {
     Eigen::ComputationInfo info() { return Eigen::Success; }
 
   protected:
+    // makes sure there is a pair of scratch vectors for each thread, large 
+    // enough for the largest domain
+    void allocate_scratch() const {
+#ifdef HAVE_OPENMP
+        const size_t nthreads = omp_get_max_threads();
+#else
+        const size_t nthreads = 1;
+#endif
+        if (m_domain_x.size() >= nthreads) return;
+
+        size_t max_size = 0;
+        for (int domain_index = 0; domain_index < m_domain_indicies.size(); ++domain_index) {
+            max_size = std::max(max_size, m_domain_indicies[domain_index].size()
+                                         +m_domain_buffer[domain_index].size()
+                                         +m_domain_random[domain_index].size());
+        }
+        m_domain_x.resize(nthreads);
+        m_domain_b.resize(nthreads);
+        for (size_t i = 0; i < nthreads; ++i) {
+            m_domain_x[i].resize(max_size);
+            m_domain_b[i].resize(max_size);
+        }
+    }
+
     bool m_isInitialized;
 };
 
+/// \brief A two-level restricted additive schwarz preconditioner
+///
+/// The fine level is a RASMPreconditioner. The coarse space is spanned by 
+/// a Nicolaides (partition of unity) basis: consecutive fine domains, which 
+/// are in tree order and so are spatially compact, are grouped into at most
+/// set_max_coarse_size() aggregates, and each basis vector is the indicator
+/// function of one aggregate. The coarse operator is the Galerkin projection
+/// A_0 = Z^T A Z, and the two levels are combined multiplicatively
+///
+/// x_0 = Z A_0^{-1} Z^T b
+/// x = x_0 + M_{RAS}^{-1} (b - A x_0)
+///
+/// The coarse level removes the global (smooth) error that the local 
+/// domains cannot see, so that the number of iterations grows much more 
+/// slowly with problem size. As the coarse size is capped independently of
+/// the number of particles, the dense coarse solve stays cheap. 
+///
+/// Calculating A_0 in factorize() needs one multiplication by the matrix 
+/// for each coarse basis vector. Each application of the preconditioner 
+/// needs one multiplication by the matrix (for the residual b - A x_0) in 
+/// addition to the coarse and fine solves, so an iterative solver using this
+/// preconditioner does two matrix-vector products per iteration. The matrix 
+/// passed to factorize() is used for these products and must outlive the 
+/// preconditioner (this is always true when used via an Eigen iterative 
+/// solver)
+template <template<typename> class Solver=Eigen::HouseholderQR>
+class TwoLevelRASMPreconditioner {
+    typedef double Scalar;
+    typedef size_t Index;
+    typedef Eigen::Matrix<Scalar,Eigen::Dynamic,Eigen::Dynamic> matrix_type;
+    typedef Eigen::Matrix<Scalar,Eigen::Dynamic,1> vector_type;
+    typedef Solver<matrix_type> solver_type;
+    typedef std::vector<size_t> storage_vector_type;
+
+    RASMPreconditioner<Solver> m_fine;
+    // the rows in each coarse aggregate are 
+    // m_coarse_indicies[m_coarse_offsets[k]:m_coarse_offsets[k+1]]
+    storage_vector_type m_coarse_indicies;
+    storage_vector_type m_coarse_offsets;
+    solver_type m_coarse_factorized_matrix;
+    std::function<void(const vector_type&, vector_type&)> m_multiply;
+    size_t m_max_coarse_size;
+    Index m_rows;
+    Index m_cols;
+    bool m_isInitialized;
+
+  public:
+    typedef typename vector_type::StorageIndex StorageIndex;
+    enum {
+      ColsAtCompileTime = Eigen::Dynamic,
+      MaxColsAtCompileTime = Eigen::Dynamic
+    };
+
+    TwoLevelRASMPreconditioner(): 
+        m_coarse_offsets(1,0),
+        m_max_coarse_size(256),
+        m_rows(0),
+        m_cols(0),
+        m_isInitialized(false)
+    {}
+
+    template<typename MatType>
+    explicit TwoLevelRASMPreconditioner(const MatType& mat):
+        TwoLevelRASMPreconditioner() {
+      compute(mat);
+    }
+
+    Index rows() const { return m_rows; }
+    Index cols() const { return m_cols; }
+
+    void set_buffer_size(double size) {
+        m_fine.set_buffer_size(size);
+    }
+
+    void set_number_of_particles_per_domain(size_t n) {
+        m_fine.set_number_of_particles_per_domain(n);
+    }
+
+    /// sets the maximum number of coarse basis vectors (default 256). If 
+    /// there are more fine domains than this, neighbouring domains share a 
+    /// basis vector
+    void set_max_coarse_size(size_t n) {
+        m_max_coarse_size = n;
+    }
+
+    /// the number of coarse basis vectors
+    size_t get_coarse_size() const {
+        return m_coarse_offsets.size()-1;
+    }
+
+    const RASMPreconditioner<Solver>& get_fine_preconditioner() const {
+        return m_fine;
+    }
+
+    template<typename MatType>
+    TwoLevelRASMPreconditioner& analyzePattern(const MatType& mat) {
+        m_fine.analyzePattern(mat);
+        m_rows = mat.rows();
+        m_cols = mat.cols();
+
+        // group consecutive fine domains into at most m_max_coarse_size
+        // aggregates
+        const std::vector<storage_vector_type>& domains = 
+                                        m_fine.get_domain_indicies();
+        const size_t ndomains = domains.size();
+        const size_t ncoarse = std::min(std::max(m_max_coarse_size,size_t(1)),
+                                        ndomains);
+        m_coarse_indicies.clear();
+        m_coarse_offsets.assign(1,0);
+        for (size_t k = 0; k < ncoarse; ++k) {
+            for (size_t d = (k*ndomains)/ncoarse; d < ((k+1)*ndomains)/ncoarse; ++d) {
+                m_coarse_indicies.insert(m_coarse_indicies.end(),
+                                         domains[d].begin(),domains[d].end());
+            }
+            m_coarse_offsets.push_back(m_coarse_indicies.size());
+        }
+        LOG(2,"TwoLevelRASMPreconditioner: using "<<ncoarse<<" coarse basis vectors for "<<ndomains<<" domains");
+        return *this;
+    }
+
+    template<typename MatType>
+    TwoLevelRASMPreconditioner& factorize(const MatType& mat) {
+        LOG(2,"TwoLevelRASMPreconditioner: factorizing coarse and fine levels");
+        m_fine.factorize(mat);
+
+        const MatType* mat_ptr = &mat;
+        m_multiply = [mat_ptr](const vector_type& x, vector_type& y) {
+            y = (*mat_ptr)*x;
+        };
+
+        // A_0 = Z^T A Z, one column at a time
+        const size_t n = get_coarse_size();
+        matrix_type coarse_matrix(n,n);
+        vector_type z = vector_type::Zero(m_cols);
+        vector_type Az;
+        for (size_t k = 0; k < n; ++k) {
+            set_coarse_basis(k,z,1.0);
+            m_multiply(z,Az);
+            set_coarse_basis(k,z,0.0);
+            restrict_to_coarse(Az,coarse_matrix.col(k));
+        }
+        m_coarse_factorized_matrix.compute(coarse_matrix);
+
+        m_isInitialized = true;
+        return *this;
+    }
+
+    template<typename MatType>
+    TwoLevelRASMPreconditioner& compute(const MatType& mat) {
+        analyzePattern(mat);
+        return factorize(mat);
+    }
+
+    /** \internal */
+    template<typename Rhs, typename Dest>
+    void _solve_impl(const Rhs& b, Dest& x) const {
+        const size_t n = get_coarse_size();
+
+        // coarse solve
+        vector_type coarse_b(n);
+        restrict_to_coarse(b,coarse_b);
+        const vector_type coarse_x = m_coarse_factorized_matrix.solve(coarse_b);
+        vector_type x0 = vector_type::Zero(b.size());
+        for (size_t k = 0; k < n; ++k) {
+            set_coarse_basis(k,x0,coarse_x[k]);
+        }
+
+        // fine solve on the residual
+        vector_type residual;
+        m_multiply(x0,residual);
+        residual = b - residual;
+        m_fine._solve_impl(residual,x);
+        x += x0;
+    }
+
+    template<typename Rhs> 
+    inline const Eigen::Solve<TwoLevelRASMPreconditioner, Rhs>
+    solve(const Eigen::MatrixBase<Rhs>& b) const {
+        eigen_assert(m_rows==b.rows()
+                && "TwoLevelRASMPreconditioner::solve(): invalid number of rows of the right hand side matrix b");
+        eigen_assert(m_isInitialized 
+                && "TwoLevelRASMPreconditioner is not initialized.");
+        return Eigen::Solve<TwoLevelRASMPreconditioner, Rhs>(*this, b.derived());
+    }
+    
+    Eigen::ComputationInfo info() { return Eigen::Success; }
+
+private:
+    // sets the entries of x in the support of coarse basis vector k to value
+    template<typename Vector>
+    void set_coarse_basis(const size_t k, Vector& x, const Scalar value) const {
+        for (size_t i = m_coarse_offsets[k]; i < m_coarse_offsets[k+1]; ++i) {
+            x[m_coarse_indicies[i]] = value;
+        }
+    }
+
+    // coarse_x = Z^T x
+    template<typename Vector, typename CoarseVector>
+    void restrict_to_coarse(const Vector& x, CoarseVector&& coarse_x) const {
+        for (size_t k = 0; k < get_coarse_size(); ++k) {
+            Scalar sum = 0;
+            for (size_t i = m_coarse_offsets[k]; i < m_coarse_offsets[k+1]; ++i) {
+                sum += x[m_coarse_indicies[i]];
+            }
+            coarse_x[k] = sum;
+        }
+    }
+};
+
+
+/// \brief A hierarchical off-diagonal low rank (HODLR) direct solver
+///
+/// The rows are permuted into the order of the particle tree (the leaf 
+/// buckets in depth-first order), so that contiguous index ranges are 
+/// spatially compact. The permuted matrix is split recursively in half, 
+/// down to leaves with at most set_max_leaf_size() rows. At each level the 
+/// two off-diagonal blocks are compressed using partially pivoted ACA, 
+/// giving
+///
+/// A = D + U V, D = diag(A_{00}, A_{11}), A_{01} = U_0 V_0, A_{10} = U_1 V_1
+///
+/// which is inverted using the Sherman-Morrison-Woodbury formula
+///
+/// A^{-1} b = D^{-1} b - W (I + V W)^{-1} V D^{-1} b, W = D^{-1} U
+///
+/// The factorization (the dense LU of each leaf, the matrices W and V and 
+/// the small matrices I + V W at each level) costs O(N k^2 log^2 N) for 
+/// off-diagonal rank k, and each solve O(N k log N), so it can be reused 
+/// for many right hand sides. Only coefficients of the matrix are needed, 
+/// so this works with any Aboria operator (e.g. KernelH2, KernelFMM, 
+/// KernelDense). Use a small tolerance (set_tolerance()) for a direct 
+/// solver, or a larger tolerance for a cheap preconditioner for an Eigen 
+/// iterative solver
+template <template<typename> class Solver=Eigen::PartialPivLU>
+class HODLRSolver {
+    typedef double Scalar;
+    typedef size_t Index;
+    typedef Eigen::Matrix<Scalar,Eigen::Dynamic,Eigen::Dynamic> matrix_type;
+    typedef Eigen::Matrix<Scalar,Eigen::Dynamic,1> vector_type;
+    typedef Solver<matrix_type> solver_type;
+    typedef std::vector<size_t> storage_vector_type;
+
+    struct node_type {
+        // range of permuted indicies in this node
+        size_t begin;
+        size_t end;
+        // children, or -1 for a leaf
+        int child[2];
+        // for a leaf, the factorized diagonal block. Otherwise the 
+        // factorized matrix I + V W
+        solver_type factorized_matrix;
+        // A_{c,1-c} = U_c V_c
+        matrix_type V[2];
+        // W_c = A_{cc}^{-1} U_c
+        matrix_type W[2];
+    };
+
+    // the matrix applied to a block of particles, used by the ACA
+    template <typename MatType>
+    struct matrix_block {
+        typedef Eigen::Index Index;
+        enum {
+            RowsAtCompileTime = Eigen::Dynamic,
+            ColsAtCompileTime = Eigen::Dynamic
+        };
+        const MatType& m_mat;
+        const size_t* m_row_indicies;
+        const size_t* m_col_indicies;
+        const Index m_rows;
+        const Index m_cols;
+
+        Index rows() const { return m_rows; }
+        Index cols() const { return m_cols; }
+
+        Scalar coeff(const Index i, const Index j) const {
+            return m_mat.coeff(m_row_indicies[i],m_col_indicies[j]);
+        }
+    };
+
+    std::vector<node_type> m_nodes;
+    // m_indicies[i] is the original index of permuted index i
+    storage_vector_type m_indicies;
+    size_t m_leaf_size;
+    double m_epsilon;
+    size_t m_max_rank;
+    Index m_rows;
+    Index m_cols;
+    bool m_isInitialized;
+
+  public:
+    typedef typename vector_type::StorageIndex StorageIndex;
+    enum {
+      ColsAtCompileTime = Eigen::Dynamic,
+      MaxColsAtCompileTime = Eigen::Dynamic
+    };
+
+    HODLRSolver(): 
+        m_leaf_size(64),
+        m_epsilon(1e-8),
+        m_max_rank(256),
+        m_rows(0),
+        m_cols(0),
+        m_isInitialized(false)
+    {}
+
+    template<typename MatType>
+    explicit HODLRSolver(const MatType& mat):
+        HODLRSolver() {
+      compute(mat);
+    }
+
+    Index rows() const { return m_rows; }
+    Index cols() const { return m_cols; }
+
+    /// sets the maximum number of rows in a leaf of the HODLR tree, 
+    /// which are stored and factorized densely
+    void set_max_leaf_size(size_t n) {
+        m_leaf_size = n;
+    }
+
+    /// sets the relative tolerance used for the ACA of the off-diagonal 
+    /// blocks
+    void set_tolerance(double epsilon) {
+        m_epsilon = epsilon;
+    }
+
+    /// sets the maximum rank of the off-diagonal blocks
+    void set_max_rank(size_t n) {
+        m_max_rank = n;
+    }
+
+    /// analyze an Aboria MatrixReplacement, ordering the indicies of 
+    /// each diagonal block using the particle tree
+    template<unsigned int NI, unsigned int NJ, typename Blocks>
+    HODLRSolver& analyzePattern(const MatrixReplacement<NI,NJ,Blocks>& mat) {
+        static_assert(NI == NJ, "HODLRSolver requires a square block operator");
+        LOG(2,"HODLRSolver: analyze pattern");
+        m_rows = mat.rows();
+        m_cols = mat.cols();
+        CHECK(m_rows == m_cols, "HODLRSolver requires a square matrix");
+        m_indicies.clear();
+        analyze_impl(mat, detail::make_index_sequence<NI>());
+        CHECK(m_indicies.size() == m_rows, "HODLRSolver: tree ordering does not include every row");
+        build_tree();
+        return *this;
+    }
+
+    /// analyze a general matrix, keeping the original ordering
+    template<typename MatType>
+    HODLRSolver& analyzePattern(const MatType& mat) {
+        LOG(2,"HODLRSolver: analyze pattern");
+        m_rows = mat.rows();
+        m_cols = mat.cols();
+        CHECK(m_rows == m_cols, "HODLRSolver requires a square matrix");
+        m_indicies.resize(m_rows);
+        std::iota(m_indicies.begin(),m_indicies.end(),0);
+        build_tree();
+        return *this;
+    }
+
+    template<typename MatType>
+    HODLRSolver& factorize(const MatType& mat) {
+        LOG(2,"HODLRSolver: factorizing");
+        eigen_assert(m_rows==mat.rows()
+                && "HODLRSolver::factorize(): invalid number of rows of mat");
+        eigen_assert(m_cols==mat.cols()
+                && "HODLRSolver::factorize(): invalid number of cols of mat");
+
+        // the two halves of each node are independent, so factorize the 
+        // tree using tasks
+        #pragma omp parallel
+        #pragma omp single
+        factorize_node(0,mat);
+
+        size_t max_rank = 0;
+        size_t nstored = 0;
+        for (const node_type& node: m_nodes) {
+            if (node.child[0] < 0) {
+                nstored += (node.end-node.begin)*(node.end-node.begin);
+            } else {
+                for (int c = 0; c < 2; ++c) {
+                    max_rank = std::max(max_rank,size_t(node.V[c].rows()));
+                    nstored += node.V[c].size() + node.W[c].size();
+                }
+            }
+        }
+        LOG(2,"HODLRSolver: finished factorizing, max rank = "<<max_rank<<", storing "<<nstored<<" values (dense matrix has "<<m_rows*m_cols<<")");
+
+        m_isInitialized = true;
+        return *this;
+    }
+
+    template<typename MatType>
+    HODLRSolver& compute(const MatType& mat) {
+        analyzePattern(mat);
+        return factorize(mat);
+    }
+
+    /** \internal */
+    template<typename Rhs, typename Dest>
+    void _solve_impl(const Rhs& b, Dest& x) const {
+        matrix_type permuted_b(m_rows,b.cols());
+        #pragma omp parallel for
+        for (size_t i = 0; i < m_rows; ++i) {
+            permuted_b.row(i) = b.row(m_indicies[i]);
+        }
+
+        #pragma omp parallel
+        #pragma omp single
+        solve_node(0,permuted_b);
+
+        #pragma omp parallel for
+        for (size_t i = 0; i < m_rows; ++i) {
+            x.row(m_indicies[i]) = permuted_b.row(i);
+        }
+    }
+
+    template<typename Rhs> 
+    inline const Eigen::Solve<HODLRSolver, Rhs>
+    solve(const Eigen::MatrixBase<Rhs>& b) const {
+        eigen_assert(m_rows==b.rows()
+                && "HODLRSolver::solve(): invalid number of rows of the right hand side matrix b");
+        eigen_assert(m_isInitialized 
+                && "HODLRSolver is not initialized.");
+        return Eigen::Solve<HODLRSolver, Rhs>(*this, b.derived());
+    }
+    
+    Eigen::ComputationInfo info() { return Eigen::Success; }
+
+  private:
+    template <typename Kernel>
+    void analyze_impl_block(const Index start_row, const Kernel& kernel) {
+        typedef typename Kernel::row_particles_type row_particles_type;
+        typedef typename Kernel::col_particles_type col_particles_type;
+        typedef typename row_particles_type::query_type query_type;
+        typedef typename row_particles_type::position position;
+
+        static_assert(std::is_same<row_particles_type,col_particles_type>::value,
+           "HODLR solver restricted to identical row and col particle sets");
+        const row_particles_type& a = kernel.get_row_particles();
+        CHECK(&a == &(kernel.get_col_particles()),
+           "HODLR solver restricted to identical row and col particle sets");
+        const query_type& query = a.get_query();
+        for (auto& bucket: query.get_subtree()) {
+            if (query.is_leaf_node(bucket)) { 
+                for (auto& p: query.get_bucket_particles(bucket)) {
+                    m_indicies.push_back(start_row + (&get<position>(p)
+                                   - &get<position>(a)[0]));
+                }
+            }
+        }
+    }
+
+    template <typename RowParticles, typename ColParticles>
+    void analyze_impl_block(
+            const Index start_row, 
+            const KernelZero<RowParticles,ColParticles>& kernel) {
+        for (size_t i = 0; i < kernel.rows(); ++i) {
+            m_indicies.push_back(start_row + i);
+        }
+    }
+     
+    template<unsigned int NI, unsigned int NJ, typename Blocks, std::size_t... I>
+    void analyze_impl(const MatrixReplacement<NI,NJ,Blocks>& mat, 
+                        detail::index_sequence<I...>) {
+        int dummy[] = { 0, 
+          (analyze_impl_block(mat.template start_row<I>(),std::get<I*NJ+I>(mat.m_blocks)),0)... 
+            };
+        static_cast<void>(dummy);
+    }
+
+    // recursively halve the permuted indicies
+    void build_tree() {
+        m_nodes.clear();
+        if (m_rows > 0) {
+            build_node(0,m_rows);
+        }
+        LOG(2,"HODLRSolver: finished analysis, created "<<m_nodes.size()<<" nodes");
+    }
+
+    int build_node(const size_t begin, const size_t end) {
+        const int index = m_nodes.size();
+        m_nodes.emplace_back();
+        m_nodes[index].begin = begin;
+        m_nodes[index].end = end;
+        if (end-begin <= m_leaf_size) {
+            m_nodes[index].child[0] = -1;
+            m_nodes[index].child[1] = -1;
+        } else {
+            const size_t middle = (begin+end)/2;
+            const int child0 = build_node(begin,middle);
+            const int child1 = build_node(middle,end);
+            m_nodes[index].child[0] = child0;
+            m_nodes[index].child[1] = child1;
+        }
+        return index;
+    }
+
+    template<typename MatType>
+    void factorize_node(const int index, const MatType& mat) {
+        node_type& node = m_nodes[index];
+        const size_t n = node.end-node.begin;
+        if (node.child[0] < 0) {
+            matrix_type leaf_matrix(n,n);
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t j = 0; j < n; ++j) {
+                    leaf_matrix(i,j) = mat.coeff(m_indicies[node.begin+i],
+                                                 m_indicies[node.begin+j]);
+                }
+            }
+            node.factorized_matrix.compute(leaf_matrix);
+            return;
+        }
+
+        // factorize the children and compress the off-diagonal blocks
+        for (int c = 0; c < 2; ++c) {
+            #pragma omp task default(shared) firstprivate(c)
+            factorize_node(node.child[c],mat);
+
+            #pragma omp task default(shared) firstprivate(c)
+            {
+                const node_type& row_node = m_nodes[node.child[c]];
+                const node_type& col_node = m_nodes[node.child[1-c]];
+                const size_t nrows = row_node.end-row_node.begin;
+                const size_t ncols = col_node.end-col_node.begin;
+                matrix_block<MatType> Z{mat,
+                    m_indicies.data()+row_node.begin,
+                    m_indicies.data()+col_node.begin,
+                    static_cast<Eigen::Index>(nrows),
+                    static_cast<Eigen::Index>(ncols)};
+                const size_t max_k = std::min(std::min(nrows,ncols),m_max_rank);
+                node.W[c].resize(nrows,max_k);
+                node.V[c].resize(max_k,ncols);
+                const size_t k = detail::adaptive_cross_approximation_partial(
+                        Z,max_k,m_epsilon,node.W[c],node.V[c]);
+                node.W[c].conservativeResize(nrows,k);
+                node.V[c].conservativeResize(k,ncols);
+            }
+        }
+        #pragma omp taskwait
+
+        // W_c = A_{cc}^{-1} U_c
+        for (int c = 0; c < 2; ++c) {
+            #pragma omp task default(shared) firstprivate(c)
+            solve_node(node.child[c],node.W[c]);
+        }
+        #pragma omp taskwait
+
+        const size_t k0 = node.V[0].rows();
+        const size_t k1 = node.V[1].rows();
+        matrix_type K = matrix_type::Identity(k0+k1,k0+k1);
+        K.topRightCorner(k0,k1) = node.V[0]*node.W[1];
+        K.bottomLeftCorner(k1,k0) = node.V[1]*node.W[0];
+        if (k0+k1 > 0) {
+            node.factorized_matrix.compute(K);
+        }
+    }
+
+    // X = A^{-1} X, for the diagonal block of node index
+    void solve_node(const int index, Eigen::Ref<matrix_type> X) const {
+        const node_type& node = m_nodes[index];
+        if (node.child[0] < 0) {
+            X = node.factorized_matrix.solve(X).eval();
+            return;
+        }
+
+        const size_t n0 = m_nodes[node.child[0]].end-node.begin;
+        auto X0 = X.topRows(n0);
+        auto X1 = X.bottomRows(X.rows()-n0);
+
+        // D^{-1} X
+        #pragma omp task default(shared)
+        solve_node(node.child[0],X0);
+        #pragma omp task default(shared)
+        solve_node(node.child[1],X1);
+        #pragma omp taskwait
+
+        // correction from the off-diagonal blocks
+        const size_t k0 = node.V[0].rows();
+        const size_t k1 = node.V[1].rows();
+        if (k0+k1 > 0) {
+            matrix_type R(k0+k1,X.cols());
+            R.topRows(k0).noalias() = node.V[0]*X1;
+            R.bottomRows(k1).noalias() = node.V[1]*X0;
+            const matrix_type Z = node.factorized_matrix.solve(R);
+            X0.noalias() -= node.W[0]*Z.topRows(k0);
+            X1.noalias() -= node.W[1]*Z.bottomRows(k1);
+        }
+    }
+};
+
+namespace detail {
+// returns solver.info() for solvers that have it (e.g. the Eigen iterative 
+// solvers), and Eigen::Success for those that do not (e.g. 
+// Eigen::PartialPivLU)
+template <typename Solver>
+auto solver_info(const Solver& solver, int) -> decltype(solver.info()) {
+    return solver.info();
+}
+
+template <typename Solver>
+Eigen::ComputationInfo solver_info(const Solver& solver, long) {
+    return Eigen::Success;
+}
+}
+
+/// \brief Mixed precision iterative refinement
+///
+/// Solves A x = b, where A is an accurate operator (e.g. a KernelDense or 
+/// KernelH2 with a high expansion order), using an inner solver for a 
+/// cheaper, lower precision approximation A_low of A. Each iteration 
+/// computes the residual 
+/// 
+/// r = b - A x
+///
+/// in double precision, and corrects the solution using the inner solver
+///
+/// x = x + A_low^{-1} r
+///
+/// The precision of the inner solve is set by the inner solver's scalar 
+/// type. If this is float (e.g. an Eigen::PartialPivLU<Eigen::MatrixXf>, or
+/// an Eigen::GMRES on an Eigen::MatrixXf) the residual is scaled to unit 
+/// norm and rounded to single precision, and the whole inner solve runs in 
+/// single precision. If it is double, A_low should store and apply its 
+/// coefficients in single precision to be cheaper than A, e.g. 
+/// create_matrix_operator() or create_h2_operator() with single_precision 
+/// = true. 
+///
+/// The inner solve only needs to reduce the residual by a modest factor 
+/// (e.g. 1e-4), so most of the work uses the cheap operator, while the 
+/// final accuracy is set by A. The iteration stops when the relative 
+/// residual is below set_tolerance(), if a correction fails to reduce the 
+/// residual (i.e. A_low is not a good enough approximation), or if the 
+/// inner solver reports a numerical issue
+///
+/// \tparam MatrixType the type of the accurate operator A
+/// \tparam InnerSolver the type of the inner solver. Use inner_solver() to 
+///         set it up (including calling its compute()) before solving
+template <typename MatrixType, typename InnerSolver>
+class IterativeRefinement {
+    typedef double Scalar;
+    typedef size_t Index;
+    typedef Eigen::Matrix<Scalar,Eigen::Dynamic,1> vector_type;
+    typedef typename InnerSolver::Scalar inner_scalar;
+    typedef Eigen::Matrix<inner_scalar,Eigen::Dynamic,1> inner_vector_type;
+
+    const MatrixType* m_mat;
+    InnerSolver m_inner_solver;
+    double m_tolerance;
+    size_t m_max_iterations;
+    mutable size_t m_iterations;
+    mutable double m_error;
+    mutable Eigen::ComputationInfo m_info;
+
+  public:
+    typedef typename vector_type::StorageIndex StorageIndex;
+    enum {
+      ColsAtCompileTime = Eigen::Dynamic,
+      MaxColsAtCompileTime = Eigen::Dynamic
+    };
+
+    IterativeRefinement(): 
+        m_mat(nullptr),
+        m_tolerance(1e-10),
+        m_max_iterations(20),
+        m_iterations(0),
+        m_error(0),
+        m_info(Eigen::Success)
+    {}
+
+    explicit IterativeRefinement(const MatrixType& mat):
+        IterativeRefinement() {
+      compute(mat);
+    }
+
+    Index rows() const { return m_mat->rows(); }
+    Index cols() const { return m_mat->cols(); }
+
+    /// the solver used for the low precision correction
+    InnerSolver& inner_solver() { return m_inner_solver; }
+    const InnerSolver& inner_solver() const { return m_inner_solver; }
+
+    /// sets the relative residual |b - A x|/|b| at which to stop
+    void set_tolerance(double tolerance) {
+        m_tolerance = tolerance;
+    }
+
+    /// sets the maximum number of refinement (outer) iterations
+    void set_max_iterations(size_t n) {
+        m_max_iterations = n;
+    }
+
+    /// the number of refinement iterations taken by the last solve. For 
+    /// multiple right hand sides this is the maximum over the columns
+    size_t iterations() const { return m_iterations; }
+
+    /// the relative residual at the end of the last solve. For multiple 
+    /// right hand sides this is the maximum over the columns
+    double error() const { return m_error; }
+
+    IterativeRefinement& compute(const MatrixType& mat) {
+        m_mat = &mat;
+        return *this;
+    }
+
+    /** \internal */
+    template<typename Rhs, typename Dest>
+    void _solve_impl(const Rhs& b, Dest& x) const {
+        m_info = Eigen::Success;
+        m_iterations = 0;
+        m_error = 0;
+        for (int c = 0; c < b.cols(); ++c) {
+            const vector_type bc = b.col(c);
+            const double b_norm = bc.norm();
+            vector_type xc = vector_type::Zero(bc.size());
+            vector_type r = bc;
+            double error = b_norm > 0 ? 1.0 : 0.0;
+            size_t iterations = 0;
+            while (error > m_tolerance && iterations < m_max_iterations) {
+                // scale the residual so it can be represented accurately by 
+                // the inner scalar type 
+                const double r_norm = r.norm();
+                const inner_vector_type inner_r = (r/r_norm).template cast<inner_scalar>();
+                const inner_vector_type inner_correction = m_inner_solver.solve(inner_r);
+                const Eigen::ComputationInfo inner_info = 
+                                        detail::solver_info(m_inner_solver,0);
+                if (inner_info != Eigen::Success) {
+                    LOG(2,"IterativeRefinement: inner solver did not succeed (info = "<<inner_info<<")");
+                    if (inner_info != Eigen::NoConvergence) {
+                        // the correction cannot be trusted
+                        m_info = inner_info;
+                        break;
+                    }
+                }
+                const vector_type new_x = xc 
+                        + r_norm*inner_correction.template cast<Scalar>();
+                r = bc - (*m_mat)*new_x;
+                const double new_error = r.norm()/b_norm;
+                ++iterations;
+                LOG(3,"IterativeRefinement: iteration "<<iterations<<" error = "<<new_error);
+                if (new_error >= error) {
+                    // the correction did not help, keep the previous solution
+                    break;
+                }
+                xc = new_x;
+                error = new_error;
+            }
+            LOG(2,"IterativeRefinement: finished after "<<iterations<<" iterations, error = "<<error);
+            if (error > m_tolerance && m_info == Eigen::Success) {
+                m_info = Eigen::NoConvergence;
+            }
+            m_iterations = std::max(m_iterations,iterations);
+            m_error = std::max(m_error,error);
+            x.col(c) = xc;
+        }
+    }
+
+    template<typename Rhs> 
+    inline const Eigen::Solve<IterativeRefinement, Rhs>
+    solve(const Eigen::MatrixBase<Rhs>& b) const {
+        eigen_assert(m_mat != nullptr 
+                && "IterativeRefinement is not initialized.");
+        eigen_assert(rows()==b.rows()
+                && "IterativeRefinement::solve(): invalid number of rows of the right hand side matrix b");
+        return Eigen::Solve<IterativeRefinement, Rhs>(*this, b.derived());
+    }
+    
+    Eigen::ComputationInfo info() const { return m_info; }
+};
 }
 
 #endif //HAVE_EIGEN
@@ -52,7 +52,11 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <iostream>
 #include <queue>
+#include <vector>
+#include <algorithm>
+#include <utility>
 #include <cmath>
+#include <limits>
 #include "Log.h"
 
 namespace Aboria {
@@ -688,6 +692,320 @@ get_neighbouring_buckets(const Query& query) {
     return iterator_range<Iterator>(Iterator(query),Iterator());
 }
 
+/// Finds the \p k nearest neighbours (using the euclidean distance) of each 
+/// point in \p points. The query points are processed in parallel (if OpenMP
+/// is enabled).
+///
+/// The results are written to the flat arrays \p indices and \p distances,
+/// which are resized to `k*points.size()` (so can be reused across calls 
+/// without reallocation). The neighbours of point `i` are stored in 
+/// `[i*k,(i+1)*k)`, sorted by increasing distance, and the indices refer to
+/// the particles' position in their container. 
+///
+/// For each point the search starts at the radius expected to contain \p k 
+/// particles (assuming they are uniformly distributed over the domain), and 
+/// this is doubled until at least \p k particles are found, so it works for 
+/// all the neighbour search data structures. The points can lie outside the 
+/// domain if it is not periodic.
+///
+/// \param query the neighbour search query object (e.g. Particles::get_query())
+/// \param points a random access container of the query positions
+/// \param k the number of neighbours to find, must be less than or equal to 
+/// the number of particles
+/// \param indices the output particle indices
+/// \param distances the output distances
+template <typename Query, typename Points>
+void knn_search(const Query& query, const Points& points, const size_t k,
+                std::vector<size_t>& indices, std::vector<double>& distances) {
+    typedef typename Query::traits_type Traits;
+    static const unsigned int dimension = Traits::dimension;
+    typedef typename Traits::position position;
+    typedef Vector<double,dimension> double_d;
+    typedef typename Query::particle_iterator::reference particle_reference;
+
+    const size_t n = query.number_of_particles();
+    const size_t npoints = points.size();
+    CHECK(k <= n, "knn_search: k is larger than the number of particles");
+    indices.resize(k*npoints);
+    distances.resize(k*npoints);
+    if (k == 0) return;
+
+    const double_d& bmin = query.get_bounds().bmin;
+    const double_d& bmax = query.get_bounds().bmax;
+    const double_d width = bmax-bmin;
+    const double initial_radius = std::pow(width.prod()*k/n,1.0/dimension);
+    const bool periodic = query.get_periodic().any();
+    // a radius larger than this might find more than one periodic image of 
+    // a particle
+    double min_periodic_half_width = std::numeric_limits<double>::max();
+    for (size_t d = 0; d < dimension; ++d) {
+        if (query.get_periodic()[d]) {
+            min_periodic_half_width = std::min(min_periodic_half_width,0.5*width[d]);
+        }
+    }
+    const double_d* positions_begin = get<position>(query.get_particles_begin());
+
+    LOG(3,"knn_search: searching for k = "<<k<<" neighbours of "<<npoints<<" points, initial radius = "<<initial_radius);
+
+    #pragma omp parallel
+    {
+        std::vector<std::pair<double,size_t>> candidates;
+
+        #pragma omp for
+        for (size_t i = 0; i < npoints; ++i) {
+            const double_d& point = points[i];
+            // every particle is within max_radius of the point
+            double_d furthest;
+            for (size_t d = 0; d < dimension; ++d) {
+                furthest[d] = query.get_periodic()[d] ? width[d] :
+                                std::max(std::abs(point[d]-bmin[d]),
+                                         std::abs(point[d]-bmax[d]));
+            }
+            const double max_radius = furthest.norm();
+            double radius = std::min(initial_radius,max_radius);
+            for (;;) {
+                candidates.clear();
+                for (auto pairj: euclidean_search(query,point,radius)) {
+                    particle_reference pj = detail::get_impl<0>(pairj);
+                    const double_d& dx = detail::get_impl<1>(pairj);
+                    candidates.push_back(std::make_pair(dx.squaredNorm(),
+                                      &get<position>(pj)-positions_begin));
+                }
+                if (periodic && radius >= min_periodic_half_width) {
+                    // large radius might find more than one periodic image
+                    // of a particle, keep only the closest
+                    std::sort(candidates.begin(),candidates.end(),
+                            [](const std::pair<double,size_t>& a,
+                               const std::pair<double,size_t>& b) {
+                                return a.second < b.second || 
+                                    (a.second == b.second && a.first < b.first);
+                            });
+                    candidates.erase(std::unique(candidates.begin(),candidates.end(),
+                            [](const std::pair<double,size_t>& a,
+                               const std::pair<double,size_t>& b) {
+                                return a.second == b.second;
+                            }),candidates.end());
+                }
+                if (candidates.size() >= k || radius >= max_radius) break;
+                radius = std::min(2*radius,max_radius);
+            }
+            CHECK(candidates.size() >= k,"knn_search: did not find k neighbours");
+            std::partial_sort(candidates.begin(),candidates.begin()+k,
+                              candidates.end());
+            for (size_t j = 0; j < k; ++j) {
+                distances[i*k+j] = std::sqrt(candidates[j].first);
+                indices[i*k+j] = candidates[j].second;
+            }
+        }
+    }
+}
+
+namespace detail {
+
+template <typename Query, typename Enable = void>
+struct is_cell_list_query: std::false_type {};
+
+template <typename Query>
+struct is_cell_list_query<Query,
+    decltype(void(std::declval<const Query&>().get_end_bucket()))>: 
+    std::true_type {};
+
+// fallback for tree data structures: search around every particle and only 
+// keep the neighbours with a larger index, so each pair is visited once 
+template <typename Query, typename F>
+void for_each_pair_search(const Query& query, const double radius, 
+                          const F& function) {
+    typedef typename Query::traits_type::position position;
+    typedef typename Query::traits_type::double_d double_d;
+    typedef typename Query::particle_iterator::reference particle_reference;
+
+    LOG(3,"for_each_pair: using serial search over all particles");
+    const size_t n = query.number_of_particles();
+    const double_d* positions_begin = get<position>(query.get_particles_begin());
+    for (size_t i = 0; i < n; ++i) {
+        particle_reference a = *(query.get_particles_begin()+i);
+        for (auto pairb: euclidean_search(query,get<position>(a),radius)) {
+            particle_reference b = detail::get_impl<0>(pairb);
+            const size_t j = &get<position>(b) - positions_begin;
+            if (j > i) {
+                function(detail::get_impl<1>(pairb),a,b);
+            }
+        }
+    }
+}
+
+// cell lists: visit each bucket and half of its neighbouring buckets. In
+// parallel the buckets are coloured so that buckets of the same colour never
+// share a neighbour, and each colour is processed as a parallel loop
+template <typename Query, typename F>
+void for_each_pair_cell_list(const Query& query, const double radius, 
+                             const F& function) {
+    typedef typename Query::traits_type Traits;
+    static const unsigned int dimension = Traits::dimension;
+    typedef typename Traits::position position;
+    typedef Vector<double,dimension> double_d;
+    typedef Vector<bool,dimension> bool_d;
+    typedef Vector<int,dimension> int_d;
+    typedef typename Query::particle_iterator particle_iterator;
+    typedef typename particle_iterator::reference particle_reference;
+
+    const int_d n = query.get_end_bucket()+1;
+    const bool_d& periodic = query.get_periodic();
+    const double_d domain_width = query.get_bounds().bmax-query.get_bounds().bmin;
+    const detail::bbox<dimension> bucket0 = query.get_bucket_bbox(int_d(0));
+    const double_d bucket_width = bucket0.bmax-bucket0.bmin;
+
+    // only the nearest neighbouring buckets are searched, and a periodic
+    // dimension needs at least three buckets so that each bucket pair is 
+    // unique
+    bool use_buckets = (bucket_width >= radius).all();
+    for (int d = 0; d < dimension; ++d) {
+        if (periodic[d] && n[d] < 3) use_buckets = false;
+    }
+    if (!use_buckets) {
+        for_each_pair_search(query,radius,function);
+        return;
+    }
+
+    // the half stencil contains the offsets that are lexicographically 
+    // greater than zero
+    std::vector<int_d> half_stencil;
+    for (lattice_iterator<dimension> it(int_d(-1),int_d(2)); it != false; ++it) {
+        const int_d& offset = *it;
+        for (int d = 0; d < dimension; ++d) {
+            if (offset[d] > 0) {
+                half_stencil.push_back(offset);
+                break;
+            } else if (offset[d] < 0) {
+                break;
+            }
+        }
+    }
+
+    const double radius2 = radius*radius;
+    auto visit_bucket = [&](const int_d& i) {
+        auto range_a = query.get_bucket_particles(i);
+        for (particle_iterator pa = range_a.begin(); pa != range_a.end(); ++pa) {
+            particle_reference a = *pa;
+            particle_iterator pb = pa;
+            for (++pb; pb != range_a.end(); ++pb) {
+                particle_reference b = *pb;
+                const double_d dx = get<position>(b)-get<position>(a);
+                if (dx.squaredNorm() <= radius2) {
+                    function(dx,a,b);
+                }
+            }
+        }
+        for (const int_d& offset: half_stencil) {
+            int_d j = i + offset;
+            double_d position_offset(0);
+            bool valid = true;
+            for (int d = 0; d < dimension; ++d) {
+                if (j[d] < 0) {
+                    valid = periodic[d];
+                    j[d] += n[d];
+                    position_offset[d] = -domain_width[d];
+                } else if (j[d] >= n[d]) {
+                    valid = periodic[d];
+                    j[d] -= n[d];
+                    position_offset[d] = domain_width[d];
+                }
+                if (!valid) break;
+            }
+            if (!valid) continue;
+            auto range_b = query.get_bucket_particles(j);
+            for (particle_reference a: range_a) {
+                const double_d position_a = get<position>(a)-position_offset;
+                for (particle_reference b: range_b) {
+                    const double_d dx = get<position>(b)-position_a;
+                    if (dx.squaredNorm() <= radius2) {
+                        function(dx,a,b);
+                    }
+                }
+            }
+        }
+    };
+
+#ifdef HAVE_OPENMP
+    // colour each dimension with i mod 3, periodic dimensions need extra 
+    // colours for the remainder buckets that wrap around to bucket 0
+    int_d ncolours;
+    for (int d = 0; d < dimension; ++d) {
+        ncolours[d] = 3 + (periodic[d] ? n[d]%3 : 0);
+    }
+    std::vector<std::vector<int_d>> buckets_by_colour(ncolours.prod());
+    for (lattice_iterator<dimension> it(int_d(0),n); it != false; ++it) {
+        const int_d& i = *it;
+        int colour = 0;
+        for (int d = dimension-1; d >= 0; --d) {
+            const int m = 3*(n[d]/3);
+            const int colour_d = (periodic[d] && i[d] >= m) ? 3 + i[d] - m : i[d]%3;
+            colour = colour*ncolours[d] + colour_d;
+        }
+        buckets_by_colour[colour].push_back(i);
+    }
+    LOG(3,"for_each_pair: using "<<buckets_by_colour.size()<<" bucket colours");
+    for (const std::vector<int_d>& buckets: buckets_by_colour) {
+        #pragma omp parallel for
+        for (size_t k = 0; k < buckets.size(); ++k) {
+            visit_bucket(buckets[k]);
+        }
+    }
+#else
+    for (lattice_iterator<dimension> it(int_d(0),n); it != false; ++it) {
+        visit_bucket(*it);
+    }
+#endif
+}
+
+template <typename Query, typename F>
+void for_each_pair_impl(const Query& query, const double radius, 
+                        const F& function, std::true_type) {
+    for_each_pair_cell_list(query,radius,function);
+}
+
+template <typename Query, typename F>
+void for_each_pair_impl(const Query& query, const double radius, 
+                        const F& function, std::false_type) {
+    for_each_pair_search(query,radius,function);
+}
+
+}
+
+/// Calls \p function once for every unordered pair of particles in \p query 
+/// that are separated by a euclidean distance less than or equal to \p radius
+/// (self pairs are not included). The function is called as 
+/// `function(dx,a,b)`, where `a` and `b` are references to the two particles
+/// and `dx` is the shortest (i.e. periodic) displacement from `a` to `b`. As 
+/// each pair is only visited once, \p function should apply equal and 
+/// opposite contributions to both particles, for example: 
+///
+/// \code
+/// for_each_pair(particles.get_query(),r,
+///     [](const vdouble3& dx, reference a, reference b) {
+///         const vdouble3 f = spring_force(dx);
+///         get<force>(a) -= f;
+///         get<force>(b) += f;
+///     });
+/// \endcode
+///
+/// For the cell list data structures (bucket_search_serial and 
+/// bucket_search_parallel) with a bucket side length of at least \p radius, 
+/// the pairs are found by symmetric enumeration of neighbouring buckets. When
+/// OpenMP is enabled the buckets are coloured so that no two threads ever 
+/// update the same particle, so \p function needs no atomics. For the tree 
+/// data structures, or smaller buckets, each particle is searched for 
+/// neighbours with a larger index, in serial.
+///
+/// \param query the neighbour search query object (e.g. Particles::get_query())
+/// \param radius the maximum separation between pairs
+/// \param function the function object to call for each pair
+template <typename Query, typename F>
+void for_each_pair(const Query& query, const double radius, const F& function) {
+    detail::for_each_pair_impl(query,radius,function,
+                               detail::is_cell_list_query<Query>());
+}
+
 
 
 }
@@ -456,6 +456,18 @@ namespace Aboria {
                 proto::value(*this).set_max_distance(max_distance);
             }
 
+            /// iterate over the neighbours stored in \p verlet_list, rather 
+            /// than using the neighbour search. The list must have been built
+            /// from the particle sets used in the expression, and it is the 
+            /// user's responsibility to call VerletList::update() after 
+            /// the particles have moved. The list radius must be greater than
+            /// or equal to the maximum distance of the accumulation, and 
+            /// only the euclidean norm (LNormNumber = 2) is supported.
+            void set_verlet_list(const detail::verlet_list_csr& verlet_list) {
+                static_assert(LNormNumber == 2, "Verlet lists only support the euclidean norm");
+                proto::value(*this).set_verlet_list(&verlet_list);
+            }
+
     };
 
     /// convenient functor to get a minumum value using the Accumulate expression
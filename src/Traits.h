@@ -267,6 +267,12 @@ struct TraitsCommon<std::tuple<TYPES...>,D,traits>:public traits {
         static_cast<void>(dummy);
     }
 
+    template<std::size_t... I>
+    static void reserve_impl(data_type& data, const size_t new_capacity, detail::index_sequence<I...>) {
+        int dummy[] = { 0, (get_by_index<I>(data).reserve(new_capacity),void(),0)... };
+        static_cast<void>(dummy);
+    }
+
     template<std::size_t... I>
     static void push_back_impl(data_type& data, const value_type& val, detail::index_sequence<I...>) {
         int dummy[] = { 0, (get_by_index<I>(data).push_back(get_by_index<I>(val)),void(),0)... };
@@ -348,6 +354,12 @@ struct TraitsCommon<std::tuple<TYPES...>,D,traits>:public traits {
         static_cast<void>(dummy); // Avoid warning for unused variable.
     }
 
+    template<typename Data, typename Function, std::size_t... I>
+    static void for_each_column_impl(Data& data, Function& f, detail::index_sequence<I...>) {
+        int dummy[] = { 0, (f(typename mpl::at<mpl_type_vector,mpl::int_<I>>::type().name, get_by_index<I>(data)),0)... };
+        static_cast<void>(dummy); // Avoid warning for unused variable.
+    }
+
     template<typename Indices = detail::make_index_sequence<N>>
     static iterator begin(data_type& data) {
         return begin_impl(data, Indices());
@@ -388,6 +400,11 @@ struct TraitsCommon<std::tuple<TYPES...>,D,traits>:public traits {
         resize_impl(data, new_size, Indices());
     }
 
+    template<typename Indices = detail::make_index_sequence<N>>
+    static void reserve(data_type& data, const size_t new_capacity) {
+        reserve_impl(data, new_capacity, Indices());
+    }
+
     template<typename Indices = detail::make_index_sequence<N>>
     static void push_back(data_type& data, const value_type& val) {
         push_back_impl(data, val, Indices());
@@ -448,6 +465,17 @@ struct TraitsCommon<std::tuple<TYPES...>,D,traits>:public traits {
         serialize_impl(data,ar,version,Indices());
     }
 
+    /// call \p f(name,vector) for the name and data vector of each variable
+    template<typename Function, typename Indices = detail::make_index_sequence<N>>
+    static void for_each_column(data_type& data, Function& f) {
+        for_each_column_impl(data,f,Indices());
+    }
+
+    template<typename Function, typename Indices = detail::make_index_sequence<N>>
+    static void for_each_column(const data_type& data, Function& f) {
+        for_each_column_impl(data,f,Indices());
+    }
+
     typedef typename position_vector_type::size_type size_type; 
     typedef typename position_vector_type::difference_type difference_type; 
 };
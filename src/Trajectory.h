@@ -0,0 +1,390 @@
+/*
+
+Copyright (c) 2005-2016, University of Oxford.
+All rights reserved.
+
+University of Oxford means the Chancellor, Masters and Scholars of the
+University of Oxford, having an administrative office at Wellington
+Square, Oxford OX1 2JD, UK.
+
+This file is part of Aboria.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+ * Neither the name of the University of Oxford nor the names of its
+   contributors may be used to endorse or promote products derived from this
+   software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TRAJECTORY_H_
+#define TRAJECTORY_H_
+
+#include "Particles.h"
+#include "detail/Trajectory.h"
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace Aboria {
+
+/// \brief Appends frames of a set of particle variables to a compressed, 
+/// binary trajectory file
+///
+/// Each frame stores the particle ids and the variables \p Variables of 
+/// every particle in a ParticlesType container. Each variable is compressed
+/// against the same variable in the previous frame (see 
+/// detail/Trajectory.h), and positions can optionally be quantized to a 
+/// fixed step before compression. 
+///
+/// By default write() only copies the particle data, and the compression 
+/// and file output is done on a background thread, so that this overlaps 
+/// with the next timestep. Use TrajectoryReader to read the file.
+///
+/// \param ParticlesType the type of the Particles container
+/// \param Variables the variables to store in each frame
+template <typename ParticlesType, typename... Variables>
+class TrajectoryWriter {
+    typedef typename ParticlesType::position position;
+    static const unsigned int dimension = ParticlesType::dimension;
+    static const size_t number_of_columns = sizeof...(Variables)+1;
+
+    struct frame_type {
+        double time;
+        size_t size;
+        std::vector<std::vector<char>> columns;
+    };
+
+public:
+    /// \param filename the trajectory file, this is overwritten
+    /// \param position_step if greater than zero, positions are rounded to
+    /// a multiple of \p position_step (lossy), which allows them to be 
+    /// compressed much further
+    /// \param asynchronous compress and write the frames on a background 
+    /// thread
+    /// \param max_pending_frames the maximum number of frames waiting to be
+    /// written before write() blocks
+    TrajectoryWriter(const std::string& filename, 
+                     const double position_step=0,
+                     const bool asynchronous=true,
+                     const size_t max_pending_frames=2):
+        m_out(filename,std::ios::binary),
+        m_position_step(position_step),
+        m_has_previous(false),
+        m_asynchronous(asynchronous),
+        m_max_pending_frames(max_pending_frames),
+        m_stop(false) {
+        CHECK(m_out.good(),"could not open file "<<filename<<" for writing");
+        CHECK(max_pending_frames > 0,"max_pending_frames must be greater than zero");
+
+        const char* names[number_of_columns] = {id().name, Variables().name...};
+        const size_t element_sizes[number_of_columns] = 
+            {sizeof(typename id::value_type), sizeof(typename Variables::value_type)...};
+        const bool quantized[number_of_columns] = 
+            {false, std::is_same<Variables,position>::value...};
+
+        detail::trajectory_file_header header;
+        std::memset(&header,0,sizeof(header));
+        std::memcpy(header.magic,detail::trajectory_file_magic,sizeof(header.magic));
+        header.version = detail::trajectory_file_version;
+        header.dimension = dimension;
+        header.number_of_columns = number_of_columns;
+        header.position_step = position_step;
+        m_out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+        for (size_t i = 0; i < number_of_columns; ++i) {
+            detail::trajectory_column_header column;
+            std::memset(&column,0,sizeof(column));
+            std::strncpy(column.name,names[i],sizeof(column.name)-1);
+            column.element_size = element_sizes[i];
+            m_quantized[i] = quantized[i] && position_step > 0;
+            column.quantized = m_quantized[i];
+            m_out.write(reinterpret_cast<const char*>(&column),sizeof(column));
+        }
+
+        if (m_asynchronous) {
+            m_thread = std::thread(&TrajectoryWriter::background_writer,this);
+        }
+    }
+
+    ~TrajectoryWriter() {
+        close();
+    }
+
+    TrajectoryWriter(const TrajectoryWriter&) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+    /// append a frame holding the current state of \p particles, labelled 
+    /// with \p time. If the writer is asynchronous this only copies the 
+    /// data, unless there are already max_pending_frames frames waiting to
+    /// be written
+    void write(const ParticlesType& particles, const double time=0) {
+        frame_type frame;
+        if (m_asynchronous) {
+            // reuse the buffers of a frame that has already been written
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_free_frames.empty()) {
+                frame = std::move(m_free_frames.back());
+                m_free_frames.pop_back();
+            }
+        }
+        frame.time = time;
+        frame.size = particles.size();
+        frame.columns.resize(number_of_columns);
+        copy_column<id>(particles,frame.columns[0]);
+        size_t i = 1;
+        int dummy[] = { 0, (copy_column<Variables>(particles,frame.columns[i++]),0)... };
+        static_cast<void>(dummy); 
+
+        if (m_asynchronous) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_frame_written.wait(lock,[this]{ 
+                    return m_pending_frames.size() < m_max_pending_frames; 
+                    });
+            m_pending_frames.push_back(std::move(frame));
+            m_frame_pending.notify_one();
+        } else {
+            encode_and_write(frame);
+        }
+    }
+
+    /// block until all the pending frames have been written to the file
+    void flush() {
+        if (m_asynchronous) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_frame_written.wait(lock,[this]{ 
+                    return m_pending_frames.empty() && !m_writing; 
+                    });
+        }
+        m_out.flush();
+    }
+
+    /// write any pending frames and close the file
+    void close() {
+        if (m_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_frame_pending.notify_one();
+            m_thread.join();
+        }
+        if (m_out.is_open()) {
+            m_out.close();
+        }
+    }
+
+private:
+    template <typename Variable>
+    void copy_column(const ParticlesType& particles, std::vector<char>& column) {
+        typedef typename Variable::value_type value_type;
+        const auto& vector = get<Variable>(particles);
+        column.resize(vector.size()*sizeof(value_type));
+        detail::copy(vector.begin(),vector.end(),
+                     reinterpret_cast<value_type*>(column.data()));
+    }
+
+    void encode_and_write(frame_type& frame) {
+        const bool delta = m_has_previous && frame.size == m_previous.size;
+        m_buffer.clear();
+        for (size_t i = 0; i < number_of_columns; ++i) {
+            const std::vector<char>& column = frame.columns[i];
+            if (m_quantized[i]) {
+                detail::quantized_encode(
+                        reinterpret_cast<const double*>(column.data()),
+                        delta ? reinterpret_cast<const double*>(m_previous.columns[i].data()) : nullptr,
+                        column.size()/sizeof(double),m_position_step,m_buffer);
+            } else {
+                detail::xor_encode(column.data(),
+                        delta ? m_previous.columns[i].data() : nullptr,
+                        column.size(),m_buffer);
+            }
+        }
+
+        detail::trajectory_frame_header header;
+        header.bytes = m_buffer.size();
+        header.size = frame.size;
+        header.time = frame.time;
+        header.delta = delta;
+        m_out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+        m_out.write(m_buffer.data(),m_buffer.size());
+        CHECK(m_out.good(),"error writing trajectory frame");
+        LOG(2,"TrajectoryWriter: wrote frame at time "<<frame.time<<" ("<<m_buffer.size()<<" bytes)");
+
+        std::swap(frame,m_previous);
+        m_has_previous = true;
+    }
+
+    void background_writer() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_frame_pending.wait(lock,[this]{ 
+                    return !m_pending_frames.empty() || m_stop; 
+                    });
+            if (m_pending_frames.empty()) break;
+            frame_type frame = std::move(m_pending_frames.front());
+            m_pending_frames.pop_front();
+            m_writing = true;
+            lock.unlock();
+
+            encode_and_write(frame);
+
+            lock.lock();
+            m_free_frames.push_back(std::move(frame));
+            m_writing = false;
+            m_frame_written.notify_all();
+        }
+    }
+
+    std::ofstream m_out;
+    double m_position_step;
+    bool m_quantized[number_of_columns];
+    frame_type m_previous;
+    bool m_has_previous;
+    std::vector<char> m_buffer;
+
+    bool m_asynchronous;
+    size_t m_max_pending_frames;
+    std::deque<frame_type> m_pending_frames;
+    std::vector<frame_type> m_free_frames;
+    bool m_writing = false;
+    bool m_stop;
+    std::mutex m_mutex;
+    std::condition_variable m_frame_pending;
+    std::condition_variable m_frame_written;
+    std::thread m_thread;
+};
+
+/// \brief Reads the frames of a trajectory file written by TrajectoryWriter
+///
+/// \param ParticlesType the type of the Particles container
+/// \param Variables the variables stored in each frame, these must match 
+/// the variables given to the TrajectoryWriter
+template <typename ParticlesType, typename... Variables>
+class TrajectoryReader {
+    static const unsigned int dimension = ParticlesType::dimension;
+    static const size_t number_of_columns = sizeof...(Variables)+1;
+
+public:
+    TrajectoryReader(const std::string& filename):
+        m_in(filename,std::ios::binary),
+        m_time(0) {
+        CHECK(m_in.good(),"could not open file "<<filename);
+
+        detail::trajectory_file_header header;
+        m_in.read(reinterpret_cast<char*>(&header),sizeof(header));
+        CHECK(m_in.good() && std::memcmp(header.magic,detail::trajectory_file_magic,
+                                         sizeof(header.magic)) == 0,
+                filename<<" is not a trajectory file");
+        CHECK(header.version == detail::trajectory_file_version,
+                "unsupported trajectory file version "<<header.version);
+        CHECK(header.dimension == dimension,
+                "trajectory file has dimension "<<header.dimension<<", expected "<<dimension);
+        CHECK(header.number_of_columns == number_of_columns,
+                "trajectory file has "<<header.number_of_columns-1<<" variables, expected "<<number_of_columns-1);
+        m_position_step = header.position_step;
+
+        const char* names[number_of_columns] = {id().name, Variables().name...};
+        const size_t element_sizes[number_of_columns] = 
+            {sizeof(typename id::value_type), sizeof(typename Variables::value_type)...};
+        for (size_t i = 0; i < number_of_columns; ++i) {
+            detail::trajectory_column_header column;
+            m_in.read(reinterpret_cast<char*>(&column),sizeof(column));
+            CHECK(std::strncmp(column.name,names[i],sizeof(column.name)-1) == 0 &&
+                  column.element_size == element_sizes[i],
+                    "variable "<<names[i]<<" does not match variable "<<column.name<<" in trajectory file");
+            m_element_sizes[i] = column.element_size;
+            m_quantized[i] = column.quantized;
+        }
+        m_previous.resize(number_of_columns);
+        m_current.resize(number_of_columns);
+    }
+
+    /// read the next frame into \p particles, which is resized to the 
+    /// number of particles in the frame. Note that the neighbour search is 
+    /// not updated (call Particles::update_positions() if required)
+    /// \return false if there are no more frames in the file
+    bool read(ParticlesType& particles) {
+        detail::trajectory_frame_header header;
+        if (!m_in.read(reinterpret_cast<char*>(&header),sizeof(header))) {
+            return false;
+        }
+        m_buffer.resize(header.bytes);
+        m_in.read(m_buffer.data(),header.bytes);
+        CHECK(m_in.good(),"trajectory file is truncated");
+
+        const char* p = m_buffer.data();
+        for (size_t i = 0; i < number_of_columns; ++i) {
+            std::vector<char>& column = m_current[i];
+            column.resize(header.size*m_element_sizes[i]);
+            if (m_quantized[i]) {
+                p = detail::quantized_decode(p,
+                        header.delta ? reinterpret_cast<const double*>(m_previous[i].data()) : nullptr,
+                        column.size()/sizeof(double),m_position_step,
+                        reinterpret_cast<double*>(column.data()));
+            } else {
+                p = detail::xor_decode(p,
+                        header.delta ? m_previous[i].data() : nullptr,
+                        column.size(),column.data());
+            }
+        }
+        CHECK(p == m_buffer.data()+m_buffer.size(),"trajectory frame is corrupt");
+        m_current.swap(m_previous);
+        m_time = header.time;
+
+        particles.resize(header.size);
+        copy_column<id>(particles,m_previous[0]);
+        size_t i = 1;
+        int dummy[] = { 0, (copy_column<Variables>(particles,m_previous[i++]),0)... };
+        static_cast<void>(dummy); 
+        return true;
+    }
+
+    /// the time of the last frame read
+    double get_time() const {
+        return m_time;
+    }
+
+private:
+    template <typename Variable>
+    void copy_column(ParticlesType& particles, const std::vector<char>& column) {
+        typedef typename Variable::value_type value_type;
+        const value_type* begin = reinterpret_cast<const value_type*>(column.data());
+        detail::copy(begin,begin+column.size()/sizeof(value_type),
+                     get<Variable>(particles).begin());
+    }
+
+    std::ifstream m_in;
+    double m_position_step;
+    double m_time;
+    size_t m_element_sizes[number_of_columns];
+    bool m_quantized[number_of_columns];
+    std::vector<std::vector<char>> m_previous;
+    std::vector<std::vector<char>> m_current;
+    std::vector<char> m_buffer;
+};
+
+}
+
+#endif //TRAJECTORY_H_
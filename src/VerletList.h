@@ -0,0 +1,341 @@
+/*
+
+Copyright (c) 2005-2016, University of Oxford.
+All rights reserved.
+
+University of Oxford means the Chancellor, Masters and Scholars of the
+University of Oxford, having an administrative office at Wellington
+Square, Oxford OX1 2JD, UK.
+
+This file is part of Aboria.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+ * Neither the name of the University of Oxford nor the names of its
+   contributors may be used to endorse or promote products derived from this
+   software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef VERLET_LIST_H_
+#define VERLET_LIST_H_
+
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <iterator>
+
+#include "detail/VerletList.h"
+#include "Search.h"
+#include "Log.h"
+
+namespace Aboria {
+
+/// A persistent Verlet neighbour list between the particles in \p RowParticles
+/// and \p ColParticles. For every row particle the list stores, in compressed 
+/// sparse row (CSR) format, the indices of the column particles that are within 
+/// a distance `radius + skin` (using the column particles' neighbour search).
+/// 
+/// The list keeps a copy of the particle positions at the time it was built. 
+/// Calling update() finds the maximum displacement of the row and column 
+/// particles since the last rebuild, and only rebuilds the list if the sum of
+/// these exceeds the skin (i.e. if the same particle set is used for both rows
+/// and columns, if any particle has moved more than half the skin). 
+///
+/// If the particles have only been reordered, for example by an ordered 
+/// neighbour search in Particles::update_positions(), the stored indices are 
+/// remapped to the new order (tracked via the `id` variable) before the 
+/// displacements are checked, which costs a sort of the ids rather than a 
+/// neighbour search. The list is rebuilt if particles have been added or 
+/// removed.
+///
+/// The list can be used directly via get_neighbours(), or by passing it to 
+/// KernelSparse::set_verlet_list() or AccumulateWithinDistance::set_verlet_list()
+///
+/// \param RowParticles the type of the row particle set
+/// \param ColParticles the type of the column particle set, must have 
+/// neighbour searching initialised
+template <typename RowParticles, typename ColParticles=RowParticles>
+class VerletList: public detail::verlet_list_csr {
+    typedef typename RowParticles::position position;
+    static const unsigned int dimension = RowParticles::dimension;
+    typedef Vector<double,dimension> double_d;
+    typedef typename ColParticles::const_reference const_col_reference;
+    typedef detail::verlet_list_csr base_type;
+
+public:
+    typedef typename std::vector<size_t>::const_iterator const_iterator;
+    typedef iterator_range<const_iterator> neighbour_range;
+
+    /// builds a Verlet list containing all the pairs within distance 
+    /// \p radius + \p skin
+    VerletList(const RowParticles& row_particles, 
+               const ColParticles& col_particles,
+               const double radius, 
+               const double skin):
+        base_type(radius,skin),
+        m_row_particles(row_particles),
+        m_col_particles(col_particles),
+        m_number_of_rebuilds(0) {
+        rebuild();
+    }
+
+    /// returns a range of the column indices of the neighbours of row 
+    /// particle \p i
+    neighbour_range get_neighbours(const size_t i) const {
+        ASSERT(i < size(),"row index i greater than number of rows");
+        return neighbour_range(m_col_indices.begin() + m_row_offsets[i],
+                               m_col_indices.begin() + m_row_offsets[i+1]);
+    }
+
+    /// checks if the list is still valid and rebuilds it if not. 
+    /// \return true if the list was rebuilt
+    bool update() {
+        const RowParticles& a = m_row_particles;
+        const ColParticles& b = m_col_particles;
+
+        const bool row_reordered = !same_particles(a,m_row_ids);
+        const bool col_reordered = is_same_set() ? 
+                                        row_reordered : !same_particles(b,m_col_ids);
+        if (row_reordered || col_reordered) {
+            std::vector<size_t> row_map,col_map;
+            if (!find_new_indices(a,m_row_ids,row_map) ||
+                (!is_same_set() && !find_new_indices(b,m_col_ids,col_map))) {
+                LOG(2,"VerletList: particle sets have changed, rebuilding");
+                rebuild();
+                return true;
+            }
+            LOG(2,"VerletList: particles have been reordered, remapping indices");
+            if (is_same_set()) {
+                remap(row_map,row_map);
+                permute(row_map,m_row_positions0);
+                store_ids(a,m_row_ids);
+                m_col_ids = m_row_ids;
+            } else {
+                remap(row_reordered ? row_map : identity(a.size()),
+                      col_reordered ? col_map : identity(b.size()));
+                if (row_reordered) {
+                    permute(row_map,m_row_positions0);
+                    store_ids(a,m_row_ids);
+                }
+                if (col_reordered) {
+                    permute(col_map,m_col_positions0);
+                    store_ids(b,m_col_ids);
+                }
+            }
+        }
+
+        double max_displacement = max_displacement_since_rebuild(a,m_row_positions0);
+        if (!is_same_set()) {
+            max_displacement += max_displacement_since_rebuild(b,m_col_positions0);
+        } else {
+            max_displacement *= 2;
+        }
+
+        if (max_displacement > m_skin) {
+            LOG(2,"VerletList: maximum displacement exceeds skin, rebuilding");
+            rebuild();
+            return true;
+        }
+
+        // positions might have moved in memory without changing order
+        m_row_positions = get<position>(a).data();
+        m_col_positions = get<position>(b).data();
+        return false;
+    }
+
+    /// rebuild the list unconditionally
+    void rebuild() {
+        const RowParticles& a = m_row_particles;
+        const ColParticles& b = m_col_particles;
+        const size_t na = a.size();
+        const double cutoff = m_radius + m_skin;
+
+        // first pass: count the neighbours of each row
+        m_row_offsets.assign(na+1,0);
+        #pragma omp parallel for
+        for (size_t i = 0; i < na; ++i) {
+            auto search = euclidean_search(b.get_query(),get<position>(a)[i],cutoff);
+            m_row_offsets[i+1] = std::distance(search.begin(),search.end());
+        }
+        std::partial_sum(m_row_offsets.begin(),m_row_offsets.end(),m_row_offsets.begin());
+
+        // second pass: fill in the column indices
+        m_col_indices.resize(m_row_offsets[na]);
+        #pragma omp parallel for
+        for (size_t i = 0; i < na; ++i) {
+            size_t index = m_row_offsets[i];
+            for (auto pairj: euclidean_search(b.get_query(),get<position>(a)[i],cutoff)) {
+                const_col_reference bj = detail::get_impl<0>(pairj);
+                m_col_indices[index++] = &get<position>(bj) - get<position>(b).data();
+            }
+        }
+
+        // store state for update()
+        store_state(a,m_row_positions0,m_row_ids);
+        if (!is_same_set()) {
+            store_state(b,m_col_positions0,m_col_ids);
+        } else {
+            m_col_positions0.clear();
+            m_col_ids = m_row_ids;
+        }
+        m_row_positions = get<position>(a).data();
+        m_col_positions = get<position>(b).data();
+
+        ++m_number_of_rebuilds;
+        LOG(2,"VerletList: rebuilt with "<<number_of_pairs()<<" pairs for "<<na<<" particles (cutoff = "<<cutoff<<")");
+    }
+
+    /// the number of times the list has been built
+    size_t number_of_rebuilds() const { return m_number_of_rebuilds; }
+
+    const RowParticles& get_row_particles() const { return m_row_particles; }
+    const ColParticles& get_col_particles() const { return m_col_particles; }
+
+private:
+    bool is_same_set() const {
+        return static_cast<const void*>(&m_row_particles) == 
+               static_cast<const void*>(&m_col_particles);
+    }
+
+    template <typename Particles>
+    static void store_state(const Particles& p, 
+                            std::vector<double_d>& positions, 
+                            std::vector<size_t>& ids) {
+        positions.resize(p.size());
+        ids.resize(p.size());
+        for (size_t i = 0; i < p.size(); ++i) {
+            positions[i] = get<position>(p)[i];
+            ids[i] = get<id>(p)[i];
+        }
+    }
+
+    template <typename Particles>
+    static void store_ids(const Particles& p, std::vector<size_t>& ids) {
+        ids.resize(p.size());
+        for (size_t i = 0; i < p.size(); ++i) {
+            ids[i] = get<id>(p)[i];
+        }
+    }
+
+    static std::vector<size_t> identity(const size_t n) {
+        std::vector<size_t> map(n);
+        std::iota(map.begin(),map.end(),0);
+        return map;
+    }
+
+    // finds the current index of each particle with id \p ids[i], returns
+    // false if any of the particles are no longer in the container, or if
+    // new particles have been added 
+    template <typename Particles>
+    static bool find_new_indices(const Particles& p, 
+                                 const std::vector<size_t>& ids,
+                                 std::vector<size_t>& map) {
+        const size_t n = p.size();
+        if (n != ids.size()) return false;
+        std::vector<std::pair<size_t,size_t>> sorted(n);
+        for (size_t i = 0; i < n; ++i) {
+            sorted[i] = std::make_pair(static_cast<size_t>(get<id>(p)[i]),i);
+        }
+        std::sort(sorted.begin(),sorted.end());
+        map.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            auto it = std::lower_bound(sorted.begin(),sorted.end(),
+                                       std::make_pair(ids[i],size_t(0)));
+            if (it == sorted.end() || it->first != ids[i]) return false;
+            map[i] = it->second;
+        }
+        return true;
+    }
+
+    // moves row i of the list to row \p row_map[i], and maps each stored 
+    // column index j to \p col_map[j]
+    void remap(const std::vector<size_t>& row_map, 
+               const std::vector<size_t>& col_map) {
+        const size_t na = size();
+        std::vector<size_t> row_offsets(na+1,0);
+        for (size_t i = 0; i < na; ++i) {
+            row_offsets[row_map[i]+1] = m_row_offsets[i+1]-m_row_offsets[i];
+        }
+        std::partial_sum(row_offsets.begin(),row_offsets.end(),row_offsets.begin());
+        std::vector<size_t> col_indices(m_col_indices.size());
+        #pragma omp parallel for
+        for (size_t i = 0; i < na; ++i) {
+            size_t index = row_offsets[row_map[i]];
+            for (size_t k = m_row_offsets[i]; k < m_row_offsets[i+1]; ++k) {
+                col_indices[index++] = col_map[m_col_indices[k]];
+            }
+        }
+        m_row_offsets.swap(row_offsets);
+        m_col_indices.swap(col_indices);
+    }
+
+    static void permute(const std::vector<size_t>& map,
+                        std::vector<double_d>& positions) {
+        std::vector<double_d> permuted(positions.size());
+        for (size_t i = 0; i < positions.size(); ++i) {
+            permuted[map[i]] = positions[i];
+        }
+        positions.swap(permuted);
+    }
+
+    template <typename Particles>
+    static bool same_particles(const Particles& p, const std::vector<size_t>& ids) {
+        if (p.size() != ids.size()) return false;
+        for (size_t i = 0; i < p.size(); ++i) {
+            if (get<id>(p)[i] != ids[i]) return false;
+        }
+        return true;
+    }
+
+    template <typename Particles>
+    static double max_displacement_since_rebuild(const Particles& p, 
+                                                 const std::vector<double_d>& positions) {
+        double max_displacement2 = 0;
+        const size_t n = p.size();
+        #pragma omp parallel for reduction(max:max_displacement2)
+        for (size_t i = 0; i < n; ++i) {
+            const double_d dx = p.correct_dx_for_periodicity(
+                    get<position>(p)[i]-positions[i]);
+            max_displacement2 = std::max(max_displacement2,dx.squaredNorm());
+        }
+        return std::sqrt(max_displacement2);
+    }
+
+    const RowParticles& m_row_particles;
+    const ColParticles& m_col_particles;
+    std::vector<double_d> m_row_positions0;
+    std::vector<double_d> m_col_positions0;
+    std::vector<size_t> m_row_ids;
+    std::vector<size_t> m_col_ids;
+    size_t m_number_of_rebuilds;
+};
+
+/// helper function to create a VerletList
+template <typename RowParticles, typename ColParticles>
+VerletList<RowParticles,ColParticles> 
+create_verlet_list(const RowParticles& row_particles, 
+                   const ColParticles& col_particles,
+                   const double radius, const double skin) {
+    return VerletList<RowParticles,ColParticles>(row_particles,col_particles,radius,skin);
+}
+
+}
+
+#endif
@@ -219,7 +219,8 @@ void sort_by_key(T1 start_keys,
     typedef typename pair_zip_type::reference reference;
     typedef typename pair_zip_type::value_type value_type;
 
-    std::sort(
+    // stable, so that data with equal keys keep their relative order
+    std::stable_sort(
             pair_zip_type(start_keys,start_data),
             pair_zip_type(end_keys,start_data+std::distance(start_keys,end_keys)),
             detail::iter_comp<value_type>());
@@ -230,7 +231,7 @@ template<typename T1, typename T2>
 void sort_by_key(T1 start_keys,
         T1 end_keys,
         T2 start_data,std::false_type) {
-    thrust::sort_by_key(start_keys,end_keys,start_data);
+    thrust::stable_sort_by_key(start_keys,end_keys,start_data);
 }
 #endif
 
@@ -709,6 +710,36 @@ void scatter_if(
     scatter_if(first,last,map,stencil,output,typename is_std_iterator<RandomAccessIterator>::type());
 }
 
+template<typename InputIterator1, typename InputIterator2, typename RandomAccessIterator>
+void scatter(
+        InputIterator1 first, InputIterator1 last,
+        InputIterator2 map, RandomAccessIterator output, std::true_type) {
+
+    const size_t n = last-first;
+    for (int i=0; i<n; ++i) {
+        // operator[] of a zip iterator returns a copy, so dereference
+        *(output+map[i]) = *(first+i);
+    }
+}
+
+#ifdef __aboria_have_thrust__
+template<typename InputIterator1, typename InputIterator2, typename RandomAccessIterator>
+void scatter(
+        InputIterator1 first, InputIterator1 last,
+        InputIterator2 map, RandomAccessIterator output, std::false_type) {
+
+    thrust::scatter(first,last,map,output);
+}
+#endif
+
+template<typename InputIterator1, typename InputIterator2, typename RandomAccessIterator>
+void scatter(
+        InputIterator1 first, InputIterator1 last,
+        InputIterator2 map, RandomAccessIterator output) {
+
+    scatter(first,last,map,output,typename is_std_iterator<RandomAccessIterator>::type());
+}
+
 template<typename InputIterator , typename RandomAccessIterator , typename OutputIterator>
 void gather(InputIterator map_first, InputIterator map_last, 
                       RandomAccessIterator input_first, OutputIterator result, std::true_type) {
@@ -732,6 +763,30 @@ void gather(InputIterator map_first, InputIterator map_last,
     gather(map_first,map_last,input_first,result, typename is_std_iterator<RandomAccessIterator>::type());
 }
 
+template<typename InputIterator1, typename InputIterator2>
+std::pair<InputIterator1,InputIterator2> mismatch(
+        InputIterator1 first1, InputIterator1 last1,
+        InputIterator2 first2, std::true_type) {
+    return std::mismatch(first1,last1,first2);
+}
+
+#ifdef __aboria_have_thrust__
+template<typename InputIterator1, typename InputIterator2>
+std::pair<InputIterator1,InputIterator2> mismatch(
+        InputIterator1 first1, InputIterator1 last1,
+        InputIterator2 first2, std::false_type) {
+    auto result = thrust::mismatch(first1,last1,first2);
+    return std::make_pair(result.first,result.second);
+}
+#endif
+
+template<typename InputIterator1, typename InputIterator2>
+std::pair<InputIterator1,InputIterator2> mismatch(
+        InputIterator1 first1, InputIterator1 last1,
+        InputIterator2 first2) {
+    return mismatch(first1,last1,first2, typename is_std_iterator<InputIterator1>::type());
+}
+
 template<typename InputIterator1, typename InputIterator2, 
     typename OutputIterator, typename Predicate>
 OutputIterator copy_if(
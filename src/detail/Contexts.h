@@ -286,6 +286,31 @@ namespace detail {
             const int LNormNumber = accumulate_type::norm_number_type::value;
 
             result_type sum = accum.init;
+            if (accum.verlet_list != nullptr) {
+                const verlet_list_csr& list = *accum.verlet_list;
+                ASSERT(accum.max_distance <= list.get_radius(),"max distance larger than Verlet list radius");
+                ASSERT(list.is_col_positions(get<position>(particlesb).data()),"Verlet list not built using these particles");
+                const size_t i = list.get_row_index(get<position>(ai));
+                ASSERT(i < list.size(),"particle not in the Verlet list rows");
+                const double max_distance2 = std::pow(accum.max_distance,2);
+                const size_t* j_begin = list.m_col_indices.data() + list.m_row_offsets[i];
+                const size_t* j_end = list.m_col_indices.data() + list.m_row_offsets[i+1];
+                for (const size_t* j = j_begin; j != j_end; ++j) {
+                    const_b_reference bi = particlesb[*j];
+                    const double_d dx = particlesb.correct_dx_for_periodicity(
+                                            get<position>(bi)-get<position>(ai));
+                    if (dx.squaredNorm() > max_distance2) continue;
+
+                    EvalCtx<map_type,list_type> const new_ctx(
+                            fusion::make_map<label_a_type,label_b_type>(ai,bi),
+                            list_type(dx)
+                            );
+
+                    sum = accum.functor(sum,proto::eval(expr,new_ctx));
+                }
+                return sum;
+            }
+
             //TODO: get query range and put it in box search
             for (const auto& i: distance_search<LNormNumber>(
                                     particlesb.get_query(),get<position>(ai),accum.max_distance)) {
@@ -294,7 +319,7 @@ namespace detail {
 
                 EvalCtx<map_type,list_type> const new_ctx(
                         fusion::make_map<label_a_type,label_b_type>(ai,bi),
-                        fusion::make_list(dx)
+                        list_type(dx)
                         );
 
                 sum = accum.functor(sum,proto::eval(expr,new_ctx));
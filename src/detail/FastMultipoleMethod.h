@@ -45,6 +45,11 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "Get.h"
 #include "Log.h"
 #include <iostream>
+#include <map>
+#include <limits>
+#include <random>
+#include <vector>
+#include <algorithm>
 
 namespace Aboria {
 namespace detail {
@@ -119,8 +124,17 @@ namespace detail {
         typedef Eigen::Matrix<double,ncheb,Eigen::Dynamic> p2m_matrix_type;
         typedef Eigen::Matrix<double,Eigen::Dynamic,ncheb> l2p_matrix_type;
         typedef Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic> p2p_matrix_type;
+        typedef Eigen::Map<p2p_matrix_type> p2p_map_type;
+        typedef Eigen::Map<const p2p_matrix_type> const_p2p_map_type;
         typedef Eigen::Matrix<double,Eigen::Dynamic,1> p_vector_type;
         typedef Eigen::Matrix<double,ncheb,1> m_vector_type;
+        // single precision leaf matrices and particle vectors
+        typedef Eigen::Matrix<float,ncheb,Eigen::Dynamic> p2m_float_matrix_type;
+        typedef Eigen::Matrix<float,Eigen::Dynamic,ncheb> l2p_float_matrix_type;
+        typedef Eigen::Matrix<float,Eigen::Dynamic,Eigen::Dynamic> p2p_float_matrix_type;
+        typedef Eigen::Map<p2p_float_matrix_type> p2p_float_map_type;
+        typedef Eigen::Map<const p2p_float_matrix_type> const_p2p_float_map_type;
+        typedef Eigen::Matrix<float,Eigen::Dynamic,1> p_float_vector_type;
 #endif
         typedef Vector<double,D> double_d;
         typedef Vector<int,D> int_d;
@@ -227,8 +241,20 @@ namespace detail {
             }
         }
 
-#ifdef HAVE_EIGEN
-        void M2L_matrix(m2l_matrix_type& matrix, 
+        double M2L_coeff(const int i, const int j,
+                 const box_type& target_box, 
+                 const box_type& source_box) const {
+            const double_d& pi_unit_box = m_cheb_points[i];
+            const double_d pi = 0.5*(pi_unit_box+1)*(target_box.bmax-target_box.bmin) 
+                                                                + target_box.bmin;
+            const double_d& pj_unit_box = m_cheb_points[j];
+            const double_d pj = 0.5*(pj_unit_box+1)*(source_box.bmax-source_box.bmin) 
+                                                                + source_box.bmin;
+            return m_K(pj-pi,pi,pj);
+        }
+
+        template <typename MatrixType>
+        void M2L_matrix(MatrixType& matrix, 
                  const box_type& target_box, 
                  const box_type& source_box) const {
             for (int i=0; i<ncheb; ++i) {
@@ -242,10 +268,7 @@ namespace detail {
                     matrix(i,j) = m_K(pj-pi,pi,pj);
                 }
             }
-
-
         }
-#endif
 
         void L2L(expansion_type& accum, 
                  const box_type& target_box, 
@@ -327,8 +350,8 @@ namespace detail {
             }
         }
 
-        template <typename RowParticlesType, typename ColParticlesType>
-        void P2P_matrix(p2p_matrix_type& matrix, 
+        template <typename MatrixType, typename RowParticlesType, typename ColParticlesType>
+        void P2P_matrix(MatrixType& matrix, 
                     const std::vector<size_t>& row_indicies,
                     const std::vector<size_t>& col_indicies,
                     const RowParticlesType& row_particles,
@@ -453,6 +476,55 @@ namespace detail {
 
     }
 
+    // Structure-of-arrays copy of the positions and source values of a 
+    // bucket of source particles. The P2P inner loop then only reads 
+    // unit-stride memory, and can be vectorised across the source particles
+    template <unsigned int D>
+    struct p2p_source_tile {
+        std::array<std::vector<double>,D> m_position;
+        std::vector<double> m_source;
+
+        size_t size() const {
+            return m_source.size();
+        }
+
+        void clear() {
+            for (int d = 0; d < D; ++d) {
+                m_position[d].clear();
+            }
+            m_source.clear();
+        }
+
+        void push_back(const Vector<double,D>& p, const double source) {
+            for (int d = 0; d < D; ++d) {
+                m_position[d].push_back(p[d]);
+            }
+            m_source.push_back(source);
+        }
+    };
+
+    template <unsigned int D, typename Function>
+    double p2p_tile_sum(const Vector<double,D>& pi, 
+                        const p2p_source_tile<D>& tile,
+                        const Function& K) {
+        const size_t n = tile.size();
+        const double* source = tile.m_source.data();
+        std::array<const double*,D> x;
+        for (int d = 0; d < D; ++d) {
+            x[d] = tile.m_position[d].data();
+        }
+        double sum = 0;
+        #pragma omp simd reduction(+:sum)
+        for (size_t j = 0; j < n; ++j) {
+            Vector<double,D> pj;
+            for (int d = 0; d < D; ++d) {
+                pj[d] = x[d][j];
+            }
+            sum += K(pj-pi,pi,pj)*source[j];
+        }
+        return sum;
+    }
+
     template <typename Expansions,
               typename Traits, 
               typename TargetVectorType, 
@@ -467,7 +539,8 @@ namespace detail {
                         const iterator_range<ranges_iterator<Traits>>& source_range, 
                         const ParticleIterator& target_particles_begin,
                         const ParticleIterator& source_particles_begin,
-                        const Expansions& expansions) {
+                        const Expansions& expansions,
+                        p2p_source_tile<D>& tile) {
         typedef typename Traits::position position;
 
         const size_t n_target = std::distance(target_range.begin(),target_range.end());
@@ -481,13 +554,13 @@ namespace detail {
         const Vector<double,D>* pbegin_source = &get<position>(source_particles_begin)[0];
         const size_t index_source = pbegin_source_range - pbegin_source;
 
+        tile.clear();
+        for (int j = index_source; j < index_source+n_source; ++j) {
+            tile.push_back(pbegin_source[j],source_vector[j]);
+        }
+
         for (int i = index_target; i < index_target+n_target; ++i) {
-            const Vector<double,D>& pi = pbegin_target[i]; 
-            for (int j = index_source; j < index_source+n_source; ++j) {
-                const Vector<double,D>& pj = pbegin_source[j]; 
-                target_vector[i] += expansions.m_K(pj-pi,pi,pj)
-                                                    *source_vector[j];
-            }
+            target_vector[i] += p2p_tile_sum(pbegin_target[i],tile,expansions.m_K);
         }
     }
 
@@ -511,19 +584,24 @@ namespace detail {
                         const iterator_range<SourceIterator>& source_range, 
                         const ParticleIterator& target_particles_begin,
                         const ParticleIterator& source_particles_begin,
-                        const Expansions &expansions) {
+                        const Expansions &expansions,
+                        p2p_source_tile<D>& tile) {
 
         typedef typename Traits::position position;
+
+        // gather source particles into tile
+        tile.clear();
+        for (auto& j: source_range) {
+            const Vector<double,D>& pj = get<position>(j); 
+            const size_t source_index = &pj - &get<position>(source_particles_begin)[0];
+            tile.push_back(pj,source_vector[source_index]);
+        }
+
         for (auto& i: target_range) {
             const Vector<double,D>& pi = get<position>(i); 
             const size_t target_index = &pi - &get<position>(target_particles_begin)[0];
-            for (auto& j: source_range) {
-                const Vector<double,D>& pj = get<position>(j); 
-                const size_t source_index = &pj - &get<position>(source_particles_begin)[0];
-                LOG(4,"calculate_P2P: i = "<<target_index<<" pi = "<<pi<<" j = "<<source_index<<" pj = "<<pj);
-                target_vector[target_index] += expansions.m_K(pj-pi,pi,pj)
-                                                    *source_vector[source_index];
-            }
+            LOG(4,"calculate_P2P: i = "<<target_index<<" pi = "<<pi);
+            target_vector[target_index] += p2p_tile_sum(pi,tile,expansions.m_K);
         }
 
     }
@@ -577,6 +655,258 @@ namespace detail {
         return sum;
     }
 
+    // For a translation invariant kernel, the M2L operator between two 
+    // equal sized boxes depends only on their size and their relative 
+    // position. This key stores the size as the number of boxes that fit 
+    // along each side of the root box (i.e. the level for an octtree) and 
+    // the offset between the two boxes in units of the box side length
+    template <unsigned int D>
+    struct m2l_key {
+        typedef Vector<int,D> int_d;
+        int_d level;
+        int_d offset;
+
+        bool operator<(const m2l_key& other) const {
+            for (int i = 0; i < D; ++i) {
+                if (level[i] != other.level[i]) return level[i] < other.level[i];
+            }
+            for (int i = 0; i < D; ++i) {
+                if (offset[i] != other.offset[i]) return offset[i] < other.offset[i];
+            }
+            return false;
+        }
+    };
+
+    // returns false if the two boxes do not lie on a uniform lattice 
+    // within the root box (e.g. buckets in a kd-tree)
+    template <unsigned int D>
+    bool get_m2l_key(m2l_key<D>& key, 
+                     const bbox<D>& root_box,
+                     const bbox<D>& target_box, 
+                     const bbox<D>& source_box) {
+        typedef Vector<double,D> double_d;
+        const double tol = 1e-8;
+        const double_d side = target_box.bmax-target_box.bmin;
+        const double_d source_side = source_box.bmax-source_box.bmin;
+        const double_d level = (root_box.bmax-root_box.bmin)/side;
+        const double_d offset = (source_box.bmin-target_box.bmin)/side;
+        for (int i = 0; i < D; ++i) {
+            if (std::abs(source_side[i]-side[i]) > tol*side[i]) return false;
+            key.level[i] = std::round(level[i]);
+            key.offset[i] = std::round(offset[i]);
+            if (std::abs(level[i]-key.level[i]) > tol*level[i]) return false;
+            if (std::abs(offset[i]-key.offset[i]) > tol) return false;
+        }
+        return true;
+    }
+
+    // dense row-major M2L operator, used by the fmm so that it does not
+    // depend on Eigen
+    template <size_t NCheb>
+    class m2l_dense_operator {
+        std::vector<double> m_data;
+    public:
+        m2l_dense_operator():m_data(NCheb*NCheb) {}
+
+        double& operator()(const size_t i, const size_t j) {
+            return m_data[i*NCheb+j];
+        }
+
+        const double& operator()(const size_t i, const size_t j) const {
+            return m_data[i*NCheb+j];
+        }
+
+        template <typename ExpansionType>
+        void apply(ExpansionType& accum, const ExpansionType& source) const {
+            const double* row = m_data.data();
+            for (size_t i = 0; i < NCheb; ++i, row += NCheb) {
+                double sum = 0;
+                for (size_t j = 0; j < NCheb; ++j) {
+                    sum += row[j]*source[j];
+                }
+                accum[i] += sum;
+            }
+        }
+    };
+
+    // the depth of the first level of the tree with at least \p ntasks 
+    // nodes (or the depth of the tree if there is no such level). Depth 0 
+    // is the children of the root
+    template <typename NeighbourQuery>
+    size_t task_depth(const NeighbourQuery& query, const size_t ntasks) {
+        typedef typename NeighbourQuery::child_iterator child_iterator;
+        std::vector<child_iterator> level,next_level;
+        for (child_iterator ci = query.get_children(); ci != false; ++ci) {
+            level.push_back(ci);
+        }
+        size_t depth = 0;
+        while (!level.empty() && level.size() < ntasks) {
+            next_level.clear();
+            for (const child_iterator& ci: level) {
+                if (!query.is_leaf_node(*ci)) {
+                    for (child_iterator cj = query.get_children(ci); cj != false; ++cj) {
+                        next_level.push_back(cj);
+                    }
+                }
+            }
+            level.swap(next_level);
+            ++depth;
+        }
+        return depth;
+    }
+
+    // by default limit the cached M2L operators to approx 64MB
+    inline size_t m2l_cache_max_keys(const size_t ncheb) {
+        return (1<<23)/(ncheb*ncheb);
+    }
+
+    // Stores one M2L operator for each unique (level, offset) pair, so that
+    // on a uniform tree the number of kernel evaluations needed for the 
+    // M2L operators is independent of the number of particles. 
+    //
+    // The cache assumes the kernel is translation invariant. This is 
+    // checked by comparing the full operator against a direct evaluation 
+    // the first time each cached operator is reused, and a random sample of
+    // its entries on every later reuse. If a check fails the cache is 
+    // disabled and all subsequent operators are calculated directly.
+    template <typename Expansions, typename Operator>
+    class m2l_cache {
+        static const unsigned int dimension = Expansions::dimension;
+        static constexpr size_t ncheb = Expansions::ncheb;
+        typedef bbox<dimension> box_type;
+        typedef m2l_key<dimension> key_type;
+
+        std::map<key_type,size_t> m_map;
+        std::vector<Operator> m_operators;
+        // true if the operator has been fully checked against a direct 
+        // evaluation
+        std::vector<bool> m_verified;
+        box_type m_root_box;
+        size_t m_max_keys;
+        bool m_enabled;
+        std::minstd_rand m_generator;
+
+    public:
+        static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+        m2l_cache():m_max_keys(0),m_enabled(false) {}
+
+        // If \p enabled is false nothing is cached and every operator is 
+        // calculated directly
+        explicit m2l_cache(const box_type& root_box, 
+                           const bool enabled=true,
+                           const size_t max_keys=m2l_cache_max_keys(ncheb)):
+            m_root_box(root_box),
+            m_max_keys(max_keys),
+            m_enabled(enabled) {}
+
+        // returns the index of a cached operator, or npos if not found
+        size_t find(const box_type& target_box, const box_type& source_box) const {
+            key_type key;
+            if (!m_enabled || !get_m2l_key(key,m_root_box,target_box,source_box)) {
+                return npos;
+            }
+            auto it = m_map.find(key);
+            return it == m_map.end() ? npos : it->second;
+        }
+
+        // returns the index of a cached operator, creating it if this is the
+        // first time the key is seen. Returns npos if the boxes cannot be 
+        // cached
+        size_t find_or_create(const box_type& target_box, 
+                              const box_type& source_box,
+                              const Expansions& expansions) {
+            key_type key;
+            if (!m_enabled || !get_m2l_key(key,m_root_box,target_box,source_box)) {
+                return npos;
+            }
+            auto it = m_map.find(key);
+            if (it == m_map.end()) {
+                if (m_map.size() >= m_max_keys) {
+                    return npos;
+                }
+                const size_t index = add(target_box,source_box,expansions);
+                m_map.insert(std::make_pair(key,index));
+                return index;
+            } else if (is_translation_invariant(it->second,
+                                              target_box,source_box,expansions)) {
+                return it->second;
+            } else {
+                LOG(2,"m2l_cache: kernel is not translation invariant, disabling cache");
+                m_enabled = false;
+                m_map.clear();
+                return npos;
+            }
+        }
+
+        // always creates a new (uncached) operator
+        size_t add(const box_type& target_box, 
+                   const box_type& source_box,
+                   const Expansions& expansions) {
+            m_operators.emplace_back();
+            m_verified.push_back(false);
+            expansions.M2L_matrix(m_operators.back(),target_box,source_box);
+            return m_operators.size()-1;
+        }
+
+        const Operator& operator[](const size_t i) const {
+            return m_operators[i];
+        }
+
+        size_t size() const {
+            return m_operators.size();
+        }
+
+        size_t number_of_keys() const {
+            return m_map.size();
+        }
+
+        bool enabled() const {
+            return m_enabled;
+        }
+
+    private:
+        bool is_translation_invariant(const size_t index,
+                                      const box_type& target_box, 
+                                      const box_type& source_box,
+                                      const Expansions& expansions) {
+            const Operator& op = m_operators[index];
+            if (!m_verified[index]) {
+                for (size_t i = 0; i < ncheb; ++i) {
+                    for (size_t j = 0; j < ncheb; ++j) {
+                        if (!is_equal(op(i,j),
+                                expansions.M2L_coeff(i,j,target_box,source_box))) {
+                            return false;
+                        }
+                    }
+                }
+                m_verified[index] = true;
+            } else {
+                const size_t nsample = 3;
+                std::uniform_int_distribution<size_t> uniform(0,ncheb-1);
+                for (size_t k = 0; k < nsample; ++k) {
+                    const size_t i = uniform(m_generator);
+                    const size_t j = uniform(m_generator);
+                    if (!is_equal(op(i,j),
+                            expansions.M2L_coeff(i,j,target_box,source_box))) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        static bool is_equal(const double cached, const double direct) {
+            const double tol = 1e-8;
+            return std::abs(cached-direct) <= 
+                        tol*(std::abs(cached)+std::abs(direct)) 
+                        + std::numeric_limits<double>::min();
+        }
+    };
+
+    template <typename Expansions, typename Operator>
+    constexpr size_t m2l_cache<Expansions,Operator>::npos;
+
     template <unsigned int D>
     struct theta_condition {
         typedef Vector<double,D> double_d;
@@ -604,6 +934,168 @@ namespace detail {
         }
     };
 
+}
+
+/// The memory used by a fast multipole or H2 operator, split by operator 
+/// class, and the number of interactions on each level of the tree. Returned
+/// by FastMultipoleMethod::get_statistics(), H2Matrix::get_statistics() and 
+/// estimate_h2_statistics()
+struct fast_method_statistics {
+    /// memory used by each operator class
+    size_t p2p_bytes;
+    size_t m2l_bytes;
+    size_t l2l_bytes;
+    size_t p2m_bytes;
+    size_t l2p_bytes;
+    /// work vectors holding the expansions and particle values
+    size_t expansion_bytes;
+    /// memory needed to store the equivalent dense matrix
+    size_t dense_bytes;
+    /// number of well separated (M2L) bucket pairs on each level
+    std::vector<size_t> weak_interactions;
+    /// number of near field (P2P) leaf pairs, indexed by the level of 
+    /// the target leaf
+    std::vector<size_t> strong_interactions;
+
+    fast_method_statistics():
+        p2p_bytes(0),m2l_bytes(0),l2l_bytes(0),p2m_bytes(0),l2p_bytes(0),
+        expansion_bytes(0),dense_bytes(0)
+    {}
+
+    size_t total_bytes() const {
+        return p2p_bytes + m2l_bytes + l2l_bytes + p2m_bytes + l2p_bytes
+                + expansion_bytes;
+    }
+
+    /// dense storage divided by the storage used by the operator
+    double compression_ratio() const {
+        return static_cast<double>(dense_bytes)/total_bytes();
+    }
+
+    void add_weak(const size_t level) {
+        if (weak_interactions.size() <= level) {
+            weak_interactions.resize(level+1,0);
+        }
+        ++weak_interactions[level];
+    }
+
+    void add_strong(const size_t level) {
+        if (strong_interactions.size() <= level) {
+            strong_interactions.resize(level+1,0);
+        }
+        ++strong_interactions[level];
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& os, 
+                                const fast_method_statistics& stats) {
+    os << "P2P = "<<stats.p2p_bytes<<" bytes, M2L = "<<stats.m2l_bytes
+       << " bytes, L2L = "<<stats.l2l_bytes<<" bytes, P2M = "<<stats.p2m_bytes
+       << " bytes, L2P = "<<stats.l2p_bytes<<" bytes, expansions = "
+       << stats.expansion_bytes<<" bytes. Total = "<<stats.total_bytes()
+       << " bytes, compression ratio = "<<stats.compression_ratio()<<std::endl;
+    const size_t nlevels = std::max(stats.weak_interactions.size(),
+                                    stats.strong_interactions.size());
+    for (size_t i = 0; i < nlevels; ++i) {
+        os << "\tlevel "<<i<<": weak interactions = "
+           << (i < stats.weak_interactions.size()?stats.weak_interactions[i]:0)
+           << ", strong interactions = "
+           << (i < stats.strong_interactions.size()?stats.strong_interactions[i]:0)
+           << std::endl;
+    }
+    return os;
+}
+
+namespace detail {
+
+    // walks the tree using the same admissibility condition as the fmm and 
+    // h2 matrix. Calls weak(level,target,source) for every well separated 
+    // pair of buckets, and strong(level,target,source) for every pair of 
+    // leafs in the near field
+    template <typename Query, typename ChildIteratorVector, 
+              typename WeakFunction, typename StrongFunction>
+    void for_each_interaction_dive(const Query& query,
+            const ChildIteratorVector& parents_strong_connections,
+            const typename Query::child_iterator& ci,
+            const size_t level,
+            WeakFunction& weak, StrongFunction& strong) {
+        typedef typename Query::child_iterator child_iterator;
+        const auto& target_box = query.get_bounds(ci);
+        theta_condition<Query::dimension> theta(target_box.bmin,target_box.bmax);
+
+        ChildIteratorVector strong_connections;
+        if (level == 0) {
+            for (child_iterator cj = query.get_children(); cj != false; ++cj) {
+                const auto& source_box = query.get_bounds(cj);
+                if (theta.check(source_box.bmin,source_box.bmax)) {
+                    strong_connections.push_back(cj);
+                } else {
+                    weak(level,ci,cj);
+                }
+            }
+        } else {
+            for (const child_iterator& source: parents_strong_connections) {
+                if (query.is_leaf_node(*source)) {
+                    strong_connections.push_back(source);
+                } else {
+                    for (child_iterator cj = query.get_children(source); cj != false; ++cj) {
+                        const auto& source_box = query.get_bounds(cj);
+                        if (theta.check(source_box.bmin,source_box.bmax)) {
+                            strong_connections.push_back(cj);
+                        } else {
+                            weak(level,ci,cj);
+                        }
+                    }
+                }
+            }
+        }
+        if (!query.is_leaf_node(*ci)) { 
+            for (child_iterator cj = query.get_children(ci); cj != false; ++cj) {
+                for_each_interaction_dive(query,strong_connections,cj,level+1,
+                                          weak,strong);
+            }
+        } else {
+            for (const child_iterator& source: strong_connections) {
+                if (query.is_leaf_node(*source)) {
+                    strong(level,ci,source);
+                } else {
+                    auto range = query.get_subtree(source);
+                    for (auto i = range.begin(); i!=range.end(); ++i) {
+                        if (query.is_leaf_node(*i)) {
+                            strong(level,ci,i.get_child_iterator());
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    template <typename Query, typename WeakFunction, typename StrongFunction>
+    void for_each_interaction(const Query& query, 
+                              WeakFunction weak, StrongFunction strong) {
+        typedef typename Query::traits_type::template vector_type<
+            typename Query::child_iterator>::type child_iterator_vector_type;
+        for (auto ci = query.get_children(); ci != false; ++ci) {
+            for_each_interaction_dive(query,child_iterator_vector_type(),ci,0,
+                                      weak,strong);
+        }
+    }
+
+    // counts the interactions on each level of the tree
+    template <typename Query>
+    void count_interactions(const Query& query, fast_method_statistics& stats) {
+        typedef typename Query::child_iterator child_iterator;
+        stats.weak_interactions.clear();
+        stats.strong_interactions.clear();
+        for_each_interaction(query,
+            [&](const size_t level, const child_iterator&, const child_iterator&) {
+                stats.add_weak(level);
+            },
+            [&](const size_t level, const child_iterator&, const child_iterator&) {
+                stats.add_strong(level);
+            });
+    }
+
 }
 }
 
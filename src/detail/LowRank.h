@@ -38,6 +38,7 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifdef HAVE_EIGEN
 
 #include <Eigen/Core>
+#include <list>
 
 namespace Aboria {
 namespace detail {
@@ -109,6 +110,16 @@ size_t adaptive_cross_approximation_partial(const Kernel& Z,
                 it_max = it;
             }
         }
+        // residual row is zero. This row gives no new information, but other 
+        // rows might (e.g. a kernel with compact support, or a sign-changing
+        // kernel that is zero along this row), so try the next remaining 
+        // row. The approximation is only exact once every row has been tried
+        if (max == 0) {
+            if (row_pivots.empty()) break;
+            i = row_pivots.front();
+            row_pivots.pop_front();
+            continue;
+        }
         col_pivots.erase(it_max);
 
         LOG(4,"\tcol pivot = "<<j);
@@ -124,7 +135,7 @@ size_t adaptive_cross_approximation_partial(const Kernel& Z,
         }
 
         U.col(k) = Rcol;
-        uv_norm2 = V.row(k).norm()*U.col(k).norm();
+        uv_norm2 = V.row(k).squaredNorm()*U.col(k).squaredNorm();
         double sum = 0;
         for (int l = 0; l < k; ++l) {
             const double innerU = U.col(l).dot(U.col(k));
@@ -148,6 +159,12 @@ size_t adaptive_cross_approximation_partial(const Kernel& Z,
                     it_max = it;
                 }
             }
+            if (max == 0) {
+                // residual column is zero, use any remaining row
+                if (row_pivots.empty()) break;
+                it_max = row_pivots.begin();
+                i = *it_max;
+            }
             row_pivots.erase(it_max);
             LOG(4,"\trow pivot = "<<i);
         }
@@ -37,8 +37,11 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef OPERATORS_DETAIL_H_
 #define OPERATORS_DETAIL_H_
 
+#include <algorithm>
+#include <array>
 #include <type_traits>
 #include <limits>
+#include <utility>
 #include "Vector.h"
 
 #define EIGEN_YES_I_KNOW_SPARSE_MODULE_IS_NOT_STABLE_YET
@@ -195,8 +198,162 @@ namespace detail {
         evalTo_unpack_blocks(y,lhs,rhs,other_blocks...);
     }
 
+    // a set of blocks can be evaluated with a single neighbour traversal if 
+    // they are all sparse kernels (see Aboria::KernelSparse) over the same 
+    // types of row and column particles 
+    template <typename Block, typename Enable=void>
+    struct is_sparse_kernel: std::false_type {};
+
+    template <typename Block>
+    struct is_sparse_kernel<Block,
+        typename std::conditional<false,typename Block::radius_function_type,void>::type>: 
+        std::true_type {};
+
+    template <bool... B>
+    struct bool_pack {};
+
+    template <bool... B>
+    struct all_true: std::is_same<bool_pack<true,B...>,bool_pack<B...,true>> {};
+
+    template <typename First, typename Block>
+    struct is_fusable_block: std::integral_constant<bool,
+        is_sparse_kernel<Block>::value &&
+        std::is_same<typename First::row_particles_type, 
+                     typename Block::row_particles_type>::value &&
+        std::is_same<typename First::col_particles_type, 
+                     typename Block::col_particles_type>::value> {};
+
+    template <typename Blocks>
+    struct is_fusable;
+
+    template <typename First, typename... T>
+    struct is_fusable<std::tuple<First,T...>>: 
+        all_true<is_fusable_block<First,First>::value,is_fusable_block<First,T>::value...> {};
+
+    // a block can be assembled directly into compressed sparse row format 
+    // if it provides assemble_row_counts and assemble_rows (see 
+    // Aboria::KernelSparse). Otherwise it only needs to provide the triplet 
+    // assemble 
+    template <typename Block, typename Enable=void>
+    struct has_csr_assemble: std::false_type {};
+
+    template <typename Block>
+    struct has_csr_assemble<Block,
+        typename std::conditional<false,
+            decltype(std::declval<const Block&>().assemble_row_counts(
+                        std::declval<int*>(),size_t())),
+            void>::type>: 
+        std::true_type {};
+
+    template <typename Blocks>
+    struct is_csr_assemblable;
+
+    template <typename... T>
+    struct is_csr_assemblable<std::tuple<T...>>: 
+        all_true<has_csr_assemble<T>::value...> {};
+
+    template<unsigned int NI, unsigned int NJ, typename Blocks, std::size_t... I>
+    bool can_fuse(const MatrixReplacement<NI,NJ,Blocks>& lhs, std::false_type, detail::index_sequence<I...>) {
+        return false;
+    }
+
+    // the blocks must also share the same row and column particle sets at 
+    // runtime, and each must be using the neighbour search directly
+    template<unsigned int NI, unsigned int NJ, typename Blocks, std::size_t... I>
+    bool can_fuse(const MatrixReplacement<NI,NJ,Blocks>& lhs, std::true_type, detail::index_sequence<I...>) {
+        const auto& first = std::get<0>(lhs.m_blocks);
+        const bool fusable[] = { (
+                &std::get<I>(lhs.m_blocks).get_row_particles() == &first.get_row_particles() &&
+                &std::get<I>(lhs.m_blocks).get_col_particles() == &first.get_col_particles() &&
+                std::get<I>(lhs.m_blocks).uses_neighbour_search())... };
+        return std::all_of(std::begin(fusable),std::end(fusable),
+                           [](const bool b) { return b; });
+    }
+
+    // row i of a single sparse block, using its own neighbour search
+    template <typename Block, typename Rhs>
+    typename Block::Scalar sparse_row_sum(const Block& block, const size_t i, 
+                                          const Rhs& rhs, const size_t start_col) {
+        typedef typename Block::row_particles_type row_particles_type;
+        typedef typename Block::col_particles_type col_particles_type;
+        typedef typename row_particles_type::position position;
+        const row_particles_type& a = block.get_row_particles();
+        const col_particles_type& b = block.get_col_particles();
+        typename row_particles_type::const_reference ai = a[i];
+        typename Block::Scalar sum(0);
+        for (auto pairj: euclidean_search(b.get_query(),get<position>(ai),block.get_radius(ai))) {
+            typename col_particles_type::const_reference bj = detail::get_impl<0>(pairj);
+            const size_t j = &get<position>(bj) - get<position>(b).data();
+            sum += block.eval(detail::get_impl<1>(pairj),ai,bj)*rhs[start_col+j];
+        }
+        return sum;
+    }
+
+    template<typename Dest, unsigned int NI, unsigned int NJ, typename Blocks, typename Rhs, std::size_t... I>
+    bool evalTo_fused(Dest& y, const MatrixReplacement<NI,NJ,Blocks>& lhs, const Rhs& rhs, std::false_type, detail::index_sequence<I...>) {
+        return false;
+    }
+
+    // Evaluates all the blocks together. For each row particle, a single 
+    // neighbour search (if the radius of every block is the same) feeds all 
+    // the blocks. The sum for each block is accumulated separately and added 
+    // to y in block order, so the result is identical to evaluating each 
+    // block in turn
+    template<typename Dest, unsigned int NI, unsigned int NJ, typename Blocks, typename Rhs, std::size_t... I>
+    bool evalTo_fused(Dest& y, const MatrixReplacement<NI,NJ,Blocks>& lhs, const Rhs& rhs, std::true_type, detail::index_sequence<I...> seq) {
+        if (!can_fuse(lhs,std::true_type(),seq)) {
+            return false;
+        }
+
+        typedef typename std::tuple_element<0,Blocks>::type first_block_type;
+        typedef typename first_block_type::row_particles_type row_particles_type;
+        typedef typename first_block_type::col_particles_type col_particles_type;
+        typedef typename row_particles_type::position position;
+        typedef typename MatrixReplacement<NI,NJ,Blocks>::Scalar Scalar;
+        const size_t nblocks = NI*NJ;
+
+        const row_particles_type& a = std::get<0>(lhs.m_blocks).get_row_particles();
+        const col_particles_type& b = std::get<0>(lhs.m_blocks).get_col_particles();
+        const size_t na = a.size();
+        const size_t nb = b.size();
+
+        #pragma omp parallel for
+        for (size_t i=0; i<na; ++i) {
+            typename row_particles_type::const_reference ai = a[i];
+            const std::array<double,nblocks> radius = {{ 
+                std::get<I>(lhs.m_blocks).get_radius(ai)... }};
+            std::array<Scalar,nblocks> sums;
+            sums.fill(Scalar(0));
+            if (std::all_of(radius.begin(),radius.end(),
+                            [&](const double r) { return r == radius[0]; })) {
+                for (auto pairj: euclidean_search(b.get_query(),get<position>(ai),radius[0])) {
+                    typename col_particles_type::const_reference bj = detail::get_impl<0>(pairj);
+                    const size_t j = &get<position>(bj) - get<position>(b).data();
+                    int dummy[] = { 0, (
+                            sums[I] += std::get<I>(lhs.m_blocks).eval(
+                                detail::get_impl<1>(pairj),ai,bj)*rhs[(I%NJ)*nb+j]
+                            ,0)... };
+                    static_cast<void>(dummy);
+                }
+            } else {
+                int dummy[] = { 0, (
+                        sums[I] = sparse_row_sum(std::get<I>(lhs.m_blocks),i,rhs,(I%NJ)*nb)
+                        ,0)... };
+                static_cast<void>(dummy);
+            }
+            for (size_t k=0; k<nblocks; ++k) {
+                y[(k/NJ)*na+i] += sums[k];
+            }
+        }
+        return true;
+    }
+
     template<typename Dest, unsigned int NI, unsigned int NJ, typename Blocks, typename Rhs, std::size_t... I>
-    void evalTo_impl(Dest& y, const MatrixReplacement<NI,NJ,Blocks>& lhs, const Rhs& rhs, detail::index_sequence<I...>) {
+    void evalTo_impl(Dest& y, const MatrixReplacement<NI,NJ,Blocks>& lhs, const Rhs& rhs, detail::index_sequence<I...> seq) {
+        if (lhs.m_fused && 
+            evalTo_fused(y,lhs,rhs,typename is_fusable<Blocks>::type(),seq)) {
+            return;
+        }
         evalTo_unpack_blocks(y,lhs,rhs,
                 std::tuple<mpl::int_<I/NJ>,mpl::int_<I%NJ>,
                             typename std::tuple_element<I,Blocks>::type const &>
@@ -204,6 +361,43 @@ namespace detail {
                            mpl::int_<I%NJ>(), 
                            std::get<I>(lhs.m_blocks))...);
     }
+
+    // kernels that provide evaluate_block() process all the right hand 
+    // sides together, all others are evaluated one column at a time
+    template <typename Dest, typename Source, typename Block>
+    auto evalTo_block_matrix(Dest y, const Source& rhs, const Block& block, int) 
+        -> decltype(block.evaluate_block(y,rhs),void()) {
+        block.evaluate_block(y,rhs);
+    }
+
+    template <typename Dest, typename Source, typename Block>
+    void evalTo_block_matrix(Dest y, const Source& rhs, const Block& block, long) {
+        for (int i = 0; i < rhs.cols(); ++i) {
+            auto y_col = y.col(i);
+            block.evaluate(y_col,rhs.col(i));
+        }
+    }
+
+    template<typename Dest, unsigned int NI, unsigned int NJ, typename Blocks, typename Rhs>
+    void evalTo_matrix_unpack_blocks(Dest& y, const MatrixReplacement<NI,NJ,Blocks>& lhs, const Rhs& rhs) {}
+
+    template<typename Dest, unsigned int NI, unsigned int NJ, typename Blocks, typename Rhs, typename I, typename J, typename T1, typename ... T>
+    void evalTo_matrix_unpack_blocks(Dest& y, const MatrixReplacement<NI,NJ,Blocks>& lhs, const Rhs& rhs, const std::tuple<I,J,T1&>& block, const T&... other_blocks) {
+        evalTo_block_matrix(y.middleRows(lhs.template start_row<I::value>(),lhs.template size_row<I::value>()),
+                rhs.middleRows(lhs.template start_col<J::value>(),lhs.template size_col<J::value>()),
+                std::get<2>(block),0);
+        evalTo_matrix_unpack_blocks(y,lhs,rhs,other_blocks...);
+    }
+
+    template<typename Dest, unsigned int NI, unsigned int NJ, typename Blocks, typename Rhs, std::size_t... I>
+    void evalTo_matrix_impl(Dest& y, const MatrixReplacement<NI,NJ,Blocks>& lhs, const Rhs& rhs, detail::index_sequence<I...>) {
+        evalTo_matrix_unpack_blocks(y,lhs,rhs,
+                std::tuple<mpl::int_<I/NJ>,mpl::int_<I%NJ>,
+                            typename std::tuple_element<I,Blocks>::type const &>
+                          (mpl::int_<I/NJ>(), 
+                           mpl::int_<I%NJ>(), 
+                           std::get<I>(lhs.m_blocks))...);
+    }
 } // namespace detail
 } // namespace Aboria
 
@@ -229,6 +423,22 @@ struct generic_product_impl<Aboria::MatrixReplacement<NI,NJ,Blocks>, Rhs, Sparse
 #endif
     }
 };
+
+// Implementation of MatrixReplacement * Eigen::DenseMatrix, used for blocks of
+// right hand sides
+template<typename Rhs, unsigned int NI, unsigned int NJ, typename Blocks>
+struct generic_product_impl<Aboria::MatrixReplacement<NI,NJ,Blocks>, Rhs, SparseShape, DenseShape, GemmProduct> // GEMM stands for matrix-matrix
+    : generic_product_impl_base<Aboria::MatrixReplacement<NI,NJ,Blocks>,Rhs,generic_product_impl<Aboria::MatrixReplacement<NI,NJ,Blocks>,Rhs,SparseShape,DenseShape,GemmProduct> > {
+
+    typedef typename Product<Aboria::MatrixReplacement<NI,NJ,Blocks>,Rhs>::Scalar Scalar;
+    template<typename Dest>
+    static void scaleAndAddTo(Dest& y, const Aboria::MatrixReplacement<NI,NJ,Blocks>& lhs, const Rhs& rhs, const Scalar& alpha) {
+        // This method should implement "y += alpha * lhs * rhs" inplace,
+        // as above alpha is assumed to be 1
+        assert(alpha==Scalar(1) && "scaling is not implemented");
+        evalTo_matrix_impl(y, lhs, rhs, Aboria::detail::make_index_sequence<NI*NJ>());
+    }
+};
 }
 }
 
@@ -37,11 +37,206 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef PARTICLES_DETAIL_H_
 #define PARTICLES_DETAIL_H_
 
+#include <cstring>
+#include <fstream>
+#include <typeinfo>
+#include <type_traits>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ABORIA_HAVE_MMAP
+#endif
 
 namespace Aboria {
 
 namespace detail {
 
+//
+// Binary checkpoint format written by Particles::save_binary(). The file 
+// holds a binary_file_header, the search domain (low and high as doubles, 
+// periodic as one byte per dimension), a binary_column_header for each 
+// variable, and finally the data of each variable stored contiguously and 
+// aligned to binary_column_alignment bytes
+//
+const char binary_file_magic[8] = {'A','B','O','R','I','A','B','N'};
+const uint32_t binary_file_version = 1;
+const uint64_t binary_column_alignment = 64;
+
+struct binary_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dimension;
+    uint64_t size;
+    uint64_t next_id;
+    uint32_t seed;
+    uint32_t number_of_columns;
+    uint32_t neighbour_search;
+    uint32_t id_search;
+    uint32_t morton_order;
+    uint32_t unused;
+    double n_particles_in_leaf;
+};
+
+struct binary_column_header {
+    char name[64];
+    char type[64];
+    uint64_t element_size;
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+inline uint64_t binary_align(const uint64_t offset) {
+    return ((offset + binary_column_alignment - 1)/binary_column_alignment)
+                *binary_column_alignment;
+}
+
+// fill in a column header for each variable, with the offset of each 
+// column starting at \p offset
+struct make_binary_column_header {
+    binary_column_header* header;
+    uint64_t offset;
+
+    make_binary_column_header(binary_column_header* header, const uint64_t offset):
+        header(header),offset(binary_align(offset)) {}
+
+    template <typename Vector>
+    void operator()(const char* name, const Vector& v) {
+        typedef typename Vector::value_type value_type;
+        std::memset(header,0,sizeof(binary_column_header));
+        std::strncpy(header->name,name,sizeof(header->name)-1);
+        std::strncpy(header->type,typeid(value_type).name(),sizeof(header->type)-1);
+        header->element_size = sizeof(value_type);
+        header->offset = offset;
+        header->bytes = v.size()*sizeof(value_type);
+        offset = binary_align(offset + header->bytes);
+        ++header;
+    }
+};
+
+// write each variable with a single contiguous write, padding the stream 
+// up to the offset given in its column header 
+struct write_binary_column {
+    std::ostream& os;
+    const binary_column_header* header;
+    uint64_t position;
+
+    write_binary_column(std::ostream& os, const binary_column_header* header, const uint64_t position):
+        os(os),header(header),position(position) {}
+
+    template <typename T, typename Alloc>
+    void operator()(const char* name, const std::vector<T,Alloc>& v) {
+        static_assert(std::is_standard_layout<T>::value,
+                "binary output requires plain data variable types");
+        write(v.data());
+    }
+
+    void operator()(const char* name, const std::vector<bool>& v) {
+        std::vector<uint8_t> tmp(v.begin(),v.end());
+        write(tmp.data());
+    }
+
+    // other (e.g. device) vectors are copied to the host first
+    template <typename Vector>
+    void operator()(const char* name, const Vector& v) {
+        std::vector<typename Vector::value_type> tmp(v.size());
+        detail::copy(v.begin(),v.end(),tmp.begin());
+        (*this)(name,tmp);
+    }
+
+private:
+    void write(const void* data) {
+        ASSERT(header->offset >= position,"column offset before end of previous column");
+        const char zeros[binary_column_alignment] = {};
+        os.write(zeros,header->offset - position);
+        os.write(static_cast<const char*>(data),header->bytes);
+        position = header->offset + header->bytes;
+        ++header;
+    }
+};
+
+// copy each variable straight from the (mapped) file, checking that its 
+// name and type match the column header
+struct read_binary_column {
+    const char* file_data;
+    uint64_t file_size;
+    const binary_column_header* header;
+    size_t n;
+
+    read_binary_column(const char* file_data, const uint64_t file_size, 
+                       const binary_column_header* header, const size_t n):
+        file_data(file_data),file_size(file_size),header(header),n(n) {}
+
+    template <typename Vector>
+    void operator()(const char* name, Vector& v) {
+        typedef typename Vector::value_type value_type;
+        CHECK(std::strncmp(header->name,name,sizeof(header->name)-1) == 0,
+                "variable "<<name<<" does not match name "<<header->name<<" in binary file");
+        CHECK(header->element_size == sizeof(value_type) && 
+              std::strncmp(header->type,typeid(value_type).name(),sizeof(header->type)-1) == 0,
+                "type of variable "<<name<<" does not match type in binary file");
+        CHECK(header->bytes == n*sizeof(value_type) && 
+              header->offset + header->bytes <= file_size,
+                "binary file is truncated or corrupt (variable "<<name<<")");
+        const value_type* begin = reinterpret_cast<const value_type*>(
+                                            file_data + header->offset);
+        v.assign(begin,begin+n);
+        ++header;
+    }
+};
+
+// read-only view of a whole file, memory mapped if possible
+class mapped_file {
+public:
+    mapped_file(const std::string& filename):
+        m_data(nullptr),m_size(0) {
+#ifdef ABORIA_HAVE_MMAP
+        const int fd = open(filename.c_str(),O_RDONLY);
+        CHECK(fd != -1,"could not open file "<<filename);
+        struct stat sb;
+        CHECK(fstat(fd,&sb) != -1,"could not stat file "<<filename);
+        m_size = sb.st_size;
+        if (m_size > 0) {
+            void* map = mmap(nullptr,m_size,PROT_READ,MAP_PRIVATE,fd,0);
+            CHECK(map != MAP_FAILED,"could not mmap file "<<filename);
+            madvise(map,m_size,MADV_SEQUENTIAL);
+            m_data = static_cast<const char*>(map);
+        }
+        close(fd);
+#else
+        std::ifstream is(filename,std::ios::binary | std::ios::ate);
+        CHECK(is.good(),"could not open file "<<filename);
+        m_size = is.tellg();
+        m_buffer.resize(m_size);
+        is.seekg(0);
+        is.read(m_buffer.data(),m_size);
+        m_data = m_buffer.data();
+#endif
+    }
+
+    ~mapped_file() {
+#ifdef ABORIA_HAVE_MMAP
+        if (m_data != nullptr) {
+            munmap(const_cast<char*>(m_data),m_size);
+        }
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char* m_data;
+    size_t m_size;
+#ifndef ABORIA_HAVE_MMAP
+    std::vector<char> m_buffer;
+#endif
+};
+
 #ifdef HAVE_VTK
 
 template <typename reference>
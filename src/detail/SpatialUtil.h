@@ -104,6 +104,23 @@ std::ostream& operator<< (std::ostream& out, const bbox<D>& b) {
 	return out << "bbox(" << b.bmin << "<->" << b.bmax << ")";
 }
 
+// round \p n down to a power of two (returns at least 1). Rounding down means
+// that buckets only ever get larger, so any minimum bucket side length (e.g.
+// the one assumed by the fast bucket search) is preserved
+inline
+CUDA_HOST_DEVICE
+unsigned int round_down_to_power_of_two(const unsigned int n) {
+    unsigned int p = 1;
+    while (2*p <= n) p *= 2;
+    return p;
+}
+
+/// maps a D-dimensional bucket index vector to a linear bucket index. By
+/// default the ordering is row-major (last dimension fastest). If \p morton is
+/// set the buckets are numbered along a Morton (Z-order) curve instead, so that
+/// buckets that are close in space are also close in memory. The morton
+/// ordering requires that each element of \p size is a power of two, and then
+/// the mapping is a bijection onto [0,size.prod())
 template<unsigned int D>
 struct bucket_index {
     typedef Vector<double,D> double_d;
@@ -111,18 +128,28 @@ struct bucket_index {
     typedef Vector<int,D> int_d;
 
     unsigned_int_d m_size;
+    bool m_morton;
 
     CUDA_HOST_DEVICE
-    bucket_index() {};
+    bucket_index():m_morton(false) {};
 
     CUDA_HOST_DEVICE
-    bucket_index(const unsigned_int_d& size): 
-        m_size(size) {
+    bucket_index(const unsigned_int_d& size, const bool morton=false): 
+        m_size(size),m_morton(morton) {
+#ifndef __CUDA_ARCH__
+            if (morton) {
+                for (int i = 0; i < D; ++i) {
+                    ASSERT((m_size[i] & (m_size[i]-1)) == 0,
+                        "morton ordering requires a power of two number of buckets in each dimension");
+                }
+            }
+#endif
         }
 
     inline 
     CUDA_HOST_DEVICE
     int collapse_index_vector(const int_d &vindex) const {
+        if (m_morton) return collapse_morton(vindex);
         int index = 0;
         unsigned int multiplier = 1.0;
         for (int i = D-1; i>=0; --i) {
@@ -137,6 +164,7 @@ struct bucket_index {
     inline 
     CUDA_HOST_DEVICE
     unsigned int collapse_index_vector(const unsigned_int_d &vindex) const {
+        if (m_morton) return collapse_morton(vindex);
         unsigned int index = 0;
         unsigned int multiplier = 1.0;
         for (int i = D-1; i>=0; --i) {
@@ -151,6 +179,7 @@ struct bucket_index {
     inline 
     CUDA_HOST_DEVICE
     int_d reassemble_index_vector(const int index) const {
+        if (m_morton) return reassemble_morton<int>(index);
         int_d vindex;
         int i = index;
         for (int d = D-1; d>=0; --d) {
@@ -164,6 +193,7 @@ struct bucket_index {
     inline 
     CUDA_HOST_DEVICE
     unsigned_int_d reassemble_index_vector(const unsigned int index) const {
+        if (m_morton) return reassemble_morton<unsigned int>(index);
         unsigned_int_d vindex;
         unsigned int i = index;
         for (int d = D-1; d>=0; --d) {
@@ -173,6 +203,47 @@ struct bucket_index {
         }
         return vindex;
     }
+
+private:
+    // interleave the bits of vindex, skipping dimensions that have run out of
+    // bits (i.e. (1<<bit) >= m_size[i]) so that non-cubic grids stay compact
+    template <typename T>
+    inline 
+    CUDA_HOST_DEVICE
+    T collapse_morton(const Vector<T,D> &vindex) const {
+        T index = 0;
+        unsigned int out_bit = 0;
+        for (unsigned int bit = 0; bit < 8*sizeof(unsigned int); ++bit) {
+            bool active = false;
+            for (int i = D-1; i>=0; --i) {
+                if ((1u << bit) < m_size[i]) {
+                    index |= ((vindex[i] >> bit) & 1) << out_bit++;
+                    active = true;
+                }
+            }
+            if (!active) break;
+        }
+        return index;
+    }
+
+    template <typename T>
+    inline 
+    CUDA_HOST_DEVICE
+    Vector<T,D> reassemble_morton(T index) const {
+        Vector<T,D> vindex(0);
+        for (unsigned int bit = 0; bit < 8*sizeof(unsigned int); ++bit) {
+            bool active = false;
+            for (int i = D-1; i>=0; --i) {
+                if ((1u << bit) < m_size[i]) {
+                    vindex[i] |= (index & 1) << bit;
+                    index >>= 1;
+                    active = true;
+                }
+            }
+            if (!active) break;
+        }
+        return vindex;
+    }
 };
 
 template<unsigned int D>
@@ -192,8 +263,9 @@ struct point_to_bucket_index {
     CUDA_HOST_DEVICE
     point_to_bucket_index(const unsigned_int_d& size, 
                           const double_d& bucket_side_length, 
-                          const bbox<D> &bounds):
-        m_bucket_index(size),
+                          const bbox<D> &bounds,
+                          const bool morton=false):
+        m_bucket_index(size,morton),
         m_bucket_side_length(bucket_side_length),
         m_inv_bucket_side_length(1.0/bucket_side_length),
         m_bounds(bounds) {}
@@ -38,6 +38,8 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef TERMINAL_DETAIL_H_
 #define TERMINAL_DETAIL_H_
 
+#include "detail/VerletList.h"
+
 
 
 namespace Aboria {
@@ -107,7 +109,8 @@ struct accumulate_within_distance {
     accumulate_within_distance(const double max_distance, const T& functor=T()):
         functor(functor),
         max_distance(max_distance),
-        init(0) 
+        init(0),
+        verlet_list(nullptr)
     {};
     void set_init(const init_type& arg) {
         init = arg;
@@ -115,9 +118,13 @@ struct accumulate_within_distance {
     void set_max_distance(const double arg) {
         max_distance = arg;
     }
+    void set_verlet_list(const verlet_list_csr* arg) {
+        verlet_list = arg;
+    }
     T functor;
     init_type init;
     double max_distance;
+    const verlet_list_csr* verlet_list;
 };
 
 template <typename T,unsigned int N>
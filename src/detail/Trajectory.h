@@ -0,0 +1,194 @@
+/*
+
+Copyright (c) 2005-2016, University of Oxford.
+All rights reserved.
+
+University of Oxford means the Chancellor, Masters and Scholars of the
+University of Oxford, having an administrative office at Wellington
+Square, Oxford OX1 2JD, UK.
+
+This file is part of Aboria.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+ * Neither the name of the University of Oxford nor the names of its
+   contributors may be used to endorse or promote products derived from this
+   software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TRAJECTORY_DETAIL_H_
+#define TRAJECTORY_DETAIL_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace Aboria {
+namespace detail {
+
+//
+// Frame compression for the trajectory files written by TrajectoryWriter. 
+// A column is compressed against the same column of the previous frame 
+// (or against zero for the first frame, or when the number of particles
+// changes), using one of two encodings:
+//
+// xor: the column is split into 64-bit words, and each word is XOR-ed with
+// the previous word. Variables that change slowly (or not at all) between 
+// frames give words with many leading zero bytes, so each word is stored 
+// as a 4-bit count of its significant bytes (packed two per byte at the 
+// start of the encoded column) followed by those bytes.
+//
+// quantized: used for positions when a quantization step is given. Each 
+// double is rounded to an integer multiple of the step, and the difference
+// to the previous frame is stored as a zig-zag encoded LEB128 varint.
+//
+
+const char trajectory_file_magic[8] = {'A','B','O','R','I','A','T','R'};
+const uint32_t trajectory_file_version = 1;
+
+struct trajectory_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dimension;
+    uint32_t number_of_columns;
+    uint32_t unused;
+    double position_step;
+};
+
+struct trajectory_column_header {
+    char name[64];
+    uint64_t element_size;
+    uint64_t quantized;
+};
+
+struct trajectory_frame_header {
+    uint64_t bytes;
+    uint64_t size;
+    double time;
+    uint64_t delta;
+};
+
+inline uint64_t load_word(const char* data, const size_t bytes) {
+    uint64_t word = 0;
+    std::memcpy(&word,data,bytes);
+    return word;
+}
+
+inline int significant_bytes(uint64_t word) {
+    int n = 0;
+    while (word != 0) {
+        word >>= 8;
+        ++n;
+    }
+    return n;
+}
+
+inline void xor_encode(const char* data, const char* previous, 
+                       const size_t bytes, std::vector<char>& out) {
+    const size_t n_words = (bytes+7)/8;
+    const size_t counts_begin = out.size();
+    out.resize(counts_begin + (n_words+1)/2,0);
+    for (size_t i = 0; i < n_words; ++i) {
+        const size_t word_bytes = std::min(size_t(8),bytes-8*i);
+        uint64_t word = load_word(data+8*i,word_bytes);
+        if (previous != nullptr) {
+            word ^= load_word(previous+8*i,word_bytes);
+        }
+        const int n = significant_bytes(word);
+        out[counts_begin + i/2] |= static_cast<char>(n << (4*(i%2)));
+        for (int b = 0; b < n; ++b) {
+            out.push_back(static_cast<char>((word >> (8*b)) & 0xFF));
+        }
+    }
+}
+
+// returns a pointer to the end of the encoded column
+inline const char* xor_decode(const char* in, const char* previous,
+                              const size_t bytes, char* data) {
+    const size_t n_words = (bytes+7)/8;
+    const unsigned char* counts = reinterpret_cast<const unsigned char*>(in);
+    const unsigned char* payload = counts + (n_words+1)/2;
+    for (size_t i = 0; i < n_words; ++i) {
+        const size_t word_bytes = std::min(size_t(8),bytes-8*i);
+        const int n = (counts[i/2] >> (4*(i%2))) & 0xF;
+        uint64_t word = 0;
+        for (int b = 0; b < n; ++b) {
+            word |= static_cast<uint64_t>(*payload++) << (8*b);
+        }
+        if (previous != nullptr) {
+            word ^= load_word(previous+8*i,word_bytes);
+        }
+        std::memcpy(data+8*i,&word,word_bytes);
+    }
+    return reinterpret_cast<const char*>(payload);
+}
+
+inline int64_t quantize(const double value, const double step) {
+    return static_cast<int64_t>(std::llround(value/step));
+}
+
+inline void quantized_encode(const double* data, const double* previous, 
+                             const size_t n, const double step, 
+                             std::vector<char>& out) {
+    for (size_t i = 0; i < n; ++i) {
+        int64_t delta = quantize(data[i],step);
+        if (previous != nullptr) {
+            delta -= quantize(previous[i],step);
+        }
+        uint64_t zigzag = (static_cast<uint64_t>(delta) << 1) ^ 
+                          static_cast<uint64_t>(delta >> 63);
+        while (zigzag >= 0x80) {
+            out.push_back(static_cast<char>((zigzag & 0x7F) | 0x80));
+            zigzag >>= 7;
+        }
+        out.push_back(static_cast<char>(zigzag));
+    }
+}
+
+// the decoded values are multiples of \p step, so \p previous is exactly 
+// representable by its quantized value
+inline const char* quantized_decode(const char* in, const double* previous, 
+                                    const size_t n, const double step, 
+                                    double* data) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t zigzag = 0;
+        int shift = 0;
+        while (*p & 0x80) {
+            zigzag |= static_cast<uint64_t>(*p++ & 0x7F) << shift;
+            shift += 7;
+        }
+        zigzag |= static_cast<uint64_t>(*p++) << shift;
+        int64_t value = static_cast<int64_t>(zigzag >> 1) ^ 
+                        -static_cast<int64_t>(zigzag & 1);
+        if (previous != nullptr) {
+            value += quantize(previous[i],step);
+        }
+        data[i] = value*step;
+    }
+    return reinterpret_cast<const char*>(p);
+}
+
+}
+}
+
+#endif //TRAJECTORY_DETAIL_H_
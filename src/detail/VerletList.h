@@ -0,0 +1,101 @@
+/*
+
+Copyright (c) 2005-2016, University of Oxford.
+All rights reserved.
+
+University of Oxford means the Chancellor, Masters and Scholars of the
+University of Oxford, having an administrative office at Wellington
+Square, Oxford OX1 2JD, UK.
+
+This file is part of Aboria.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+ * Neither the name of the University of Oxford nor the names of its
+   contributors may be used to endorse or promote products derived from this
+   software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef VERLET_LIST_DETAIL_H_
+#define VERLET_LIST_DETAIL_H_
+
+#include <vector>
+#include <cstddef>
+
+namespace Aboria {
+namespace detail {
+
+/// Compressed sparse row (CSR) storage for a Verlet list. This holds no 
+/// particle types, so that symbolic terminals (e.g. AccumulateWithinDistance)
+/// can refer to a list without knowing the particle sets it was built from.
+/// Row and column indices are the indices of the particles in their 
+/// containers at the last rebuild.
+struct verlet_list_csr {
+    std::vector<size_t> m_row_offsets;
+    std::vector<size_t> m_col_indices;
+
+    // start of the row/col position arrays at the last update, used to map a 
+    // particle reference back to its index
+    const void* m_row_positions;
+    const void* m_col_positions;
+    double m_radius;
+    double m_skin;
+
+    verlet_list_csr(const double radius, const double skin):
+        m_row_offsets(1,0),
+        m_row_positions(nullptr),
+        m_col_positions(nullptr),
+        m_radius(radius),
+        m_skin(skin) 
+    {}
+
+    /// the number of rows in the list
+    size_t size() const { return m_row_offsets.size()-1; }
+
+    /// the number of stored (i,j) pairs 
+    size_t number_of_pairs() const { return m_col_indices.size(); }
+
+    /// all pairs closer than this are guarenteed to be in the list
+    double get_radius() const { return m_radius; }
+
+    /// the extra distance added to the radius when building the list 
+    double get_skin() const { return m_skin; }
+
+    const std::vector<size_t>& get_row_offsets() const { return m_row_offsets; }
+    const std::vector<size_t>& get_col_indices() const { return m_col_indices; }
+
+    /// returns the row index of the particle with the given position (which 
+    /// must be a reference into the row particle set)
+    template <typename double_d>
+    size_t get_row_index(const double_d& position) const {
+        return &position - static_cast<const double_d*>(m_row_positions);
+    }
+
+    /// returns true if the list was built using \p col_positions
+    template <typename double_d>
+    bool is_col_positions(const double_d* col_positions) const {
+        return static_cast<const void*>(col_positions) == m_col_positions;
+    }
+};
+
+}
+}
+
+#endif
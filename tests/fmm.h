@@ -95,6 +95,12 @@ public:
             TS_ASSERT_LESS_THAN(L2_fmm/scale,1e-2);
         }
 
+        auto stats = fmm.get_statistics();
+        std::cout << "fmm statistics: " << stats;
+        TS_ASSERT_EQUALS(stats.dense_bytes,
+                         particles.size()*particles.size()*sizeof(double));
+        TS_ASSERT(!stats.strong_interactions.empty());
+
 #ifdef HAVE_EIGEN
         for (reference p: particles) {
             get<target_fmm>(p) = 0;
@@ -344,6 +350,106 @@ public:
     }
 
 
+    void test_m2l_cache(void) {
+        // a kernel that is not translation invariant must give the same 
+        // result whether or not the M2L cache is enabled, as the cache 
+        // disables itself when the first reused operator fails the check
+        const unsigned int D = 2;
+        typedef Vector<double,D> double_d;
+        typedef Particles<std::tuple<source,target_manual,target_fmm>,D,std::vector,octtree> ParticlesType;
+        typedef typename ParticlesType::position position;
+        const size_t N = 2000;
+        ParticlesType particles(N);
+        std::uniform_real_distribution<double> U(0,1);
+        generator_type generator;
+        for (size_t i=0; i<N; i++) {
+            get<position>(particles)[i] = double_d(U(generator),U(generator));
+            get<source>(particles)[i] = U(generator);
+        }
+        particles.init_neighbour_search(double_d(0),double_d(1),Vector<bool,D>(false),10);
+
+        auto kernel = [](const double_d &dx, const double_d &pa, const double_d &pb) {
+            return std::sqrt(dx.squaredNorm() + 0.01)*(1.0 + pa[0]*pb[0]); 
+        };
+
+        for (size_t i=0; i<N; i++) {
+            const double_d& pi = get<position>(particles)[i];
+            double sum = 0;
+            for (size_t j=0; j<N; j++) {
+                const double_d& pj = get<position>(particles)[j];
+                sum += kernel(pj-pi,pi,pj)*get<source>(particles)[j];
+            }
+            get<target_manual>(particles)[i] = sum;
+        }
+
+        auto fmm_cached = make_fmm(particles,make_black_box_expansion<D,5>(kernel));
+        auto fmm_direct = make_fmm(particles,make_black_box_expansion<D,5>(kernel),false);
+        std::vector<double> target_cached(N,0.0), target_direct(N,0.0);
+        fmm_cached.matrix_vector_multiply(particles,target_cached,get<source>(particles));
+        fmm_direct.matrix_vector_multiply(particles,target_direct,get<source>(particles));
+        double L2_cached = 0;
+        double L2_direct = 0;
+        double scale = 0;
+        for (size_t i=0; i<N; i++) {
+            const double manual = get<target_manual>(particles)[i];
+            L2_cached += std::pow(target_cached[i]-manual,2);
+            L2_direct += std::pow(target_direct[i]-manual,2);
+            scale += std::pow(manual,2);
+        }
+        std::cout << "m2l cache: L2 error (cached) = "<<std::sqrt(L2_cached/scale)
+                  << " L2 error (direct) = "<<std::sqrt(L2_direct/scale)<<std::endl;
+        TS_ASSERT_LESS_THAN(std::sqrt(L2_direct/scale),1e-4);
+        TS_ASSERT_LESS_THAN(std::sqrt(L2_cached/scale),1e-4);
+    }
+
+    void test_task_depth(void) {
+        // the result must not depend on the number of threads, or on the 
+        // depth of the tree below which subtrees are swept serially
+        const unsigned int D = 2;
+        typedef Vector<double,D> double_d;
+        typedef Particles<std::tuple<source,target_manual,target_fmm>,D,std::vector,octtree> ParticlesType;
+        typedef typename ParticlesType::position position;
+        const size_t N = 5000;
+        ParticlesType particles(N);
+        std::uniform_real_distribution<double> U(0,1);
+        generator_type generator;
+        for (size_t i=0; i<N; i++) {
+            get<position>(particles)[i] = double_d(U(generator),U(generator));
+            get<source>(particles)[i] = U(generator);
+        }
+        particles.init_neighbour_search(double_d(0),double_d(1),Vector<bool,D>(false),10);
+
+        auto kernel = [](const double_d &dx, const double_d &pa, const double_d &pb) {
+            return std::sqrt(dx.squaredNorm() + 0.01); 
+        };
+
+#ifdef HAVE_OPENMP
+        const int nthreads = omp_get_max_threads();
+        omp_set_num_threads(std::max(nthreads,4));
+#endif
+        auto fmm = make_fmm(particles,make_black_box_expansion<D,3>(kernel));
+        std::vector<double> target_default(N,0.0), target_serial(N,0.0), target_tasks(N,0.0);
+        fmm.matrix_vector_multiply(particles,target_default,get<source>(particles));
+        fmm.set_task_depth(0);
+        fmm.matrix_vector_multiply(particles,target_serial,get<source>(particles));
+        fmm.set_task_depth(std::numeric_limits<size_t>::max());
+        fmm.matrix_vector_multiply(particles,target_tasks,get<source>(particles));
+        for (size_t i=0; i<N; i++) {
+            TS_ASSERT_EQUALS(target_serial[i],target_default[i]);
+            TS_ASSERT_EQUALS(target_tasks[i],target_default[i]);
+        }
+
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(1);
+        std::vector<double> target_one_thread(N,0.0);
+        fmm.matrix_vector_multiply(particles,target_one_thread,get<source>(particles));
+        omp_set_num_threads(nthreads);
+        for (size_t i=0; i<N; i++) {
+            TS_ASSERT_EQUALS(target_one_thread[i],target_default[i]);
+        }
+#endif
+    }
+
     void test_fast_methods_bucket_search_serial(void) {
         const size_t N = 5000;
 #ifdef HAVE_GPERFTOOLS
@@ -61,6 +61,40 @@ class H2Test: public CxxTest::TestSuite {
 
 public:
 #ifdef HAVE_EIGEN
+    template <typename ParticlesType, typename KernelFunction>
+    void helper_hmatrix_calculate(ParticlesType& particles, const KernelFunction& kernel, const double scale,
+                                  const double tol=1e-4) {
+        const unsigned int dimension = ParticlesType::dimension;
+
+        // perform the operation using an aca compressed hierarchical matrix
+        auto t0 = Clock::now();
+        auto h_eigen = create_hmatrix_operator(particles,particles,kernel,1e-6);
+        auto t1 = Clock::now();
+        std::chrono::duration<double> time_setup = t1 - t0;
+
+        typedef Eigen::Map<Eigen::Matrix<double,Eigen::Dynamic,1>> map_type; 
+        map_type target_eigen(get<target_h2>(particles).data(),particles.size());
+        map_type source_eigen(get<source>(particles).data(),particles.size());
+
+        t0 = Clock::now();
+        target_eigen = h_eigen*source_eigen; 
+        t1 = Clock::now();
+        std::chrono::duration<double> time_eval = t1 - t0;
+
+        const double L2 = std::inner_product(
+                std::begin(get<target_h2>(particles)), std::end(get<target_h2>(particles)),
+                std::begin(get<target_manual>(particles)), 
+                0.0,
+                [](const double t1, const double t2) { return t1 + t2; },
+                [](const double t1, const double t2) { return (t1-t2)*(t1-t2); }
+                );
+
+        std::cout << "for aca hierarchical matrix operator:" <<std::endl;
+        std::cout << "dimension = "<<dimension<<". L2 error = "<<L2<<". L2 relative error is "<<std::sqrt(L2/scale)<<". time_setup = "<<time_setup.count()<<". time_eval = "<<time_eval.count()<<std::endl;
+
+        TS_ASSERT_LESS_THAN(std::sqrt(L2/scale),tol);
+    }
+
     template <unsigned int N, typename ParticlesType, typename KernelFunction>
     void helper_fast_methods_calculate(ParticlesType& particles, const KernelFunction& kernel, const double scale) {
         typedef typename ParticlesType::position position;
@@ -94,6 +128,37 @@ public:
             TS_ASSERT_LESS_THAN(L2_h2/scale,1e-2);
         }
 
+        // the estimate from the tree should match the matrix
+        auto stats = h2_matrix.get_statistics();
+        auto estimate = estimate_h2_statistics<N>(particles);
+        std::cout << "h2 matrix statistics: " << stats;
+        TS_ASSERT_EQUALS(stats.p2p_bytes,estimate.p2p_bytes);
+        TS_ASSERT_EQUALS(stats.m2l_bytes,estimate.m2l_bytes);
+        TS_ASSERT_EQUALS(stats.l2l_bytes,estimate.l2l_bytes);
+        TS_ASSERT_EQUALS(stats.p2m_bytes,estimate.p2m_bytes);
+        TS_ASSERT_EQUALS(stats.l2p_bytes,estimate.l2p_bytes);
+        TS_ASSERT_EQUALS(stats.dense_bytes,estimate.dense_bytes);
+        TS_ASSERT(stats.weak_interactions == estimate.weak_interactions);
+        TS_ASSERT(stats.strong_interactions == estimate.strong_interactions);
+
+        // without the M2L cache there is one operator per well separated 
+        // pair, which bounds the M2L memory for any kernel
+        if (N == 3) {
+            auto h2_uncached = make_h2_matrix(particles,particles,
+                    make_black_box_expansion<dimension,N>(kernel),false);
+            auto estimate_uncached = estimate_h2_statistics<N>(particles,false);
+            TS_ASSERT_EQUALS(h2_uncached.get_statistics().m2l_bytes,
+                             estimate_uncached.m2l_bytes);
+            TS_ASSERT_LESS_THAN_EQUALS(stats.m2l_bytes,estimate_uncached.m2l_bytes);
+        }
+
+        // the parallel sweeps are deterministic, so repeating the 
+        // multiply must give bitwise identical results
+        std::vector<double> target_repeat(particles.size(),0.0);
+        h2_matrix.matrix_vector_multiply(target_repeat,get<source>(particles));
+        TS_ASSERT(std::equal(target_repeat.begin(),target_repeat.end(),
+                             std::begin(get<target_h2>(particles))));
+
         t0 = Clock::now();
         auto h2_eigen = create_h2_operator<N>(particles,particles,
                                     kernel);
@@ -124,6 +189,67 @@ public:
             TS_ASSERT_LESS_THAN(L2_h2/scale,1e-2);
         }
 
+        // block of right hand sides, each column is a scaled copy of the 
+        // source vector plus a different linear function of position
+        const size_t nrhs = 4;
+        typedef Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic> matrix_type; 
+        matrix_type source_block(particles.size(),nrhs);
+        for (int i = 0; i < particles.size(); ++i) {
+            for (int j = 0; j < nrhs; ++j) {
+                source_block(i,j) = (j+1)*get<source>(particles)[i] 
+                                    + j*get<position>(particles)[i][0];
+            }
+        }
+
+        t0 = Clock::now();
+        matrix_type target_block = matrix_type::Zero(particles.size(),nrhs);
+        h2_matrix.matrix_matrix_multiply(target_block,source_block);
+        t1 = Clock::now();
+        time_h2_eval = t1 - t0;
+
+        t0 = Clock::now();
+        matrix_type target_columns = matrix_type::Zero(particles.size(),nrhs);
+        for (int j = 0; j < nrhs; ++j) {
+            auto target_col = target_columns.col(j);
+            h2_matrix.matrix_vector_multiply(target_col,source_block.col(j));
+        }
+        t1 = Clock::now();
+        std::chrono::duration<double> time_h2_columns = t1 - t0;
+
+        std::cout << "for h2 matrix block multiply:" <<std::endl;
+        std::cout << "dimension = "<<dimension<<". N = "<<N<<". nrhs = "<<nrhs<<". time_h2_block = "<<time_h2_eval.count()<<". time_h2_columns = "<<time_h2_columns.count()<<std::endl;
+
+        TS_ASSERT_LESS_THAN((target_block-target_columns).norm(),
+                            1e-10*target_columns.norm());
+
+        matrix_type target_operator = h2_eigen*source_block;
+        TS_ASSERT_LESS_THAN((target_operator-target_columns).norm(),
+                            1e-10*target_columns.norm());
+
+        // storing the leaf matrices in single precision halves their memory,
+        // and changes the result by about the single precision rounding error
+        auto h2_single = make_h2_matrix(particles,particles,
+                make_black_box_expansion<dimension,N>(kernel),true,true);
+        matrix_type target_single_columns = matrix_type::Zero(particles.size(),nrhs);
+        for (int j = 0; j < nrhs; ++j) {
+            auto target_col = target_single_columns.col(j);
+            h2_single.matrix_vector_multiply(target_col,source_block.col(j));
+        }
+        matrix_type target_single_block = matrix_type::Zero(particles.size(),nrhs);
+        h2_single.matrix_matrix_multiply(target_single_block,source_block);
+        std::cout << "single precision h2 matrix relative difference = "
+                  << (target_single_columns-target_columns).norm()/target_columns.norm()
+                  << std::endl;
+        TS_ASSERT_LESS_THAN((target_single_columns-target_columns).norm(),
+                            1e-5*target_columns.norm());
+        TS_ASSERT_LESS_THAN((target_single_block-target_single_columns).norm(),
+                            1e-5*target_columns.norm());
+        auto stats_double = h2_matrix.get_statistics();
+        auto stats_single = h2_single.get_statistics();
+        TS_ASSERT_LESS_THAN(stats_single.p2p_bytes,stats_double.p2p_bytes);
+        TS_ASSERT_EQUALS(2*stats_single.p2m_bytes,stats_double.p2m_bytes);
+        TS_ASSERT_EQUALS(2*stats_single.l2p_bytes,stats_double.l2p_bytes);
+
     }
 
     template<unsigned int D, template <typename,typename> class StorageVector,template <typename> class SearchMethod>
@@ -200,6 +326,7 @@ public:
         helper_fast_methods_calculate<1>(particles,kernel,scale);
         helper_fast_methods_calculate<2>(particles,kernel,scale);
         helper_fast_methods_calculate<3>(particles,kernel,scale);
+        helper_hmatrix_calculate(particles,kernel,scale);
     }
 
     template <typename Expansions>
@@ -351,8 +478,137 @@ public:
         }
         TS_ASSERT_LESS_THAN(std::sqrt(L2/scale),1e-4);
     }
+
+    template <typename KernelFunction>
+    void helper_hmatrix_kernel(const KernelFunction& kernel, const double tol) {
+        const unsigned int D = 2;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+        typedef Particles<std::tuple<source,target_manual,target_h2>,D,std::vector,octtree> ParticlesType;
+        typedef typename ParticlesType::position position;
+        const size_t N = 2000;
+        ParticlesType particles(N);
+        std::uniform_real_distribution<double> U(0,1);
+        generator_type generator;
+        for (size_t i=0; i<N; i++) {
+            get<position>(particles)[i] = double_d(U(generator),U(generator));
+            get<source>(particles)[i] = U(generator);
+        }
+        particles.init_neighbour_search(double_d(0),double_d(1),bool_d(false),20);
+
+        double scale = 0;
+        for (size_t i=0; i<N; i++) {
+            const double_d& pi = get<position>(particles)[i];
+            double sum = 0;
+            for (size_t j=0; j<N; j++) {
+                const double_d& pj = get<position>(particles)[j];
+                sum += kernel(pi-pj,pi,pj)*get<source>(particles)[j];
+            }
+            get<target_manual>(particles)[i] = sum;
+            scale += std::pow(sum,2);
+        }
+        helper_hmatrix_calculate(particles,kernel,scale,tol);
+    }
 #endif
-        
+
+    void test_hmatrix_compact_support() {
+#ifdef HAVE_EIGEN
+        // only a few particles near the corners of each well separated block
+        // interact, so many rows of the block are zero. The partial ACA must 
+        // keep trying rows after finding a zero residual row, otherwise it 
+        // misses these interactions
+        const unsigned int D = 2;
+        typedef Vector<double,D> double_d;
+        for (const double h: {0.1,0.12,0.15}) {
+            auto wendland = [h](const double_d &dx, const double_d &pa, const double_d &pb) {
+                const double r = dx.norm()/h;
+                return r < 1 ? std::pow(1-r,4)*(4*r+1) : 0.0; 
+            };
+            helper_hmatrix_kernel(wendland,1e-9);
+
+            // compactly supported and sign-changing 
+            auto sign_changing = [h](const double_d &dx, const double_d &pa, const double_d &pb) {
+                const double r = dx.norm()/h;
+                return r < 1 ? (1-2*r)*std::pow(1-r,4)*(4*r+1) : 0.0; 
+            };
+            helper_hmatrix_kernel(sign_changing,1e-9);
+        }
+#endif
+    }
+
+    void test_task_depth(void) {
+#ifdef HAVE_EIGEN
+        // the result must not depend on the depth of the tree below which
+        // subtrees are swept serially
+        const unsigned int D = 2;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+        typedef Particles<std::tuple<source,target_manual,target_h2>,D,std::vector,octtree> ParticlesType;
+        typedef typename ParticlesType::position position;
+        const size_t N = 5000;
+        ParticlesType particles(N);
+        std::uniform_real_distribution<double> U(0,1);
+        generator_type generator;
+        for (size_t i=0; i<N; i++) {
+            get<position>(particles)[i] = double_d(U(generator),U(generator));
+            get<source>(particles)[i] = U(generator);
+        }
+        particles.init_neighbour_search(double_d(0),double_d(1),bool_d(false),10);
+
+        auto kernel = [](const double_d &dx, const double_d &pa, const double_d &pb) {
+            return std::sqrt(dx.squaredNorm() + 0.01); 
+        };
+
+#ifdef HAVE_OPENMP
+        const int nthreads = omp_get_max_threads();
+        omp_set_num_threads(std::max(nthreads,4));
+#endif
+        typedef Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic> matrix_type;
+        const int nrhs = 2;
+        matrix_type source_block = matrix_type::Random(N,nrhs);
+        auto h2_matrix = make_h2_matrix(particles,particles,
+                                        make_black_box_expansion<D,3>(kernel));
+        std::vector<matrix_type> target_vector(3,matrix_type::Zero(N,1));
+        std::vector<matrix_type> target_block(3,matrix_type::Zero(N,nrhs));
+        const size_t depths[] = {0,std::numeric_limits<size_t>::max()};
+        for (int i = 0; i < 3; ++i) {
+            if (i > 0) h2_matrix.set_task_depth(depths[i-1]);
+            auto target_col = target_vector[i].col(0);
+            h2_matrix.matrix_vector_multiply(target_col,source_block.col(0));
+            h2_matrix.matrix_matrix_multiply(target_block[i],source_block);
+        }
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(nthreads);
+#endif
+        TS_ASSERT_LESS_THAN(0,target_vector[0].norm());
+        TS_ASSERT((target_block[0].col(0)-target_vector[0]).norm() 
+                    < 1e-10*target_vector[0].norm());
+        for (int i = 1; i < 3; ++i) {
+            TS_ASSERT(target_vector[i] == target_vector[0]);
+            TS_ASSERT(target_block[i] == target_block[0]);
+        }
+
+        // the same for the aca compressed hierarchical matrix
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(std::max(nthreads,4));
+#endif
+        auto h_matrix = make_h_matrix(particles,particles,kernel);
+        std::vector<matrix_type> target_h(3,matrix_type::Zero(N,1));
+        for (int i = 0; i < 3; ++i) {
+            if (i > 0) h_matrix.set_task_depth(depths[i-1]);
+            auto target_col = target_h[i].col(0);
+            h_matrix.matrix_vector_multiply(target_col,source_block.col(0));
+        }
+#ifdef HAVE_OPENMP
+        omp_set_num_threads(nthreads);
+#endif
+        TS_ASSERT_LESS_THAN(0,target_h[0].norm());
+        for (int i = 1; i < 3; ++i) {
+            TS_ASSERT(target_h[i] == target_h[0]);
+        }
+#endif
+    }
+
     void test_fmm_matrix_operators() {
 #ifdef HAVE_EIGEN
         const unsigned int D = 2;
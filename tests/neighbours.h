@@ -664,7 +664,7 @@ You can create a particle set using a hyper oct-tree by setting the [classref Ab
     template<unsigned int D, 
              template <typename,typename> class VectorType,
              template <typename> class SearchMethod>
-    void helper_d_random(const int N, const double r, const int neighbour_n, const bool is_periodic, const bool push_back_construction) {
+    void helper_d_random(const int N, const double r, const int neighbour_n, const bool is_periodic, const bool push_back_construction, const bool morton_order=false) {
     	typedef Particles<std::tuple<neighbours_brute,neighbours_aboria>,D,VectorType,SearchMethod> particles_type;
         typedef position_d<D> position;
         typedef Vector<double,D> double_d;
@@ -677,7 +677,7 @@ You can create a particle set using a hyper oct-tree by setting the [classref Ab
         particles_type particles;
         double r2 = r*r;
 
-        std::cout << "random test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" r="<<r<<" push_back_construction = "<<push_back_construction<<"):" << std::endl;
+        std::cout << "random test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" r="<<r<<" push_back_construction = "<<push_back_construction<<" morton_order = "<<morton_order<<"):" << std::endl;
 
         unsigned seed1 = std::chrono::system_clock::now().time_since_epoch().count();
         std::cout << "seed is "<< seed1 << std::endl;
@@ -686,7 +686,7 @@ You can create a particle set using a hyper oct-tree by setting the [classref Ab
         detail::uniform_real_distribution<float> uniform(-1.0, 1.0);
 
         if (push_back_construction) {
-    	    particles.init_neighbour_search(min,max,periodic,neighbour_n);
+    	    particles.init_neighbour_search(min,max,periodic,neighbour_n,morton_order);
             typename particles_type::value_type p;
             for (int i=0; i<N; ++i) {
                 for (int d = 0; d < D; ++d) {
@@ -700,7 +700,7 @@ You can create a particle set using a hyper oct-tree by setting the [classref Ab
                 set_random_position
                     <D,typename particles_type::raw_reference>(-1.0,1.0));
             
-    	    particles.init_neighbour_search(min,max,periodic,neighbour_n);
+    	    particles.init_neighbour_search(min,max,periodic,neighbour_n,morton_order);
         }
 
         // delete random particle
@@ -959,6 +959,272 @@ You can create a particle set using a hyper oct-tree by setting the [classref Ab
         helper_d_test_list_regular<std::vector,bucket_search_parallel>();
     }
 
+    template<template <typename,typename> class VectorType,
+             template <typename> class SearchMethod>
+    void helper_d_test_list_random_morton() {
+        helper_d_random<1,VectorType,SearchMethod>(1000,0.1,10,true,false,true);
+        helper_d_random<1,VectorType,SearchMethod>(1000,0.1,10,false,false,true);
+        helper_d_random<2,VectorType,SearchMethod>(1000,0.1,10,true,false,true);
+        helper_d_random<2,VectorType,SearchMethod>(1000,0.1,10,false,false,true);
+        helper_d_random<2,VectorType,SearchMethod>(1000,0.2,1,true,false,true);
+        helper_d_random<3,VectorType,SearchMethod>(1000,0.2,10,true,false,true);
+        helper_d_random<3,VectorType,SearchMethod>(1000,0.2,10,false,false,true);
+        helper_d_random<3,VectorType,SearchMethod>(1000,0.2,1,false,false,true);
+        helper_d_random<4,VectorType,SearchMethod>(1000,0.2,10,true,false,true);
+        helper_d_random<2,VectorType,SearchMethod>(1000,0.1,10,false,true,true);
+        helper_d_random<3,VectorType,SearchMethod>(1000,0.2,10,true,true,true);
+    }
+
+    template<template <typename> class SearchMethod>
+    void helper_verlet_list(void) {
+    	typedef Particles<std::tuple<scalar>,2,std::vector,SearchMethod> particles_type;
+        typedef position_d<2> position;
+        typedef typename particles_type::const_reference const_reference;
+        const double radius = 0.1;
+        const double skin = 0.05;
+        const size_t N = 1000;
+
+        particles_type particles(N);
+        generator_type gen(0); 
+        detail::uniform_real_distribution<double> uniform(0.0, 1.0);
+        for (size_t i = 0; i < N; ++i) {
+            get<position>(particles)[i] = vdouble2(uniform(gen),uniform(gen));
+        }
+        particles.init_neighbour_search(vdouble2(0),vdouble2(1),vbool2(true));
+
+        VerletList<particles_type> verlet_list(particles,particles,radius,skin);
+        TS_ASSERT_EQUALS(verlet_list.number_of_rebuilds(),1);
+        TS_ASSERT_EQUALS(verlet_list.size(),N);
+
+        // the list should contain every pair within radius (checked by brute force) 
+        auto check_list = [&]() {
+            for (size_t i = 0; i < N; ++i) {
+                int count_list = 0;
+                for (const size_t j: verlet_list.get_neighbours(i)) {
+                    const vdouble2 dx = particles.correct_dx_for_periodicity(
+                            get<position>(particles)[j]-get<position>(particles)[i]);
+                    if (dx.norm() <= radius) ++count_list;
+                }
+                int count_brute = 0;
+                for (size_t j = 0; j < N; ++j) {
+                    const vdouble2 dx = particles.correct_dx_for_periodicity(
+                            get<position>(particles)[j]-get<position>(particles)[i]);
+                    if (dx.norm() <= radius) ++count_brute;
+                }
+                TS_ASSERT_EQUALS(count_list,count_brute);
+            }
+        };
+        check_list();
+
+        // move all particles by less than skin/2, list should be unchanged but
+        // still valid
+        for (size_t i = 0; i < N; ++i) {
+            get<position>(particles)[i] += vdouble2(0.2*skin,0.3*skin);
+        }
+        particles.update_positions();
+        TS_ASSERT(!verlet_list.update());
+        TS_ASSERT_EQUALS(verlet_list.number_of_rebuilds(),1);
+        check_list();
+
+        // move one particle more than skin/2, list should be rebuilt
+        get<position>(particles)[N/2] += vdouble2(0.6*skin,0);
+        particles.update_positions();
+        TS_ASSERT(verlet_list.update());
+        check_list();
+
+        // symbolic sums should give the same result with and without the list
+        Symbol<scalar> s;
+        Label<0,particles_type> a(particles);
+        Label<1,particles_type> b(particles);
+        auto dx = create_dx(a,b);
+        AccumulateWithinDistance<std::plus<double> > sum(radius);
+        s[a] = sum(b,norm(dx));
+        std::vector<double> s_search(get<scalar>(particles).begin(),
+                                     get<scalar>(particles).end());
+        sum.set_verlet_list(verlet_list);
+        s[a] = sum(b,norm(dx));
+        for (size_t i = 0; i < N; ++i) {
+            TS_ASSERT_DELTA(get<scalar>(particles)[i],s_search[i],1e-10);
+        }
+
+#ifdef HAVE_EIGEN
+        // as should KernelSparse 
+        auto kernel = [](const vdouble2& dx, const_reference a, const_reference b) {
+            return dx.norm();
+        };
+        auto A = create_sparse_operator(particles,particles,radius,kernel);
+        auto A_verlet = create_sparse_operator(particles,particles,verlet_list,radius,kernel);
+        Eigen::VectorXd x = Eigen::VectorXd::Ones(N);
+        Eigen::VectorXd y = A*x;
+        Eigen::VectorXd y_verlet = A_verlet*x;
+        for (size_t i = 0; i < N; ++i) {
+            TS_ASSERT_DELTA(y[i],y_verlet[i],1e-10);
+            TS_ASSERT_DELTA(y[i],s_search[i],1e-10);
+        }
+#endif
+    }
+
+    void test_verlet_list(void) {
+        helper_verlet_list<bucket_search_serial>();
+        helper_verlet_list<bucket_search_parallel>();
+        helper_verlet_list<octtree>();
+    }
+
+    template<unsigned int D, template <typename> class SearchMethod>
+    void helper_for_each_pair(const int N, const double r, const bool is_periodic) {
+    	typedef Particles<std::tuple<neighbours_brute,neighbours_aboria>,D,std::vector,SearchMethod> particles_type;
+        typedef typename particles_type::reference reference;
+        typedef position_d<D> position;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+    	double_d min(-1);
+    	double_d max(1);
+        const double required_bucket_number = N*std::pow(r,D)/std::pow(2.0,D);
+
+        std::cout << "for_each_pair test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" r="<<r<<"):" << std::endl;
+
+        particles_type particles(N);
+        generator_type gen(0); 
+        detail::uniform_real_distribution<double> uniform(-1.0, 1.0);
+        for (int i = 0; i < N; ++i) {
+            for (int d = 0; d < D; ++d) {
+                get<position>(particles)[i][d] = uniform(gen);
+            }
+            get<neighbours_aboria>(particles)[i] = 0;
+        }
+        particles.init_neighbour_search(min,max,bool_d(is_periodic),required_bucket_number);
+
+        Aboria::detail::for_each(particles.begin(),particles.end(),
+                brute_force_check<particles_type>(particles,min,max,r*r,is_periodic));
+
+        for_each_pair(particles.get_query(),r,
+                [&](const double_d& dx, reference a, reference b) {
+                    get<neighbours_aboria>(a)++;
+                    get<neighbours_aboria>(b)++;
+                });
+
+        for (int i = 0; i < N; ++i) {
+            // brute force count includes the particle itself
+            TS_ASSERT_EQUALS(int(get<neighbours_brute>(particles)[i]),
+                             int(get<neighbours_aboria>(particles)[i])+1);
+        }
+    }
+
+    template<template <typename> class SearchMethod>
+    void helper_for_each_pair_all(void) {
+        helper_for_each_pair<1,SearchMethod>(1000,0.1,true);
+        helper_for_each_pair<1,SearchMethod>(1000,0.1,false);
+        helper_for_each_pair<2,SearchMethod>(1000,0.2,true);
+        helper_for_each_pair<2,SearchMethod>(1000,0.2,false);
+        helper_for_each_pair<3,SearchMethod>(1000,0.2,true);
+        helper_for_each_pair<3,SearchMethod>(1000,0.2,false);
+        helper_for_each_pair<3,SearchMethod>(1000,0.7,true);
+    }
+
+    void test_for_each_pair(void) {
+        helper_for_each_pair_all<bucket_search_serial>();
+        helper_for_each_pair_all<bucket_search_parallel>();
+        helper_for_each_pair_all<nanoflann_adaptor>();
+        helper_for_each_pair_all<octtree>();
+    }
+
+    template<unsigned int D, template <typename> class SearchMethod>
+    void helper_knn_search(const int N, const size_t k, const bool is_periodic,
+                           const double aspect=1.0, const double point_scale=1.0) {
+    	typedef Particles<std::tuple<>,D,std::vector,SearchMethod> particles_type;
+        typedef position_d<D> position;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+        typedef Vector<int,D> int_d;
+        // the domain is stretched by aspect in the first dimension, and the 
+        // query points are scaled by point_scale (so can lie outside the 
+        // domain) 
+    	double_d min(-1);
+    	double_d max(1);
+        min[0] *= aspect;
+        max[0] *= aspect;
+
+        std::cout << "knn search test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" k="<<k<<" aspect="<<aspect<<" point_scale="<<point_scale<<"):" << std::endl;
+
+        particles_type particles(N);
+        generator_type gen(0); 
+        detail::uniform_real_distribution<double> uniform(-1.0, 1.0);
+        for (int i = 0; i < N; ++i) {
+            for (int d = 0; d < D; ++d) {
+                get<position>(particles)[i][d] = uniform(gen)*(d==0?aspect:1.0);
+            }
+        }
+        particles.init_neighbour_search(min,max,bool_d(is_periodic),10);
+
+        std::vector<double_d> points(100);
+        for (size_t i = 0; i < points.size(); ++i) {
+            for (int d = 0; d < D; ++d) {
+                points[i][d] = uniform(gen)*(d==0?aspect:1.0)*point_scale;
+            }
+        }
+
+        std::vector<size_t> indices;
+        std::vector<double> distances;
+        knn_search(particles.get_query(),points,k,indices,distances);
+        TS_ASSERT_EQUALS(indices.size(),k*points.size());
+        TS_ASSERT_EQUALS(distances.size(),k*points.size());
+
+        for (size_t i = 0; i < points.size(); ++i) {
+            // brute force distances 
+            std::vector<double> brute(N);
+            for (int j = 0; j < N; ++j) {
+                brute[j] = std::numeric_limits<double>::max();
+                for (lattice_iterator<D> periodic_it(int_d(is_periodic?-1:0),int_d(is_periodic?2:1)); 
+                        periodic_it != false; ++periodic_it) {
+                    const double_d dx = get<position>(particles)[j]
+                                        +(*periodic_it)*(max-min)-points[i];
+                    brute[j] = std::min(brute[j],dx.norm());
+                }
+            }
+            std::vector<double> sorted_brute(brute);
+            std::sort(sorted_brute.begin(),sorted_brute.end());
+            for (size_t j = 0; j < k; ++j) {
+                TS_ASSERT_DELTA(distances[i*k+j],sorted_brute[j],1e-10);
+                TS_ASSERT_DELTA(brute[indices[i*k+j]],distances[i*k+j],1e-10);
+            }
+        }
+    }
+
+    template<template <typename> class SearchMethod>
+    void helper_knn_search_all(void) {
+        helper_knn_search<1,SearchMethod>(1000,5,false);
+        helper_knn_search<2,SearchMethod>(1000,10,true);
+        helper_knn_search<2,SearchMethod>(1000,10,false);
+        helper_knn_search<3,SearchMethod>(1000,20,true);
+        helper_knn_search<3,SearchMethod>(1000,20,false);
+        helper_knn_search<2,SearchMethod>(50,50,true);
+        // anisotropic periodic domain with k/N between 0.25 and 0.5, so the 
+        // search radius is larger than half the narrow width but smaller 
+        // than half the diagonal
+        helper_knn_search<2,SearchMethod>(200,70,true,4.0);
+        helper_knn_search<3,SearchMethod>(200,60,true,4.0);
+        // query points outside a non-periodic domain
+        helper_knn_search<2,SearchMethod>(1000,10,false,1.0,3.0);
+        helper_knn_search<3,SearchMethod>(1000,20,false,2.0,3.0);
+    }
+
+    void test_knn_search(void) {
+        helper_knn_search_all<bucket_search_serial>();
+        helper_knn_search_all<bucket_search_parallel>();
+        helper_knn_search_all<octtree>();
+#if not defined(__CUDACC__)
+        helper_knn_search_all<nanoflann_adaptor>();
+#endif
+    }
+
+    void test_std_vector_bucket_search_serial_morton(void) {
+        helper_d_test_list_random_morton<std::vector,bucket_search_serial>();
+    }
+
+    void test_std_vector_bucket_search_parallel_morton(void) {
+        helper_d_test_list_random_morton<std::vector,bucket_search_parallel>();
+    }
+
     void test_std_vector_bucket_search_serial_fast_bucketsearch(void) {
         helper_d_test_list_random_fast_bucketsearch<std::vector,bucket_search_serial>();
         helper_single_particle<std::vector,bucket_search_serial>();
@@ -978,12 +1244,66 @@ You can create a particle set using a hyper oct-tree by setting the [classref Ab
 #if not defined(__CUDACC__)
         helper_d_test_list_random<std::vector,nanoflann_adaptor>();
         helper_d_test_list_regular<std::vector,nanoflann_adaptor>();
+        helper_tree_update<2,nanoflann_adaptor>(1000,0.1,false,0.001);
+        helper_tree_update<2,nanoflann_adaptor>(1000,0.1,true,0.01);
+        helper_tree_update<3,nanoflann_adaptor>(1000,0.2,true,0.001);
+        helper_tree_update<3,nanoflann_adaptor>(1000,0.2,false,0.1);
 #endif
     }
 
+    template<unsigned int D, template <typename> class SearchMethod>
+    void helper_tree_update(const int N, const double r, const bool is_periodic, const double max_step) {
+    	typedef Particles<std::tuple<neighbours_brute,neighbours_aboria>,D,std::vector,SearchMethod> particles_type;
+        typedef position_d<D> position;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+    	double_d min(-1);
+    	double_d max(1);
+
+        std::cout << "tree update test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" r="<<r<<" max_step="<<max_step<<"):" << std::endl;
+
+        particles_type particles(N);
+        generator_type gen(0); 
+        detail::uniform_real_distribution<double> uniform(-1.0, 1.0);
+        for (int i = 0; i < N; ++i) {
+            for (int d = 0; d < D; ++d) {
+                get<position>(particles)[i][d] = uniform(gen);
+            }
+        }
+        particles.init_neighbour_search(min,max,bool_d(is_periodic),10);
+
+        for (int step = 0; step < 5; ++step) {
+            // small random steps, plus one particle jumping across the domain
+            for (int i = 0; i < N; ++i) {
+                for (int d = 0; d < D; ++d) {
+                    get<position>(particles)[i][d] += max_step*uniform(gen);
+                    if (!is_periodic) {
+                        get<position>(particles)[i][d] = std::min(0.999,std::max(-0.999,
+                                    get<position>(particles)[i][d]));
+                    }
+                }
+            }
+            get<position>(particles)[step] = -get<position>(particles)[step];
+            particles.update_positions();
+
+            Aboria::detail::for_each(particles.begin(),particles.end(),
+                    brute_force_check<particles_type>(particles,min,max,r*r,is_periodic));
+            Aboria::detail::for_each(particles.begin(),particles.end(),
+                    aboria_check<particles_type>(particles,r));
+            for (int i = 0; i < N; ++i) {
+                TS_ASSERT_EQUALS(int(get<neighbours_brute>(particles)[i]),
+                                 int(get<neighbours_aboria>(particles)[i]));
+            }
+        }
+    }
+
     void test_std_vector_octtree(void) {
         helper_d_test_list_random<std::vector,octtree>();
         helper_d_test_list_regular<std::vector,octtree>();
+        helper_tree_update<2,octtree>(1000,0.1,false,0.001);
+        helper_tree_update<2,octtree>(1000,0.1,true,0.01);
+        helper_tree_update<3,octtree>(1000,0.2,true,0.001);
+        helper_tree_update<3,octtree>(1000,0.2,false,0.1);
     }
 
     //void test_thrust_vector_bucket_search_serial(void) {
@@ -44,6 +44,47 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 using namespace Aboria;
 
+#ifdef HAVE_EIGEN
+// a dense kernel that only provides the triplet assemble, so sparse 
+// assembly must fall back to setFromTriplets
+template<typename RowParticles, typename ColParticles, typename F>
+class KernelTripletsOnly: public KernelBase<RowParticles,ColParticles,F> {
+    typedef KernelBase<RowParticles,ColParticles,F> base_type;
+public:
+    typedef typename base_type::Scalar Scalar;
+
+    KernelTripletsOnly(const RowParticles& row_particles,
+                       const ColParticles& col_particles,
+                       const F& function): 
+        base_type(row_particles,col_particles,function) 
+    {};
+
+    // the diagonal is split into two repeated entries
+    template<typename Triplet>
+    void assemble(std::vector<Triplet>& triplets,
+                  const size_t startI=0, const size_t startJ=0) const {
+        for (size_t i=0; i<this->rows(); ++i) {
+            for (size_t j=0; j<this->cols(); ++j) {
+                if (i == j) {
+                    triplets.push_back(Triplet(i+startI,j+startJ,0.5*this->coeff(i,j)));
+                    triplets.push_back(Triplet(i+startI,j+startJ,0.5*this->coeff(i,j)));
+                } else {
+                    triplets.push_back(Triplet(i+startI,j+startJ,this->coeff(i,j)));
+                }
+            }
+        }
+    }
+
+    template<typename VectorLHS,typename VectorRHS>
+    void evaluate(VectorLHS &lhs, const VectorRHS &rhs) const {
+        for (size_t i=0; i<this->rows(); ++i) {
+            for (size_t j=0; j<this->cols(); ++j) {
+                lhs[i] += this->coeff(i,j)*rhs[j];
+            }
+        }
+    }
+};
+#endif // HAVE_EIGEN
 
 class OperatorsTest : public CxxTest::TestSuite {
 public:
@@ -926,6 +967,415 @@ the result in `m`.
 #endif // HAVE_EIGEN
     }
 
+    void test_sparse_cache(void) {
+#ifdef HAVE_EIGEN
+        ABORIA_VARIABLE(scalar,double,"scalar")
+
+    	typedef Particles<std::tuple<scalar>,2> ParticlesType;
+        typedef position_d<2> position;
+       	ParticlesType particles;
+
+        const size_t n = 500;
+        const double radius = 0.1;
+        std::default_random_engine gen;
+        std::uniform_real_distribution<double> uniform(0,1);
+        particles.resize(n);
+        for (size_t i=0; i<n; ++i) {
+            get<position>(particles)[i] = vdouble2(uniform(gen),uniform(gen));
+            get<scalar>(particles)[i] = uniform(gen);
+        }
+        particles.init_neighbour_search(vdouble2(0),vdouble2(1),vbool2(true));
+
+        auto kernel = [radius](const vdouble2 &dx,
+                         ParticlesType::const_reference a,
+                         ParticlesType::const_reference b) {
+                    return get<scalar>(a)*get<scalar>(b)*(radius-dx.norm());
+                    };
+
+        auto K = create_sparse_operator(particles,particles,radius,kernel);
+        auto K_pattern = create_sparse_operator(particles,particles,radius,kernel);
+        auto K_values = create_sparse_operator(particles,particles,radius,kernel);
+        K_pattern.get_first_kernel().set_cache();
+        K_values.get_first_kernel().set_cache(true,true);
+
+        Eigen::VectorXd v = Eigen::VectorXd::Random(n);
+        Eigen::VectorXd ans = K*v;
+        Eigen::VectorXd ans_pattern = K_pattern*v;
+        Eigen::VectorXd ans_values = K_values*v;
+        for (size_t i=0; i<n; ++i) {
+            TS_ASSERT_DELTA(ans_pattern[i],ans[i],1e-12);
+            TS_ASSERT_DELTA(ans_values[i],ans[i],1e-12);
+        }
+
+        // unchanged positions reuse the cache
+        v = Eigen::VectorXd::Random(n);
+        ans = K*v;
+        ans_pattern = K_pattern*v;
+        ans_values = K_values*v;
+        for (size_t i=0; i<n; ++i) {
+            TS_ASSERT_DELTA(ans_pattern[i],ans[i],1e-12);
+            TS_ASSERT_DELTA(ans_values[i],ans[i],1e-12);
+        }
+        TS_ASSERT_EQUALS(K_pattern.get_first_kernel().number_of_cache_builds(),1);
+        TS_ASSERT_EQUALS(K_values.get_first_kernel().number_of_cache_builds(),1);
+
+        // moving the particles rebuilds the cache
+        for (size_t i=0; i<n; ++i) {
+            get<position>(particles)[i] += 0.05*vdouble2(uniform(gen)-0.5,uniform(gen)-0.5);
+            for (int d=0; d<2; ++d) {
+                get<position>(particles)[i][d] -= std::floor(get<position>(particles)[i][d]);
+            }
+        }
+        particles.update_positions();
+        ans = K*v;
+        ans_pattern = K_pattern*v;
+        ans_values = K_values*v;
+        for (size_t i=0; i<n; ++i) {
+            TS_ASSERT_DELTA(ans_pattern[i],ans[i],1e-12);
+            TS_ASSERT_DELTA(ans_values[i],ans[i],1e-12);
+        }
+        TS_ASSERT_EQUALS(K_pattern.get_first_kernel().number_of_cache_builds(),2);
+        TS_ASSERT_EQUALS(K_values.get_first_kernel().number_of_cache_builds(),2);
+#endif // HAVE_EIGEN
+    }
+
+    void test_matrix_operator(void) {
+#ifdef HAVE_EIGEN
+        ABORIA_VARIABLE(scalar,double,"scalar")
+
+    	typedef Particles<std::tuple<scalar>,2> ParticlesType;
+        typedef position_d<2> position;
+       	ParticlesType particles;
+
+        // not a multiple of the tile size
+        const size_t n = 300;
+        std::default_random_engine gen;
+        std::uniform_real_distribution<double> uniform(0,1);
+        particles.resize(n);
+        for (size_t i=0; i<n; ++i) {
+            get<position>(particles)[i] = vdouble2(uniform(gen),uniform(gen));
+            get<scalar>(particles)[i] = uniform(gen);
+        }
+        particles.init_neighbour_search(vdouble2(0),vdouble2(1),vbool2(true,false));
+
+        auto kernel = [](const vdouble2 &dx,
+                         ParticlesType::const_reference a,
+                         ParticlesType::const_reference b) {
+                    return get<scalar>(a)*get<scalar>(b)*std::exp(-dx.squaredNorm());
+                    };
+
+        auto K = create_dense_operator(particles,particles,kernel);
+        auto K_matrix = create_matrix_operator(particles,particles,kernel);
+        auto K_symmetric = create_matrix_operator(particles,particles,kernel,true);
+        auto K_single = create_matrix_operator(particles,particles,kernel,true,true);
+
+        Eigen::MatrixXd M_matrix(n,n),M_symmetric(n,n);
+        K_matrix.assemble(M_matrix);
+        K_symmetric.assemble(M_symmetric);
+        for (size_t i=0; i<n; ++i) {
+            for (size_t j=0; j<n; ++j) {
+                TS_ASSERT_DELTA(M_symmetric(i,j),M_matrix(i,j),1e-14);
+            }
+        }
+
+        Eigen::VectorXd v = Eigen::VectorXd::Random(n);
+        Eigen::VectorXd ans = K*v;
+        Eigen::VectorXd ans_matrix = K_matrix*v;
+        Eigen::VectorXd ans_symmetric = K_symmetric*v;
+        Eigen::VectorXd ans_single = K_single*v;
+        for (size_t i=0; i<n; ++i) {
+            TS_ASSERT_DELTA(ans_matrix[i],ans[i],1e-10);
+            TS_ASSERT_DELTA(ans_symmetric[i],ans[i],1e-10);
+        }
+        TS_ASSERT_LESS_THAN((ans_single-ans).norm()/ans.norm(),1e-5);
+#endif // HAVE_EIGEN
+    }
+
+    void test_fused(void) {
+#ifdef HAVE_EIGEN
+        ABORIA_VARIABLE(scalar,double,"scalar")
+
+    	typedef Particles<std::tuple<scalar>,2> ParticlesType;
+        typedef position_d<2> position;
+       	ParticlesType particles;
+
+        const size_t n = 500;
+        const double radius = 0.1;
+        std::default_random_engine gen;
+        std::uniform_real_distribution<double> uniform(0,1);
+        particles.resize(n);
+        for (size_t i=0; i<n; ++i) {
+            get<position>(particles)[i] = vdouble2(uniform(gen),uniform(gen));
+            get<scalar>(particles)[i] = uniform(gen);
+        }
+        particles.init_neighbour_search(vdouble2(0),vdouble2(1),vbool2(true));
+
+        auto A11 = create_sparse_operator(particles,particles,radius,
+                [radius](const vdouble2 &dx,
+                         ParticlesType::const_reference a,
+                         ParticlesType::const_reference b) {
+                    return radius-dx.norm();
+                    });
+        auto A12 = create_sparse_operator(particles,particles,radius,
+                [](const vdouble2 &dx,
+                   ParticlesType::const_reference a,
+                   ParticlesType::const_reference b) {
+                    return dx[0]*dx[1]*get<scalar>(b);
+                    });
+        auto A22 = create_sparse_operator(particles,particles,radius,
+                [](const vdouble2 &dx,
+                   ParticlesType::const_reference a,
+                   ParticlesType::const_reference b) {
+                    return get<scalar>(a)*dx.squaredNorm();
+                    });
+        auto A22_small = create_sparse_operator(particles,particles,0.5*radius,
+                [](const vdouble2 &dx,
+                   ParticlesType::const_reference a,
+                   ParticlesType::const_reference b) {
+                    return get<scalar>(a)*dx.squaredNorm();
+                    });
+        auto D = create_dense_operator(particles,particles,
+                [](const vdouble2 &dx,
+                   ParticlesType::const_reference a,
+                   ParticlesType::const_reference b) {
+                    return get<scalar>(a)*dx.squaredNorm();
+                    });
+
+        Eigen::VectorXd v = Eigen::VectorXd::Random(2*n);
+
+        // same radius, a single search per row particle
+        auto A = create_block_operator<2,2>(A11,A12,
+                                            A12,A22);
+        Eigen::VectorXd ans = A*v;
+        A.set_fused();
+        TS_ASSERT(A.is_fused());
+        Eigen::VectorXd ans_fused = A*v;
+        for (size_t i=0; i<2*n; ++i) {
+            TS_ASSERT_EQUALS(ans_fused[i],ans[i]);
+        }
+
+        // different radius, a search per block
+        auto A_small = create_block_operator<2,2>(A11,A12,
+                                                  A12,A22_small);
+        ans = A_small*v;
+        A_small.set_fused();
+        TS_ASSERT(A_small.is_fused());
+        ans_fused = A_small*v;
+        for (size_t i=0; i<2*n; ++i) {
+            TS_ASSERT_EQUALS(ans_fused[i],ans[i]);
+        }
+
+        // a dense block cannot be fused
+        auto A_dense = create_block_operator<2,2>(A11,A12,
+                                                  A12,D);
+        ans = A_dense*v;
+        A_dense.set_fused();
+        TS_ASSERT(!A_dense.is_fused());
+        ans_fused = A_dense*v;
+        for (size_t i=0; i<2*n; ++i) {
+            TS_ASSERT_EQUALS(ans_fused[i],ans[i]);
+        }
+#endif // HAVE_EIGEN
+    }
+
+    void test_iterative_refinement(void) {
+#ifdef HAVE_EIGEN
+    	typedef Particles<std::tuple<>,2> ParticlesType;
+        typedef position_d<2> position;
+       	ParticlesType particles;
+
+        const size_t n = 500;
+        const double c2 = std::pow(1.0/0.05,2);
+        const double sigma = 0.1;
+        std::default_random_engine gen;
+        std::uniform_real_distribution<double> uniform(0,1);
+        particles.resize(n);
+        for (size_t i=0; i<n; ++i) {
+            get<position>(particles)[i] = vdouble2(uniform(gen),uniform(gen));
+        }
+        particles.init_neighbour_search(vdouble2(0),vdouble2(1),vbool2(false));
+
+        auto kernel = [c2,sigma](const vdouble2 &dx,
+                         ParticlesType::const_reference a,
+                         ParticlesType::const_reference b) {
+                    return std::exp(-dx.squaredNorm()*c2) 
+                        + (get<id>(a)==get<id>(b) ? sigma : 0.0);
+                    };
+
+        auto A = create_dense_operator(particles,particles,kernel);
+        auto A_single = create_matrix_operator(particles,particles,kernel,true,true);
+
+        typedef Eigen::GMRES<decltype(A_single),Eigen::IdentityPreconditioner> inner_type;
+        IterativeRefinement<decltype(A),inner_type> solver(A);
+        solver.set_tolerance(1e-12);
+        solver.inner_solver().setTolerance(1e-4);
+        solver.inner_solver().compute(A_single);
+
+        Eigen::VectorXd b = Eigen::VectorXd::Random(n);
+        Eigen::VectorXd x = solver.solve(b);
+        std::cout << "IterativeRefinement: #iterations: " << solver.iterations() 
+                  << ", error: " << solver.error() << std::endl;
+        TS_ASSERT_EQUALS(solver.info(),Eigen::Success);
+        TS_ASSERT_LESS_THAN(1,solver.iterations());
+        TS_ASSERT_LESS_THAN((A*x-b).norm()/b.norm(),1e-12);
+
+        // single precision inner solve of several right hand sides, the
+        // reported iterations and error are the maximum over the columns
+        Eigen::MatrixXd A_eigen(n,n);
+        A.assemble(A_eigen);
+        const Eigen::MatrixXf A_float = A_eigen.cast<float>();
+        typedef Eigen::PartialPivLU<Eigen::MatrixXf> float_inner_type;
+        IterativeRefinement<decltype(A),float_inner_type> float_solver(A);
+        float_solver.set_tolerance(1e-12);
+        float_solver.inner_solver().compute(A_float);
+
+        Eigen::MatrixXd B = Eigen::MatrixXd::Random(n,2);
+        B.col(1) *= 1e3;
+        Eigen::MatrixXd X = float_solver.solve(B);
+        std::cout << "IterativeRefinement (float): #iterations: " 
+                  << float_solver.iterations() 
+                  << ", error: " << float_solver.error() << std::endl;
+        TS_ASSERT_EQUALS(float_solver.info(),Eigen::Success);
+        TS_ASSERT_LESS_THAN(1,float_solver.iterations());
+        TS_ASSERT_LESS_THAN(float_solver.error(),1e-12);
+        for (int j = 0; j < 2; ++j) {
+            TS_ASSERT_LESS_THAN((A_eigen*X.col(j)-B.col(j)).norm()/B.col(j).norm(),
+                                1e-12);
+        }
+#endif // HAVE_EIGEN
+    }
+
+    void test_sparse_assemble(void) {
+#ifdef HAVE_EIGEN
+        ABORIA_VARIABLE(scalar,double,"scalar")
+
+    	typedef Particles<std::tuple<scalar>,2> ParticlesType;
+        typedef position_d<2> position;
+       	ParticlesType particles;
+
+        const size_t n = 500;
+        const double radius = 0.1;
+        std::default_random_engine gen;
+        std::uniform_real_distribution<double> uniform(0,1);
+        particles.resize(n);
+        for (size_t i=0; i<n; ++i) {
+            get<position>(particles)[i] = vdouble2(uniform(gen),uniform(gen));
+            get<scalar>(particles)[i] = uniform(gen);
+        }
+        particles.init_neighbour_search(vdouble2(0),vdouble2(1),vbool2(false));
+
+        auto kernel = [radius](const vdouble2 &dx,
+                         ParticlesType::const_reference a,
+                         ParticlesType::const_reference b) {
+                    return get<scalar>(a)*get<scalar>(b)*(radius-dx.norm());
+                    };
+
+        auto K = create_sparse_operator(particles,particles,radius,kernel);
+        auto Z = create_zero_operator(particles,particles);
+        auto D = create_dense_operator(particles,particles,kernel);
+        auto Full = create_block_operator<2,2>(K,Z,
+                                               D,K);
+
+        Eigen::VectorXd v = Eigen::VectorXd::Random(2*n);
+        Eigen::VectorXd ans = Full*v;
+
+        Eigen::SparseMatrix<double> Full_csc(2*n,2*n);
+        Full.assemble(Full_csc);
+        Eigen::SparseMatrix<double,Eigen::RowMajor> Full_csr(2*n,2*n);
+        Full.assemble(Full_csr);
+        TS_ASSERT_EQUALS(Full_csc.nonZeros(),Full_csr.nonZeros());
+
+        size_t nnz_K = 0;
+        for (size_t i=0; i<n; ++i) {
+            for (auto tpl: euclidean_search(particles.get_query(),
+                                            get<position>(particles)[i],radius)) {
+                ++nnz_K;
+            }
+        }
+        TS_ASSERT_EQUALS(Full_csr.nonZeros(),2*nnz_K+n*n);
+
+        for (int k=0; k<Full_csr.outerSize(); ++k) {
+            int last_col = -1;
+            for (Eigen::SparseMatrix<double,Eigen::RowMajor>::InnerIterator it(Full_csr,k); it; ++it) {
+                TS_ASSERT_LESS_THAN(last_col,it.col());
+                last_col = it.col();
+                TS_ASSERT_DELTA(it.value(),Full.coeff(it.row(),it.col()),1e-12); 
+            }
+        }
+
+        Eigen::VectorXd ans_csc = Full_csc*v;
+        Eigen::VectorXd ans_csr = Full_csr*v;
+        for (size_t i=0; i<2*n; ++i) {
+            TS_ASSERT_DELTA(ans_csc[i],ans[i],1e-10);
+            TS_ASSERT_DELTA(ans_csr[i],ans[i],1e-10);
+        }
+
+        // with a periodic search and a radius more than half the domain the 
+        // search returns some column particles more than once. These are 
+        // merged into a single entry
+        ParticlesType periodic_particles(n);
+        for (size_t i=0; i<n; ++i) {
+            get<position>(periodic_particles)[i] = vdouble2(uniform(gen),uniform(gen));
+            get<scalar>(periodic_particles)[i] = uniform(gen);
+        }
+        periodic_particles.init_neighbour_search(vdouble2(0),vdouble2(1),vbool2(true));
+        const double periodic_radius = 0.6;
+        auto periodic_kernel = [periodic_radius](const vdouble2 &dx,
+                         ParticlesType::const_reference a,
+                         ParticlesType::const_reference b) {
+                    return get<scalar>(a)*get<scalar>(b)*(periodic_radius-dx.norm());
+                    };
+        auto K_periodic = create_sparse_operator(periodic_particles,periodic_particles,
+                                                 periodic_radius,periodic_kernel);
+        Eigen::VectorXd v_periodic = Eigen::VectorXd::Random(n);
+        Eigen::VectorXd ans_periodic = K_periodic*v_periodic;
+
+        size_t nsearch = 0;
+        for (size_t i=0; i<n; ++i) {
+            for (auto tpl: euclidean_search(periodic_particles.get_query(),
+                                            get<position>(periodic_particles)[i],
+                                            periodic_radius)) {
+                ++nsearch;
+            }
+        }
+        Eigen::SparseMatrix<double> K_periodic_csc(n,n);
+        K_periodic.assemble(K_periodic_csc);
+        Eigen::SparseMatrix<double,Eigen::RowMajor> K_periodic_csr(n,n);
+        K_periodic.assemble(K_periodic_csr);
+        TS_ASSERT_LESS_THAN(K_periodic_csr.nonZeros(),nsearch);
+        TS_ASSERT_EQUALS(K_periodic_csc.nonZeros(),K_periodic_csr.nonZeros());
+        for (int k=0; k<K_periodic_csr.outerSize(); ++k) {
+            int last_col = -1;
+            for (Eigen::SparseMatrix<double,Eigen::RowMajor>::InnerIterator it(K_periodic_csr,k); it; ++it) {
+                TS_ASSERT_LESS_THAN(last_col,it.col());
+                last_col = it.col();
+            }
+        }
+        Eigen::VectorXd ans_periodic_csc = K_periodic_csc*v_periodic;
+        Eigen::VectorXd ans_periodic_csr = K_periodic_csr*v_periodic;
+        for (size_t i=0; i<n; ++i) {
+            TS_ASSERT_DELTA(ans_periodic_csc[i],ans_periodic[i],1e-10);
+            TS_ASSERT_DELTA(ans_periodic_csr[i],ans_periodic[i],1e-10);
+        }
+
+        // blocks without the CSR assembly methods are assembled from triplets
+        typedef KernelTripletsOnly<ParticlesType,ParticlesType,decltype(kernel)> 
+            triplets_kernel_type;
+        typedef MatrixReplacement<1,1,std::tuple<triplets_kernel_type>> 
+            triplets_operator_type;
+        triplets_operator_type T(std::make_tuple(
+                    triplets_kernel_type(particles,particles,kernel)));
+        Eigen::VectorXd v_triplets = Eigen::VectorXd::Random(n);
+        Eigen::VectorXd ans_triplets = T*v_triplets;
+        Eigen::SparseMatrix<double,Eigen::RowMajor> T_csr(n,n);
+        T.assemble(T_csr);
+        TS_ASSERT_EQUALS(T_csr.nonZeros(),n*n);
+        Eigen::VectorXd ans_triplets_csr = T_csr*v_triplets;
+        for (size_t i=0; i<n; ++i) {
+            TS_ASSERT_DELTA(ans_triplets_csr[i],ans_triplets[i],1e-10);
+        }
+#endif // HAVE_EIGEN
+    }
 
 };
 
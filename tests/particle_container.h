@@ -38,6 +38,11 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define PARTICLE_CONTAINER_H_
 
 #include <cxxtest/TestSuite.h>
+#include <random>
+#include <set>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
 
 #include "Level1.h"
 
@@ -105,6 +110,126 @@ public:
     	typename Test_type::value_type p_value = test[0];
     }
 
+    template<template <typename,typename> class V, template <typename> class SearchMethod>
+    void helper_reorder(void) {
+    	typedef Particles<std::tuple<>,3,V,SearchMethod> Test_type;
+        typedef typename Test_type::position position;
+        typedef Vector<double,3> double3;
+        const size_t N = 1000;
+    	Test_type test(N);
+        test.reserve(2*N);
+
+        std::default_random_engine generator;
+        std::uniform_real_distribution<double> uniform(0.0,1.0);
+        std::vector<double3> positions(N);
+        for (size_t i = 0; i < N; ++i) {
+            positions[i] = double3(uniform(generator),uniform(generator),uniform(generator));
+            get<position>(test)[i] = positions[i];
+        }
+        test.init_neighbour_search(double3(0),double3(1),Vector<bool,3>(false));
+
+        // an update with no movement should not move anything
+        std::vector<size_t> ids_before(N);
+        for (size_t i = 0; i < N; ++i) {
+            ids_before[i] = get<id>(test)[i];
+        }
+        test.update_positions();
+        for (size_t i = 0; i < N; ++i) {
+            TS_ASSERT_EQUALS(get<id>(test)[i],ids_before[i]);
+        }
+
+        // move a few particles and check that all the particles are 
+        // still there, with the right positions
+        std::set<const double3*> buffers;
+        for (int step = 0; step < 4; ++step) {
+            for (size_t i = 0; i < N; i += 10) {
+                const size_t particle_id = get<id>(test)[i];
+                const double3 new_position(uniform(generator),uniform(generator),uniform(generator));
+                get<position>(test)[i] = new_position;
+                positions[particle_id] = new_position;
+            }
+            test.update_positions();
+            buffers.insert(&static_cast<const double3&>(get<position>(test)[0]));
+
+            TS_ASSERT_EQUALS(test.size(),N);
+            std::vector<bool> found(N,false);
+            for (size_t i = 0; i < N; ++i) {
+                const size_t particle_id = get<id>(test)[i];
+                TS_ASSERT(!found[particle_id]);
+                found[particle_id] = true;
+                TS_ASSERT((static_cast<double3>(get<position>(test)[i]) 
+                            == positions[particle_id]).all());
+            }
+        }
+
+        // with reserved storage the particles only ever use two buffers
+        TS_ASSERT_LESS_THAN_EQUALS(buffers.size(),2);
+    }
+
+    // creates an empty file with a unique name in the temporary directory
+    static std::string temporary_filename() {
+        const char* dir = std::getenv("TMPDIR");
+        std::string filename = std::string(dir ? dir : "/tmp") + "/aboria_XXXXXX";
+        const int fd = mkstemp(&filename[0]);
+        TS_ASSERT(fd != -1);
+        close(fd);
+        return filename;
+    }
+
+    template<template <typename,typename> class V, template <typename> class SearchMethod>
+    void helper_binary(void) {
+        ABORIA_VARIABLE(scalar,double,"scalar")
+        ABORIA_VARIABLE(count,int,"count")
+    	typedef Particles<std::tuple<scalar,count>,3,V,SearchMethod> Test_type;
+        typedef typename Test_type::position position;
+        typedef Vector<double,3> double3;
+        const size_t N = 1000;
+        const double r = 0.1;
+    	Test_type test(N);
+
+        std::default_random_engine generator;
+        std::uniform_real_distribution<double> uniform(0.0,1.0);
+        for (size_t i = 0; i < N; ++i) {
+            get<position>(test)[i] = double3(uniform(generator),uniform(generator),uniform(generator));
+            get<scalar>(test)[i] = uniform(generator);
+        }
+        test.init_neighbour_search(double3(0),double3(1),Vector<bool,3>(true,false,true));
+        for (size_t i = 0; i < N; ++i) {
+            get<count>(test)[i] = 0;
+            for (auto tpl: euclidean_search(test.get_query(),get<position>(test)[i],r)) {
+                get<count>(test)[i]++;
+            }
+        }
+        const std::string filename = temporary_filename();
+        test.save_binary(filename);
+
+        Test_type loaded;
+        loaded.load_binary(filename);
+        std::remove(filename.c_str());
+        TS_ASSERT_EQUALS(loaded.size(),N);
+        TS_ASSERT((loaded.get_min() == test.get_min()).all());
+        TS_ASSERT((loaded.get_max() == test.get_max()).all());
+        TS_ASSERT((loaded.get_periodic() == test.get_periodic()).all());
+        for (size_t i = 0; i < N; ++i) {
+            TS_ASSERT_EQUALS(get<id>(loaded)[i],get<id>(test)[i]);
+            TS_ASSERT_EQUALS(get<scalar>(loaded)[i],get<scalar>(test)[i]);
+            TS_ASSERT((static_cast<double3>(get<position>(loaded)[i]) == 
+                       static_cast<double3>(get<position>(test)[i])).all());
+
+            // neighbour search is restored
+            int n = 0;
+            for (auto tpl: euclidean_search(loaded.get_query(),get<position>(loaded)[i],r)) {
+                n++;
+            }
+            TS_ASSERT_EQUALS(n,get<count>(loaded)[i]);
+        }
+
+        // new particles continue on from the saved ids
+        loaded.push_back(double3(0.5));
+        test.push_back(double3(0.5));
+        TS_ASSERT_EQUALS(get<id>(loaded)[N],get<id>(test)[N]);
+    }
+
     void test_documentation(void) {
 #if not defined(__CUDACC__)
         //[particle_container
@@ -382,6 +507,8 @@ public:
         helper_add_particle2<std::vector,bucket_search_serial>();
         helper_add_particle2_dimensions<std::vector,bucket_search_serial>();
         helper_add_delete_particle<std::vector,bucket_search_serial>();
+        helper_reorder<std::vector,bucket_search_serial>();
+        helper_binary<std::vector,bucket_search_serial>();
     }
 
     void test_std_vector_bucket_search_parallel(void) {
@@ -389,6 +516,18 @@ public:
         helper_add_particle2<std::vector,bucket_search_parallel>();
         helper_add_particle2_dimensions<std::vector,bucket_search_parallel>();
         helper_add_delete_particle<std::vector,bucket_search_parallel>();
+        helper_reorder<std::vector,bucket_search_parallel>();
+        helper_binary<std::vector,bucket_search_parallel>();
+    }
+
+    void test_std_vector_octtree(void) {
+        helper_binary<std::vector,octtree>();
+    }
+
+    void test_std_vector_nanoflann_adaptor(void) {
+#if not defined(__CUDACC__)
+        helper_binary<std::vector,nanoflann_adaptor>();
+#endif
     }
 
     void test_thrust_vector_bucket_search_parallel(void) {
@@ -378,6 +378,32 @@ void helper_compact(void) {
         gamma = gmres.solve(phi);
         std::cout << "GMRES-RASM:  #iterations: " << gmres.iterations() << ", estimated error: " << gmres.error() << std::endl;
 
+        Eigen::GMRES<matrix_type,  TwoLevelRASMPreconditioner<Eigen::HouseholderQR>> gmres_two_level;
+        gmres_two_level.setMaxIterations(max_iter);
+        gmres_two_level.preconditioner().set_buffer_size(RASM_buffer);
+        gmres_two_level.preconditioner().set_number_of_particles_per_domain(RASM_n);
+        gmres_two_level.preconditioner().analyzePattern(W);
+        gmres_two_level.set_restart(restart);
+        gmres_two_level.compute(W_matrix);
+        gamma = gmres_two_level.solve(phi);
+        std::cout << "GMRES-RASM2: #iterations: " << gmres_two_level.iterations() << ", estimated error: " << gmres_two_level.error() << std::endl;
+        TS_ASSERT_EQUALS(gmres_two_level.info(),Eigen::Success);
+        TS_ASSERT_LESS_THAN_EQUALS(gmres_two_level.iterations(),gmres.iterations());
+
+        // the coarse size is capped independently of the number of particles
+        Eigen::GMRES<matrix_type,  TwoLevelRASMPreconditioner<Eigen::HouseholderQR>> gmres_capped;
+        gmres_capped.setMaxIterations(max_iter);
+        gmres_capped.preconditioner().set_buffer_size(RASM_buffer);
+        gmres_capped.preconditioner().set_number_of_particles_per_domain(RASM_n);
+        gmres_capped.preconditioner().set_max_coarse_size(4);
+        gmres_capped.preconditioner().analyzePattern(W);
+        gmres_capped.set_restart(restart);
+        gmres_capped.compute(W_matrix);
+        gamma = gmres_capped.solve(phi);
+        std::cout << "GMRES-RASM2 (coarse size "<<gmres_capped.preconditioner().get_coarse_size()<<"): #iterations: " << gmres_capped.iterations() << ", estimated error: " << gmres_capped.error() << std::endl;
+        TS_ASSERT_LESS_THAN_EQUALS(gmres_capped.preconditioner().get_coarse_size(),4);
+        TS_ASSERT_EQUALS(gmres_capped.info(),Eigen::Success);
+
         Eigen::DGMRES<matrix_type,  RASMPreconditioner<Eigen::HouseholderQR>> dgmres;
         dgmres.setMaxIterations(max_iter);
         dgmres.preconditioner().set_buffer_size(RASM_buffer);
@@ -434,6 +460,93 @@ void helper_compact(void) {
 #endif // HAVE_EIGEN
     }
 
+template<template <typename> class SearchMethod>
+    void helper_hodlr(void) {
+#ifdef HAVE_EIGEN
+        std::cout << "---------------------\n"<<
+                     "Running hodlr test....\n" <<
+                     "---------------------" << std::endl;
+        auto funct = [](const double x, const double y) { 
+            return std::exp(-9*std::pow(x-0.5,2) - 9*std::pow(y-0.25,2)); 
+        };
+
+    	typedef Particles<std::tuple<>,2,std::vector,SearchMethod> ParticlesType;
+        typedef position_d<2> position;
+        typedef typename ParticlesType::const_reference const_particle_reference;
+        typedef typename position::value_type const & const_position_reference;
+        typedef Eigen::Matrix<double,Eigen::Dynamic,1> vector_type; 
+       	ParticlesType knots;
+
+       	const double c = 10.0;
+        const double c2 = std::pow(c,2);
+        const double sigma = 1e-3;
+        vdouble2 min(0);
+        vdouble2 max(1);
+        vdouble2 periodic(false);
+
+        const int N = 2000;
+        const int max_iter = 100;
+        const int restart = 101;
+        typename ParticlesType::value_type p;
+
+        std::default_random_engine generator;
+        std::uniform_real_distribution<double> distribution(0.0,1.0);
+        for (int i=0; i<N; ++i) {
+            get<position>(p) = vdouble2(distribution(generator),
+                                       distribution(generator));
+            knots.push_back(p);
+        }
+
+        knots.init_neighbour_search(min,max,periodic);
+
+        // gaussian kernel with a small smoothing term on the diagonal
+        auto kernel = [&](const_position_reference dx,
+                         const_particle_reference a,
+                         const_particle_reference b) {
+                            return std::exp(-dx.squaredNorm()*c2) 
+                                + (get<id>(a)==get<id>(b) ? sigma : 0.0);
+                        };
+
+        auto G = create_dense_operator(knots,knots,kernel);
+
+        vector_type phi(N), gamma(N);
+        for (int i=0; i<knots.size(); ++i) {
+            const double x = get<position>(knots[i])[0];
+            const double y = get<position>(knots[i])[1];
+            phi[i] = funct(x,y);
+        }
+
+        // direct solve
+        HODLRSolver<> solver;
+        solver.set_tolerance(1e-10);
+        solver.compute(G);
+        gamma = solver.solve(phi);
+        const double residual = (G*gamma - phi).norm()/phi.norm();
+        std::cout << "HODLR direct: residual = " << residual << std::endl;
+        TS_ASSERT_LESS_THAN(residual,1e-6);
+
+        // as a preconditioner
+        Eigen::GMRES<decltype(G)> gmres;
+        gmres.setMaxIterations(max_iter);
+        gmres.setTolerance(1e-10);
+        gmres.set_restart(restart);
+        gmres.compute(G);
+        gamma = gmres.solve(phi);
+        std::cout << "GMRES:        #iterations: " << gmres.iterations() << ", estimated error: " << gmres.error() << std::endl;
+
+        Eigen::GMRES<decltype(G), HODLRSolver<>> gmres_hodlr;
+        gmres_hodlr.setMaxIterations(max_iter);
+        gmres_hodlr.setTolerance(1e-10);
+        gmres_hodlr.set_restart(restart);
+        gmres_hodlr.preconditioner().set_tolerance(1e-8);
+        gmres_hodlr.compute(G);
+        gamma = gmres_hodlr.solve(phi);
+        std::cout << "GMRES-HODLR:  #iterations: " << gmres_hodlr.iterations() << ", estimated error: " << gmres_hodlr.error() << std::endl;
+        TS_ASSERT_EQUALS(gmres_hodlr.info(),Eigen::Success);
+        TS_ASSERT_LESS_THAN(gmres_hodlr.iterations(),gmres.iterations());
+#endif // HAVE_EIGEN
+    }
+
 template<template <typename> class SearchMethod>
     void helper_h2(void) {
 #ifdef HAVE_EIGEN
@@ -585,6 +698,7 @@ template<template <typename> class SearchMethod>
                      "------------------------------------------" << std::endl;
         helper_global<bucket_search_parallel>();
         helper_compact<bucket_search_parallel>();
+        helper_hodlr<bucket_search_parallel>();
     }
 
     void test_bucket_search_serial() {
@@ -593,6 +707,7 @@ template<template <typename> class SearchMethod>
                      "------------------------------------------" << std::endl;
         helper_global<bucket_search_serial>();
         helper_compact<bucket_search_serial>();
+        helper_hodlr<bucket_search_serial>();
     }
 
     void test_kdtree() {
@@ -601,6 +716,7 @@ template<template <typename> class SearchMethod>
                      "------------------------------------------" << std::endl;
         helper_compact<nanoflann_adaptor>();
         helper_h2<nanoflann_adaptor>();
+        helper_hodlr<nanoflann_adaptor>();
     }
 
     void test_octtree() {
@@ -609,6 +725,7 @@ template<template <typename> class SearchMethod>
                      "------------------------------------------" << std::endl;
         helper_compact<nanoflann_adaptor>();
         helper_h2<octtree>();
+        helper_hodlr<octtree>();
     }
 
 };
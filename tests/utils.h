@@ -38,6 +38,9 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define UTILS_H_
 
 #include <cxxtest/TestSuite.h>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
 
 #include "Aboria.h"
 
@@ -76,6 +79,42 @@ public:
     }
 
 
+    void test_morton_bucket_indicies(void) {
+        typedef Vector<unsigned int,3> vect;
+        detail::bucket_index<3> bi(vect(4,8,2),true);
+        unsigned int index = bi.collapse_index_vector(vect(1,2,1));
+        // bits interleaved from the last dimension, skipping exhausted dims:
+        // index = 1*1 + 0*2 + 1*4 (bit 0) + 1*8 + 0*16 (bit 1) + 0*32 (bit 2) = 13
+    	TS_ASSERT_EQUALS(index,13);
+        vect vindex = bi.reassemble_index_vector(index);
+    	TS_ASSERT_EQUALS(vindex[0],1);
+    	TS_ASSERT_EQUALS(vindex[1],2);
+    	TS_ASSERT_EQUALS(vindex[2],1);
+
+        // check that the morton index is a bijection onto [0,size.prod())
+        std::vector<bool> found(bi.m_size.prod(),false);
+        for (unsigned int i = 0; i < 4; ++i) {
+            for (unsigned int j = 0; j < 8; ++j) {
+                for (unsigned int k = 0; k < 2; ++k) {
+                    const unsigned int index = bi.collapse_index_vector(vect(i,j,k));
+                    TS_ASSERT_LESS_THAN(index,bi.m_size.prod());
+                    TS_ASSERT(!found[index]);
+                    found[index] = true;
+                    vect vindex = bi.reassemble_index_vector(index);
+                    TS_ASSERT_EQUALS(vindex[0],i);
+                    TS_ASSERT_EQUALS(vindex[1],j);
+                    TS_ASSERT_EQUALS(vindex[2],k);
+                }
+            }
+        }
+
+        TS_ASSERT_EQUALS(detail::round_down_to_power_of_two(0),1);
+        TS_ASSERT_EQUALS(detail::round_down_to_power_of_two(1),1);
+        TS_ASSERT_EQUALS(detail::round_down_to_power_of_two(7),4);
+        TS_ASSERT_EQUALS(detail::round_down_to_power_of_two(8),8);
+    }
+
+
     void test_point_to_bucket_indicies(void) {
         const unsigned int D = 3;
         vdouble3 min(0,0,0);
@@ -114,6 +153,79 @@ public:
 
     }
 
+    // creates an empty file with a unique name in the temporary directory
+    static std::string temporary_filename() {
+        const char* dir = std::getenv("TMPDIR");
+        std::string filename = std::string(dir ? dir : "/tmp") + "/aboria_XXXXXX";
+        const int fd = mkstemp(&filename[0]);
+        TS_ASSERT(fd != -1);
+        close(fd);
+        return filename;
+    }
+
+    template <bool Asynchronous>
+    void helper_trajectory(const double position_step) {
+        ABORIA_VARIABLE(velocity,vdouble3,"velocity")
+        typedef Particles<std::tuple<velocity>,3> ParticlesType;
+        typedef typename ParticlesType::position position;
+        const size_t N = 1000;
+        const int n_frames = 10;
+        const double dt = 1e-3;
+        ParticlesType particles(N);
+        std::default_random_engine generator;
+        std::uniform_real_distribution<double> uniform(0.0,1.0);
+        for (size_t i = 0; i < N; ++i) {
+            get<position>(particles)[i] = vdouble3(uniform(generator),uniform(generator),uniform(generator));
+            get<velocity>(particles)[i] = vdouble3(uniform(generator),uniform(generator),uniform(generator));
+        }
+
+        // store the frames to check against
+        std::vector<std::vector<vdouble3>> positions(n_frames,std::vector<vdouble3>(N));
+        const std::string filename = temporary_filename();
+        {
+            TrajectoryWriter<ParticlesType,position,velocity> writer(
+                    filename,position_step,Asynchronous);
+            for (int frame = 0; frame < n_frames; ++frame) {
+                for (size_t i = 0; i < N; ++i) {
+                    positions[frame][i] = get<position>(particles)[i];
+                }
+                writer.write(particles,frame*dt);
+                for (size_t i = 0; i < N; ++i) {
+                    get<position>(particles)[i] += dt*get<velocity>(particles)[i];
+                }
+            }
+        }
+
+        std::ifstream file(filename,std::ios::binary | std::ios::ate);
+        const size_t raw_size = n_frames*N*(sizeof(size_t)+2*sizeof(vdouble3));
+        std::cout << "trajectory file size = "<<file.tellg()<<" bytes, uncompressed = "<<raw_size<<" bytes"<<std::endl;
+        TS_ASSERT_LESS_THAN(size_t(file.tellg()),raw_size);
+
+        ParticlesType read_particles;
+        TrajectoryReader<ParticlesType,position,velocity> reader(filename);
+        int frame = 0;
+        while (reader.read(read_particles)) {
+            TS_ASSERT_EQUALS(reader.get_time(),frame*dt);
+            TS_ASSERT_EQUALS(read_particles.size(),N);
+            for (size_t i = 0; i < N; ++i) {
+                TS_ASSERT_EQUALS(get<id>(read_particles)[i],get<id>(particles)[i]);
+                TS_ASSERT((static_cast<vdouble3>(get<velocity>(read_particles)[i]) == 
+                           static_cast<vdouble3>(get<velocity>(particles)[i])).all());
+                const vdouble3 error = abs(get<position>(read_particles)[i]-positions[frame][i]);
+                TS_ASSERT_LESS_THAN_EQUALS(error.maxCoeff(),0.5*position_step);
+            }
+            ++frame;
+        }
+        TS_ASSERT_EQUALS(frame,n_frames);
+        std::remove(filename.c_str());
+    }
+
+    void test_trajectory(void) {
+        helper_trajectory<true>(0);
+        helper_trajectory<true>(1e-6);
+        helper_trajectory<false>(1e-6);
+    }
+
     void test_low_rank(void) {
 #ifdef HAVE_EIGEN
         const unsigned int D = 2;